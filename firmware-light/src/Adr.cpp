@@ -0,0 +1,151 @@
+#include "Adr.h"
+#include "Airtime.h"
+#include "MacCommands.h"
+#include <string.h>
+
+void AdrState::reset()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+int16_t AdrEngine::requiredSnr(uint8_t spreadingFactor)
+{
+    // -7.5 dB at SF7, 2.5 dB lower for every step up to -20 dB at SF12
+    return -30 - 10 * (spreadingFactor - 7);
+}
+
+bool AdrEngine::uplink(AdrState *state, uint8_t spreadingFactor, int8_t snr, uint8_t length, bool adr)
+{
+    if (!enabled)
+    {
+        return false;
+    }
+
+    if (state->baseline == 0)
+    {
+        state->baseline = spreadingFactor;
+    }
+
+    if (state->spreadingFactor != spreadingFactor)
+    {
+        // The SNR at another spreading factor says nothing about this one
+        state->spreadingFactor = spreadingFactor;
+        state->count = 0;
+        state->next = 0;
+    }
+
+    state->frames++;
+    state->airtimeSaved += (int32_t)loraAirtime(state->baseline, length) - (int32_t)loraAirtime(spreadingFactor, length);
+
+    state->snr[state->next] = snr;
+    state->next = (state->next + 1) % ADR_HISTORY;
+    if (state->count < ADR_HISTORY)
+    {
+        state->count++;
+    }
+
+    if (pending(state))
+    {
+        if (state->retries == 0)
+        {
+            // No answer to any of the requests, start over
+            state->requestSF = 0;
+            state->count = 0;
+            state->next = 0;
+            return false;
+        }
+        return adr;
+    }
+
+    if (!adr || state->count < ADR_HISTORY)
+    {
+        return false;
+    }
+
+    _decide(state);
+    return pending(state);
+}
+
+uint8_t AdrEngine::request(AdrState *state, uint8_t *fOpts, uint8_t room)
+{
+    if (!pending(state) || state->retries == 0 || room < ADR_REQUEST_LENGTH)
+    {
+        return 0;
+    }
+
+    fOpts[0] = MAC_LINK_ADR;
+    fOpts[1] = (12 - state->requestSF) << 4 | (state->requestPower & 0x0f); // DR0 is SF12 in EU868
+    fOpts[2] = channelMask & 0xff;
+    fOpts[3] = channelMask >> 8;
+    fOpts[4] = 0x01; // ChMaskCntl 0, NbTrans 1
+
+    state->retries--;
+    return ADR_REQUEST_LENGTH;
+}
+
+void AdrEngine::answer(AdrState *state, uint8_t status)
+{
+    if (!pending(state))
+    {
+        return;
+    }
+
+    // Power, data rate and channel mask ACK
+    if ((status & 0x07) == 0x07)
+    {
+        state->power = state->requestPower;
+    }
+
+    // Measure again with the new settings, or retry later after a NAck
+    state->requestSF = 0;
+    state->count = 0;
+    state->next = 0;
+}
+
+void AdrEngine::_decide(AdrState *state)
+{
+    int16_t best = state->snr[0];
+    for (uint8_t i = 1; i < state->count; i++)
+    {
+        if (state->snr[i] > best)
+        {
+            best = state->snr[i];
+        }
+    }
+
+    int16_t margin = best - requiredSnr(state->spreadingFactor) - ADR_MARGIN;
+    int16_t steps = margin >= 0 ? margin / ADR_STEP : -((ADR_STEP - 1 - margin) / ADR_STEP);
+
+    uint8_t spreadingFactor = state->spreadingFactor;
+    uint8_t power = state->power;
+
+    while (steps > 0 && spreadingFactor > minSF)
+    {
+        spreadingFactor--;
+        steps--;
+    }
+
+    while (steps > 0 && power < ADR_MAX_POWER)
+    {
+        power++;
+        steps--;
+    }
+
+    while (steps < 0 && power > 0)
+    {
+        power--;
+        steps++;
+    }
+
+    if (spreadingFactor > maxSF)
+    {
+        spreadingFactor = maxSF;
+    }
+
+    if (spreadingFactor != state->spreadingFactor || power != state->power)
+    {
+        state->requestSF = spreadingFactor;
+        state->requestPower = power;
+        state->retries = ADR_RETRIES;
+    }
+}
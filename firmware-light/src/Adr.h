@@ -0,0 +1,75 @@
+#ifndef ADR_H
+#define ADR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef ADR_HISTORY
+#define ADR_HISTORY 20 // Uplinks in the window before a decision
+#endif
+
+#define ADR_MARGIN 40     // Installation margin in steps of 0.25 dB, 10 dB
+#define ADR_STEP 12       // 3 dB per step of spreading factor or power
+#define ADR_MAX_POWER 5   // Highest TXPower index, max EIRP - 10 dB in EU868
+#define ADR_RETRIES 3     // Downlinks with a LinkADRReq before giving up
+#define ADR_REQUEST_LENGTH 5
+
+// ADR state of one device. Kept in the device table, zeroed by reset().
+class AdrState
+{
+public:
+    int8_t snr[ADR_HISTORY]; // Of the last uplinks, in steps of 0.25 dB
+    uint8_t count;           // Valid entries in snr
+    uint8_t next;            // Entry written by the next uplink
+
+    uint8_t spreadingFactor; // Of the last uplink
+    uint8_t baseline;        // Spreading factor of the first uplink
+    uint8_t power;           // TXPower index the device uses, 0 is max
+
+    uint8_t requestSF;    // Requested settings, 0 if nothing pending
+    uint8_t requestPower;
+    uint8_t retries;      // Left for the pending request
+
+    uint32_t frames;
+    int32_t airtimeSaved; // Micros less on air than at the baseline spreading factor
+
+    void reset();
+};
+
+// Adaptive data rate, after the reference algorithm of Semtech. Keeps the
+// best SNR of the last ADR_HISTORY uplinks of a device, and asks the device
+// with a LinkADRReq in FOpts to lower its spreading factor, then its power,
+// as long as the margin above the demodulation floor allows. A device that
+// runs out of margin is given its power back.
+class AdrEngine
+{
+public:
+    bool enabled = true;
+    uint8_t minSF = 7; // Spreading factors we receive on
+    uint8_t maxSF = 12;
+    uint16_t channelMask = 0x0001; // ChMask of the LinkADRReq
+
+    // Record an uplink received with snr. length is the whole frame.
+    // With adr set the device allows changing its settings, returns true if
+    // a LinkADRReq should go out with the next downlink.
+    bool uplink(AdrState *state, uint8_t spreadingFactor, int8_t snr, uint8_t length, bool adr);
+
+    // Write the pending LinkADRReq to fOpts. Returns the bytes written, 0 if
+    // nothing is pending or it does not fit in room.
+    uint8_t request(AdrState *state, uint8_t *fOpts, uint8_t room);
+
+    // LinkADRAns of the device.
+    static void answer(AdrState *state, uint8_t status);
+
+    static bool pending(AdrState *state) { return state->requestSF != 0; }
+
+    // Demodulation floor of spreading factor, in steps of 0.25 dB.
+    static int16_t requiredSnr(uint8_t spreadingFactor);
+
+private:
+    void _decide(AdrState *state);
+};
+
+#else
+#error "ADR_H not defined"
+#endif
@@ -0,0 +1,23 @@
+#include "Airtime.h"
+
+uint32_t loraSymbolTime(uint8_t spreadingFactor, uint32_t bandwidth)
+{
+    return ((uint64_t)1000000 << spreadingFactor) / bandwidth;
+}
+
+uint32_t loraAirtime(uint8_t spreadingFactor, uint8_t length, uint32_t bandwidth, uint8_t codingRate)
+{
+    // Semtech AN1200.13, in quarter symbols for the 4.25 symbols after the preamble
+    uint8_t lowDataRate = loraSymbolTime(spreadingFactor, bandwidth) >= 16000 ? 1 : 0;
+    int32_t bits = 8 * length - 4 * spreadingFactor + 28 + 16;
+    int32_t bitsPerBlock = 4 * (spreadingFactor - 2 * lowDataRate);
+    int32_t blocks = bits > 0 ? (bits + bitsPerBlock - 1) / bitsPerBlock : 0;
+    uint32_t quarterSymbols = (LORA_PREAMBLE_SYMBOLS * 4 + 17) + (8 + blocks * codingRate) * 4;
+
+    return ((uint64_t)quarterSymbols * 1000000 << spreadingFactor) / bandwidth / 4;
+}
+
+uint32_t loraPreambleTime(uint8_t spreadingFactor, uint32_t bandwidth)
+{
+    return ((uint64_t)(LORA_PREAMBLE_SYMBOLS * 4 + 17) * 1000000 << spreadingFactor) / bandwidth / 4;
+}
@@ -0,0 +1,23 @@
+#ifndef AIRTIME_H
+#define AIRTIME_H
+
+#include <stdint.h>
+
+#define LORA_BANDWIDTH 125000 // Hz, all EU868 data rates used here
+#define LORA_PREAMBLE_SYMBOLS 8
+#define LORA_CODING_RATE 5 // 4/5
+
+// Duration of one LoRa symbol in micros.
+uint32_t loraSymbolTime(uint8_t spreadingFactor, uint32_t bandwidth = LORA_BANDWIDTH);
+
+// Time on air of a frame of length bytes in micros, with explicit header,
+// CRC and low data rate optimization from SF11 at 125 kHz, like the LoRaWAN
+// defaults. codingRate is the denominator of the coding rate, 5 to 8.
+uint32_t loraAirtime(uint8_t spreadingFactor, uint8_t length, uint32_t bandwidth = LORA_BANDWIDTH, uint8_t codingRate = LORA_CODING_RATE);
+
+// Time from the start of a frame to the end of its preamble, sync word and start of frame delimiter.
+uint32_t loraPreambleTime(uint8_t spreadingFactor, uint32_t bandwidth = LORA_BANDWIDTH);
+
+#else
+#error "AIRTIME_H not defined"
+#endif
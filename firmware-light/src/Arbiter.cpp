@@ -0,0 +1,104 @@
+#include "Arbiter.h"
+#include <string.h>
+
+void Arbiter::begin(uint8_t sender)
+{
+    _sender = sender;
+}
+
+bool Arbiter::claim(const uint8_t *uplink, uint8_t length, int16_t rssi, uint32_t rxDone, DoorLinkClaim *claim)
+{
+    // Unconfirmed or confirmed data up with at least MHDR, FHDR and MIC
+    uint8_t type = uplink[0] >> 5;
+    if (window == 0 || (type != 2 && type != 4) || length < 12)
+    {
+        return false;
+    }
+
+    memcpy(claim->devAddr, &uplink[1], 4);
+    claim->fCnt = uplink[6] | uplink[7] << 8;
+    claim->rssi = rssi;
+
+    _own = *claim;
+    _rxDone = rxDone;
+    _active = true;
+    claims++;
+    return true;
+}
+
+void Arbiter::receive(uint8_t sender, const DoorLinkClaim *claim, uint32_t now)
+{
+    if (sender == _sender)
+    {
+        return;
+    }
+    heard++;
+
+    if (_active && _same(claim, &_own) && !_inWindow(now))
+    {
+        late++;
+        return;
+    }
+
+    // Kept even when not claimed yet, another light may handle the uplink sooner
+    Entry *entry = &_entries[_next];
+    entry->valid = true;
+    entry->sender = sender;
+    entry->claim = *claim;
+    entry->time = now;
+    _next = (_next + 1) % ARBITER_CLAIMS;
+}
+
+ArbiterDecision Arbiter::decide(uint32_t now, uint32_t *wait)
+{
+    if (!_active)
+    {
+        return ARBITER_IDLE;
+    }
+
+    int32_t left = (int32_t)(_rxDone + window - now);
+    if (left > 0)
+    {
+        *wait = left;
+        return ARBITER_WAIT;
+    }
+    _active = false;
+
+    int16_t best = _own.rssi;
+    _winner = _sender;
+    for (uint8_t i = 0; i < ARBITER_CLAIMS; i++)
+    {
+        Entry *entry = &_entries[i];
+        if (!entry->valid || !_same(&entry->claim, &_own) || !_inWindow(entry->time))
+        {
+            continue;
+        }
+
+        if (entry->claim.rssi > best || (entry->claim.rssi == best && entry->sender < _winner))
+        {
+            best = entry->claim.rssi;
+            _winner = entry->sender;
+        }
+    }
+
+    if (_winner == _sender)
+    {
+        won++;
+        return ARBITER_ANSWER;
+    }
+    yielded++;
+    return ARBITER_YIELD;
+}
+
+bool Arbiter::_same(const DoorLinkClaim *a, const DoorLinkClaim *b)
+{
+    return a->fCnt == b->fCnt && memcmp(a->devAddr, b->devAddr, 4) == 0;
+}
+
+bool Arbiter::_inWindow(uint32_t time)
+{
+    // Around RxDone, so an earlier claim of the same FCnt, e.g. before a
+    // retransmission of the uplink, does not count
+    int32_t offset = (int32_t)(time - _rxDone);
+    return offset >= -(int32_t)window && offset <= (int32_t)window;
+}
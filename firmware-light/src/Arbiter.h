@@ -0,0 +1,83 @@
+#ifndef ARBITER_H
+#define ARBITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "DoorLink.h"
+
+#define ARBITER_WINDOW 100000UL // Micros after RxDone claims are collected, well before RX1 at 1 s
+#define ARBITER_CLAIMS 8        // Claims of other lights kept
+
+enum ArbiterDecision : uint8_t
+{
+    ARBITER_IDLE = 0, // Nothing claimed, answer as usual
+    ARBITER_WAIT,     // Claimed, decide again after the returned wait time
+    ARBITER_ANSWER,   // This light heard the uplink best, send the downlink
+    ARBITER_YIELD,    // Another light heard it better and answers, drop the downlink
+};
+
+// Elects the one light that answers an uplink heard by several lights, so
+// their downlinks do not collide in RX1. A light that wants to answer
+// broadcasts a claim with the DevAddr, FCnt and RSSI of the uplink, and
+// collects the claims of the others until window micros after RxDone. The
+// best RSSI answers, the lowest sender on a tie. A lost claim makes both
+// lights answer, as without arbitration. Only the downlink is arbitrated,
+// every light still handles the uplink. A light that yields drops its
+// response with LoRaWanP2P::responseDropped(), which keeps what the
+// response carried for the next uplink. Times are micros().
+class Arbiter
+{
+public:
+    uint32_t window = ARBITER_WINDOW; // 0 always answers, without claims
+
+    uint32_t claims = 0;  // Uplinks this light claimed
+    uint32_t won = 0;
+    uint32_t yielded = 0;
+    uint32_t heard = 0;   // Claims of other lights received
+    uint32_t late = 0;    // Claims of other lights received after the window
+
+    // sender is the id of this light on the link, unique among the lights.
+    void begin(uint8_t sender);
+
+    // This light wants to answer uplink, a data frame received at rxDone
+    // with rssi. Writes the claim to broadcast to claim, returns false if the
+    // uplink is not arbitrated, e.g. a join request.
+    bool claim(const uint8_t *uplink, uint8_t length, int16_t rssi, uint32_t rxDone, DoorLinkClaim *claim);
+
+    // Claim of another light, received at now.
+    void receive(uint8_t sender, const DoorLinkClaim *claim, uint32_t now);
+
+    // Decide on the last claim at time now. ARBITER_ANSWER and ARBITER_YIELD
+    // are returned once, at the end of the window. On ARBITER_WAIT, wait is
+    // set to the number of micros until then.
+    ArbiterDecision decide(uint32_t now, uint32_t *wait);
+
+    // Sender of the best claim of the last decision.
+    uint8_t winner() { return _winner; }
+
+private:
+    struct Entry
+    {
+        bool valid;
+        uint8_t sender;
+        DoorLinkClaim claim;
+        uint32_t time; // micros() when received
+    };
+
+    uint8_t _sender = 0;
+    uint8_t _winner = 0;
+
+    bool _active = false; // _own waits for a decision
+    DoorLinkClaim _own;
+    uint32_t _rxDone = 0;
+
+    Entry _entries[ARBITER_CLAIMS] = {};
+    uint8_t _next = 0; // Oldest entry, replaced next
+
+    static bool _same(const DoorLinkClaim *a, const DoorLinkClaim *b);
+    bool _inWindow(uint32_t time);
+};
+
+#else
+#error "ARBITER_H not defined"
+#endif
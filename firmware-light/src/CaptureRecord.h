@@ -0,0 +1,28 @@
+//
+//  CaptureRecord.h
+//  Record format of the raw frame capture (see FrameCapture.h). Kept free of
+//  Arduino dependencies, so the host replay tool can read captures too.
+//
+
+#ifndef CAPTURERECORD_H
+#define CAPTURERECORD_H
+
+#include <stdint.h>
+
+#define CAPTURE_MAX_FRAME 64
+#define CAPTURE_LINE_PREFIX "capture " // Prefix of a record in the serial dump
+
+typedef struct __attribute__((packed)) struct_capture_record
+{
+    uint32_t sequence; // Starts at 1, 0 is an empty slot
+    uint32_t time;     // millis() at reception
+    int16_t rssi;      // dBm
+    int8_t snr;        // In steps of 0.25 dB
+    uint8_t outcome;   // LoRaWanResult of parseMessage()
+    uint8_t length;
+    uint8_t frame[CAPTURE_MAX_FRAME];
+} struct_capture_record;
+
+#else
+#error "CAPTURERECORD_H not defined"
+#endif
@@ -0,0 +1,125 @@
+#include "ChannelScanner.h"
+#include "Airtime.h"
+#include <string.h>
+
+bool ChannelScanner::begin(const uint32_t *frequencies, uint8_t numChannels, uint8_t minSF, uint8_t maxSF, uint8_t maxFrame, uint32_t now)
+{
+    if (numChannels == 0 || numChannels > SCAN_MAX_CHANNELS || minSF < SCAN_MIN_SF || maxSF > SCAN_MAX_SF || minSF > maxSF)
+    {
+        return false;
+    }
+
+    _frequencies = frequencies;
+    _numChannels = numChannels;
+    _minSF = minSF;
+    _numSlots = numChannels * (maxSF - minSF + 1);
+    _maxFrame = maxFrame;
+    _slot = 0;
+    _locked = false;
+    _cycleStart = now;
+    reset();
+    return true;
+}
+
+uint32_t ChannelScanner::frequency()
+{
+    return _frequencies[_slot % _numChannels];
+}
+
+uint8_t ChannelScanner::spreadingFactor()
+{
+    return _minSF + _slot / _numChannels;
+}
+
+ScanAction ChannelScanner::cadDone(bool detected, uint32_t now)
+{
+    if (_locked)
+    {
+        return SCAN_NONE;
+    }
+
+    ScanStats *stats = &_stats[_slot];
+    stats->cads++;
+    if (detected)
+    {
+        stats->detections++;
+        _locked = true;
+        _lockedAt = now;
+        return SCAN_RECEIVE;
+    }
+
+    _next(now);
+    return SCAN_CAD;
+}
+
+void ChannelScanner::received(uint32_t now)
+{
+    if (!_locked)
+    {
+        return;
+    }
+
+    _stats[_slot].frames++;
+    _locked = false;
+    _next(now);
+}
+
+void ChannelScanner::cancel(uint32_t now)
+{
+    if (_locked)
+    {
+        _locked = false;
+        _next(now);
+    }
+}
+
+ScanAction ChannelScanner::poll(uint32_t now)
+{
+    // Detected somewhere in the preamble, so wait for all of it and the longest frame
+    if (!_locked || now - _lockedAt < loraAirtime(spreadingFactor(), _maxFrame))
+    {
+        return SCAN_NONE;
+    }
+
+    _stats[_slot].timeouts++;
+    _locked = false;
+    _next(now);
+    return SCAN_CAD;
+}
+
+ScanStats ChannelScanner::stats(uint8_t channel, uint8_t spreadingFactor)
+{
+    ScanStats empty = {};
+    if (channel >= _numChannels || spreadingFactor < _minSF)
+    {
+        return empty;
+    }
+
+    uint16_t slot = (spreadingFactor - _minSF) * _numChannels + channel;
+    return slot < _numSlots ? _stats[slot] : empty;
+}
+
+void ChannelScanner::reset()
+{
+    memset(_stats, 0, sizeof(_stats));
+    cycles = 0;
+    cycleTime = 0;
+    maxCycleTime = 0;
+}
+
+void ChannelScanner::_next(uint32_t now)
+{
+    if (++_slot < _numSlots)
+    {
+        return;
+    }
+
+    _slot = 0;
+    cycles++;
+    cycleTime = now - _cycleStart;
+    if (cycleTime > maxCycleTime)
+    {
+        maxCycleTime = cycleTime;
+    }
+    _cycleStart = now;
+}
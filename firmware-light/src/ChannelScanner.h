@@ -0,0 +1,83 @@
+#ifndef CHANNELSCANNER_H
+#define CHANNELSCANNER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_MAX_CHANNELS 8 // EU868 default plus the 5 extra channels of the LDS02
+#define SCAN_MIN_SF 7
+#define SCAN_MAX_SF 12
+#define SCAN_SPREADING_FACTORS (SCAN_MAX_SF - SCAN_MIN_SF + 1)
+
+enum ScanAction : uint8_t
+{
+    SCAN_NONE = 0, // Keep the radio as it is
+    SCAN_CAD,      // Start CAD on frequency() and spreadingFactor()
+    SCAN_RECEIVE,  // Preamble detected, receive on the current channel
+};
+
+typedef struct ScanStats
+{
+    uint32_t cads;
+    uint32_t detections;
+    uint32_t frames;   // Detections that turned into a frame
+    uint32_t timeouts; // Detections without a frame
+} ScanStats;
+
+// Round robin channel activity detection over a set of channels and
+// spreading factors. Every slot, one channel at one spreading factor, gets
+// a CAD. When it detects a preamble the radio stays on that slot and
+// receives until a frame arrives or the longest frame would have ended.
+// Slots go by spreading factor first, so consecutive CADs only retune the
+// frequency. Times are in micros.
+class ChannelScanner
+{
+public:
+    // Scan frequencies from minSF to maxSF. Frames are at most maxFrame bytes.
+    bool begin(const uint32_t *frequencies, uint8_t numChannels, uint8_t minSF, uint8_t maxSF, uint8_t maxFrame, uint32_t now);
+
+    // Current slot
+    uint32_t frequency();
+    uint8_t spreadingFactor();
+    uint8_t channel() { return _slot % _numChannels; }
+    bool locked() { return _locked; }
+
+    // CAD of the current slot finished.
+    ScanAction cadDone(bool detected, uint32_t now);
+
+    // Frame received on the current slot. Continue with the next one.
+    void received(uint32_t now);
+
+    // Stop receiving on the current slot, e.g. to transmit, without counting a timeout.
+    void cancel(uint32_t now);
+
+    // Returns SCAN_CAD when a receive timed out.
+    ScanAction poll(uint32_t now);
+
+    ScanStats stats(uint8_t channel, uint8_t spreadingFactor);
+    void reset();
+
+    uint32_t cycles = 0;       // Full passes over all slots
+    uint32_t cycleTime = 0;    // Duration of the last pass
+    uint32_t maxCycleTime = 0; // Longest pass, including the time spent receiving
+
+private:
+    const uint32_t *_frequencies = NULL;
+    uint8_t _numChannels = 1;
+    uint8_t _minSF = SCAN_MIN_SF;
+    uint8_t _numSlots = 1;
+    uint8_t _slot = 0;
+    uint8_t _maxFrame = 0;
+
+    bool _locked = false;
+    uint32_t _lockedAt = 0;
+    uint32_t _cycleStart = 0;
+
+    ScanStats _stats[SCAN_MAX_CHANNELS * SCAN_SPREADING_FACTORS];
+
+    void _next(uint32_t now);
+};
+
+#else
+#error "CHANNELSCANNER_H not defined"
+#endif
@@ -0,0 +1,265 @@
+#include "CounterJournal.h"
+
+bool CounterJournal::begin(const char *path, uint32_t size)
+{
+    strncpy(_path, path, sizeof(_path) - 1);
+    _path[sizeof(_path) - 1] = '\0';
+    _size = size;
+    _count = 0;
+
+    if (!LittleFS.begin())
+    {
+        return false;
+    }
+
+    // Replay the journal, the last record of a device wins. Stop at the
+    // first invalid record, a write that was cut off by a reset.
+    uint32_t records = 0;
+    bool clean = true;
+    File file = LittleFS.open(_path, "r");
+    if (file)
+    {
+        struct_journal_record record;
+        while (file.read((uint8_t *)&record, sizeof(record)) == sizeof(record))
+        {
+            if (record.crc != _crc((uint8_t *)&record, sizeof(record) - 2))
+            {
+                clean = false;
+                break;
+            }
+
+            if (record.type == JOURNAL_STATS)
+            {
+                writes = record.fCntUp;
+                compactions = record.fCntDown;
+            }
+            else if (record.type == JOURNAL_COUNTERS)
+            {
+                Entry *entry = _find(record.devAddr);
+                if (!entry && _count < JOURNAL_DEVICES)
+                {
+                    entry = &_entries[_count++];
+                    memcpy(entry->devAddr, record.devAddr, 4);
+                }
+                if (entry)
+                {
+                    entry->fCntUp = record.fCntUp;
+                    entry->fCntDown = record.fCntDown;
+                    entry->dirty = false;
+                }
+            }
+            records++;
+        }
+
+        clean = clean && records * sizeof(record) == file.size();
+        file.close();
+    }
+    writes += records;
+
+    // Never append behind a damaged record
+    if (!clean && !_compact())
+    {
+        _damaged = true; // Compacted by the next sync()
+        return false;
+    }
+
+    _file = LittleFS.open(_path, "a");
+    return (bool)_file;
+}
+
+bool CounterJournal::load(uint8_t *devAddr, uint32_t *fCntUp, uint32_t *fCntDown)
+{
+    Entry *entry = _find(devAddr);
+    if (!entry)
+    {
+        return false;
+    }
+
+    *fCntUp = entry->fCntUp;
+    *fCntDown = entry->fCntDown;
+    return true;
+}
+
+bool CounterJournal::append(uint8_t *devAddr, uint32_t fCntUp, uint32_t fCntDown)
+{
+    Entry *entry = _find(devAddr);
+    if (!entry)
+    {
+        if (_count >= JOURNAL_DEVICES)
+        {
+            return false;
+        }
+        entry = &_entries[_count++];
+        memcpy(entry->devAddr, devAddr, 4);
+    }
+    else if (entry->fCntUp == fCntUp && entry->fCntDown == fCntDown)
+    {
+        return true;
+    }
+
+    entry->fCntUp = fCntUp;
+    entry->fCntDown = fCntDown;
+    entry->dirty = true;
+    _dirty = true;
+    _failed = false;
+    return true;
+}
+
+bool CounterJournal::sync()
+{
+    if (!_dirty || (_failed && millis() - _failedAt < JOURNAL_RETRY_DELAY))
+    {
+        return true;
+    }
+    syncs++;
+
+    if (_sync())
+    {
+        return true;
+    }
+    failures++;
+    _failed = true;
+    _failedAt = millis();
+    return false;
+}
+
+bool CounterJournal::_sync()
+{
+    uint32_t changed = 0;
+    for (uint16_t i = 0; i < _count; i++)
+    {
+        changed += _entries[i].dirty;
+    }
+
+    // Full, or behind a failed write that may have left part of a record
+    if (!_file || _damaged || _file.size() + changed * sizeof(struct_journal_record) > _size)
+    {
+        // Start over with only the latest counters
+        if (_file)
+        {
+            _file.close();
+        }
+        bool compacted = _compact();
+        _file = LittleFS.open(_path, "a");
+        return compacted && _file;
+    }
+
+    struct_journal_record record;
+    for (uint16_t i = 0; i < _count; i++)
+    {
+        Entry *entry = &_entries[i];
+        if (!entry->dirty)
+        {
+            continue;
+        }
+
+        record.type = JOURNAL_COUNTERS;
+        memcpy(record.devAddr, entry->devAddr, 4);
+        record.fCntUp = entry->fCntUp;
+        record.fCntDown = entry->fCntDown;
+        if (_write(&record))
+        {
+            entry->dirty = false;
+        }
+        else
+        {
+            _damaged = true;
+        }
+    }
+    _file.flush();
+
+    _dirty = false;
+    for (uint16_t i = 0; i < _count; i++)
+    {
+        _dirty |= _entries[i].dirty;
+    }
+    return !_dirty;
+}
+
+float CounterJournal::wear(uint32_t fsSize, uint32_t blockSize)
+{
+    float erases = (float)writes + (float)compactions * JOURNAL_COMPACTION_ERASES;
+    return fsSize ? erases * blockSize / fsSize : 0;
+}
+
+CounterJournal::Entry *CounterJournal::_find(uint8_t *devAddr)
+{
+    for (uint16_t i = 0; i < _count; i++)
+    {
+        if (memcmp(_entries[i].devAddr, devAddr, 4) == 0)
+        {
+            return &_entries[i];
+        }
+    }
+    return NULL;
+}
+
+bool CounterJournal::_write(struct_journal_record *record)
+{
+    record->reserved = 0;
+    record->crc = _crc((uint8_t *)record, sizeof(*record) - 2);
+    if (_file.write((uint8_t *)record, sizeof(*record)) != sizeof(*record))
+    {
+        return false;
+    }
+    writes++;
+    return true;
+}
+
+bool CounterJournal::_compact()
+{
+    // Write the snapshot next to the journal and swap it in, so a reset
+    // halfway leaves the old journal intact
+    char tmp[sizeof(_path) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", _path);
+
+    _file = LittleFS.open(tmp, "w");
+    if (!_file)
+    {
+        return false;
+    }
+
+    struct_journal_record record = {};
+    record.type = JOURNAL_STATS;
+    record.fCntUp = writes;
+    record.fCntDown = ++compactions;
+    bool written = _write(&record);
+
+    for (uint16_t i = 0; i < _count; i++)
+    {
+        record.type = JOURNAL_COUNTERS;
+        memcpy(record.devAddr, _entries[i].devAddr, 4);
+        record.fCntUp = _entries[i].fCntUp;
+        record.fCntDown = _entries[i].fCntDown;
+        written &= _write(&record);
+    }
+    _file.close();
+
+    // The old journal stays until the new one is complete
+    if (!written || !LittleFS.rename(tmp, _path))
+    {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < _count; i++)
+    {
+        _entries[i].dirty = false;
+    }
+    _dirty = false;
+    _damaged = false;
+    return true;
+}
+
+uint16_t CounterJournal::_crc(const uint8_t *data, uint8_t length)
+{
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < length; i++)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
@@ -0,0 +1,104 @@
+#ifndef COUNTERJOURNAL_H
+#define COUNTERJOURNAL_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+
+// Devices the journal keeps counters of, at least DEVICE_TABLE_SIZE. Follows
+// DEVICE_TABLE_SIZE when that is set as build flag.
+#ifndef JOURNAL_DEVICES
+#ifdef DEVICE_TABLE_SIZE
+#define JOURNAL_DEVICES DEVICE_TABLE_SIZE
+#else
+#define JOURNAL_DEVICES 16
+#endif
+#endif
+
+#define JOURNAL_RATED_CYCLES 100000 // Erase cycles a flash block is rated for
+#define JOURNAL_COMPACTION_ERASES 2 // Blocks erased by a compaction: the new file and the rename
+#define JOURNAL_RETRY_DELAY 60000UL // Millis after a failed sync before it is tried again without a new change
+
+enum JournalRecordType : uint8_t
+{
+    JOURNAL_COUNTERS = 1, // Frame counters of devAddr
+    JOURNAL_STATS = 2,    // First record after a compaction: fCntUp = records written before it, fCntDown = compactions
+};
+
+typedef struct __attribute__((packed)) struct_journal_record
+{
+    uint8_t type;
+    uint8_t devAddr[4];
+    uint32_t fCntUp;
+    uint32_t fCntDown;
+    uint8_t reserved;
+    uint16_t crc; // CRC-16/CCITT of the bytes before it
+} struct_journal_record;
+
+// Append only journal of the frame counters of every device. Every change
+// is a 16 byte record appended to a file on LittleFS. LittleFS is copy on
+// write: every sync copies the partly written last block of the file to a
+// freshly erased block (a file small enough to be inlined is rewritten in
+// its metadata pair instead), so a sync costs about one block erase, not
+// 16 bytes. Batching changes into few syncs is what saves the flash. When
+// the file reaches its size, the latest counters are written to a fresh
+// file. At boot the last valid record of every device gives its exact
+// counters.
+class CounterJournal
+{
+public:
+    uint32_t writes = 0;      // Records written, over the life of the journal
+    uint32_t compactions = 0; // Over the life of the journal
+    uint32_t syncs = 0;       // Since boot
+    uint32_t failures = 0;    // Syncs since boot that could not write every change
+
+    bool begin(const char *path, uint32_t size);
+
+    // Counters of devAddr found at boot. Returns false if there are none.
+    bool load(uint8_t *devAddr, uint32_t *fCntUp, uint32_t *fCntDown);
+
+    // Remember new counters. Only touches RAM, write them with sync().
+    // Returns false if the journal is full of other devices.
+    bool append(uint8_t *devAddr, uint32_t fCntUp, uint32_t fCntDown);
+
+    // Write the counters changed since the last sync. Returns false if a
+    // write failed. A failed sync is only tried again on the next counter
+    // change or after JOURNAL_RETRY_DELAY, so a failing block is not written
+    // on every call. It starts a fresh file, behind a write that was cut off.
+    bool sync();
+    bool dirty() { return _dirty; }
+
+    // Estimated erase cycles used by every block of a file system of fsSize
+    // bytes in blocks of blockSize, LittleFS spreads the erases over all its
+    // blocks. One erase per sync, and every record is counted as a sync of
+    // its own, as syncs are not kept over reboots, so this is an upper bound.
+    float wear(uint32_t fsSize, uint32_t blockSize);
+
+private:
+    struct Entry
+    {
+        uint8_t devAddr[4];
+        uint32_t fCntUp;
+        uint32_t fCntDown;
+        bool dirty;
+    };
+
+    char _path[32];
+    uint32_t _size = 0;
+    File _file;
+    Entry _entries[JOURNAL_DEVICES];
+    uint16_t _count = 0;
+    bool _dirty = false;
+    bool _failed = false;   // Wait for a change or the retry delay
+    uint32_t _failedAt = 0; // millis() of the last failure
+    bool _damaged = false;  // A write failed, the file may end in part of a record
+
+    Entry *_find(uint8_t *devAddr);
+    bool _sync();
+    bool _write(struct_journal_record *record);
+    bool _compact();
+    static uint16_t _crc(const uint8_t *data, uint8_t length);
+};
+
+#else
+#error "COUNTERJOURNAL_H not defined"
+#endif
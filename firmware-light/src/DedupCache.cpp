@@ -0,0 +1,54 @@
+#include "DedupCache.h"
+
+// FNV-1a
+static uint32_t hash(uint32_t value, const uint8_t *data, uint8_t length)
+{
+    for (uint8_t i = 0; i < length; i++)
+    {
+        value ^= data[i];
+        value *= 16777619;
+    }
+    return value;
+}
+
+uint32_t DedupCache::key(const uint8_t *devAddr, uint16_t fCnt, const uint8_t *mic)
+{
+    uint8_t counter[2] = {(uint8_t)fCnt, (uint8_t)(fCnt >> 8)};
+    uint32_t value = hash(2166136261UL, devAddr, 4);
+    value = hash(value, counter, 2);
+    return hash(value, mic, 4);
+}
+
+bool DedupCache::seen(uint32_t key, uint32_t now)
+{
+    if (expiry == 0)
+    {
+        return false;
+    }
+
+    lookups++;
+    for (uint8_t i = 0; i < DEDUP_CACHE_SIZE; i++)
+    {
+        Entry *entry = &_entries[i];
+        if (entry->valid && entry->key == key && now - entry->time < expiry)
+        {
+            hits++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void DedupCache::add(uint32_t key, uint32_t now)
+{
+    if (expiry == 0)
+    {
+        return;
+    }
+
+    Entry *entry = &_entries[_next];
+    entry->valid = true;
+    entry->key = key;
+    entry->time = now;
+    _next = (_next + 1) % DEDUP_CACHE_SIZE;
+}
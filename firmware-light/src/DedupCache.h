@@ -0,0 +1,42 @@
+#ifndef DEDUPCACHE_H
+#define DEDUPCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEDUP_CACHE_SIZE 16 // Frames remembered, over all devices
+#define DEDUP_EXPIRY 2000   // Millis a frame is remembered. A device resends a confirmed frame later than this.
+
+// Frames received a moment ago, to drop copies of the same transmission,
+// e.g. heard by another light too and passed on. A frame is known by a hash
+// of its DevAddr, FCnt and MIC as on air, so a copy is found before any AES
+// work. Only add frames with a valid MIC, so junk can not push them out.
+class DedupCache
+{
+public:
+    uint32_t expiry = DEDUP_EXPIRY; // 0 remembers nothing
+
+    uint32_t lookups = 0;
+    uint32_t hits = 0;
+
+    static uint32_t key(const uint8_t *devAddr, uint16_t fCnt, const uint8_t *mic);
+
+    // Whether key was added less than expiry millis before now.
+    bool seen(uint32_t key, uint32_t now);
+    void add(uint32_t key, uint32_t now);
+
+private:
+    struct Entry
+    {
+        bool valid;
+        uint32_t key;
+        uint32_t time; // millis() when added
+    };
+
+    Entry _entries[DEDUP_CACHE_SIZE] = {};
+    uint8_t _next = 0; // Oldest entry, replaced next
+};
+
+#else
+#error "DEDUPCACHE_H not defined"
+#endif
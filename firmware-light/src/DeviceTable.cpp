@@ -0,0 +1,138 @@
+#include "DeviceTable.h"
+#include <string.h>
+
+LoRaWanDevice *DeviceTable::add(uint8_t *devAddr, uint8_t *nwkSKey, uint8_t *appSKey, uint8_t id)
+{
+    bool found;
+    int index = _search(_address(devAddr), &found);
+
+    if (!found)
+    {
+        if (_count >= DEVICE_TABLE_SIZE)
+        {
+            return NULL;
+        }
+
+        // Keep the table sorted
+        memmove(&_devices[index + 1], &_devices[index], (_count - index) * sizeof(LoRaWanDevice));
+        _count++;
+
+        LoRaWanDevice *device = &_devices[index];
+        memcpy(device->devAddr, devAddr, 4);
+        device->fCntUp = 0;
+        device->fCntDown = 0;
+        device->allowFCntReset = true;
+        device->dirty = false;
+        device->adr.reset();
+        device->mac.reset();
+    }
+
+    LoRaWanDevice *device = &_devices[index];
+    memcpy(device->nwkSKey, nwkSKey, 16);
+    memcpy(device->appSKey, appSKey, 16);
+    device->id = id;
+
+    invalidate(device);
+    return device;
+}
+
+LoRaWanDevice *DeviceTable::find(uint8_t *devAddr)
+{
+    bool found;
+    int index = _search(_address(devAddr), &found);
+    return found ? &_devices[index] : NULL;
+}
+
+LoRaWanSession *DeviceTable::session(LoRaWanDevice *device)
+{
+    uint32_t address = _address(device->devAddr);
+    LoRaWanSession *victim = &_sessions[0];
+
+    _clock++;
+
+    for (uint8_t i = 0; i < DEVICE_CONTEXT_CACHE_SIZE; i++)
+    {
+        LoRaWanSession *session = &_sessions[i];
+        if (session->valid && session->address == address)
+        {
+            session->lastUsed = _clock;
+            return session;
+        }
+
+        // Least recently used, empty slots first
+        if (victim->valid && (!session->valid || session->lastUsed < victim->lastUsed))
+        {
+            victim = session;
+        }
+    }
+
+    victim->address = address;
+    AES_Setup(&victim->appSKey, device->appSKey);
+    AES_Setup(&victim->nwkSKey, device->nwkSKey);
+    victim->valid = true;
+    victim->lastUsed = _clock;
+    return victim;
+}
+
+LoRaWanSession *DeviceTable::nextSession()
+{
+    for (uint8_t i = 0; i < DEVICE_CONTEXT_CACHE_SIZE; i++)
+    {
+        LoRaWanSession *session = &_sessions[_nextSession];
+        _nextSession = (_nextSession + 1) % DEVICE_CONTEXT_CACHE_SIZE;
+
+        if (session->valid)
+        {
+            return session;
+        }
+    }
+    return NULL;
+}
+
+void DeviceTable::invalidate(LoRaWanDevice *device)
+{
+    uint32_t address = _address(device->devAddr);
+    for (uint8_t i = 0; i < DEVICE_CONTEXT_CACHE_SIZE; i++)
+    {
+        if (_sessions[i].address == address)
+        {
+            _sessions[i].valid = false;
+        }
+    }
+}
+
+uint32_t DeviceTable::_address(uint8_t *devAddr)
+{
+    return (uint32_t)devAddr[0] << 24 | (uint32_t)devAddr[1] << 16 | (uint32_t)devAddr[2] << 8 | devAddr[3];
+}
+
+// Binary search. Returns the index of the device, or the index to insert it at.
+int DeviceTable::_search(uint32_t address, bool *found)
+{
+    int low = 0;
+    int high = _count;
+
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        uint32_t value = _address(_devices[mid].devAddr);
+
+        if (value == address)
+        {
+            *found = true;
+            return mid;
+        }
+
+        if (value < address)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    *found = false;
+    return low;
+}
@@ -0,0 +1,85 @@
+#ifndef DEVICETABLE_H
+#define DEVICETABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "KeystreamCache.h"
+#include "Adr.h"
+#include "MacCommands.h"
+
+// Maximum number of devices. Every device costs 92 bytes, so 256 devices use 23 KB.
+#ifndef DEVICE_TABLE_SIZE
+#define DEVICE_TABLE_SIZE 16
+#endif
+
+// Number of devices that keep their expanded keys in RAM. Each slot costs
+// two AES contexts. Devices outside the cache are expanded on their next frame.
+#ifndef DEVICE_CONTEXT_CACHE_SIZE
+#define DEVICE_CONTEXT_CACHE_SIZE 4
+#endif
+
+class LoRaWanDevice
+{
+public:
+    uint8_t devAddr[4];
+    uint8_t appSKey[16];
+    uint8_t nwkSKey[16];
+
+    uint32_t fCntUp;
+    uint32_t fCntDown;
+
+    uint8_t id;          // Chosen by the user, e.g. the led segment of this device
+    bool allowFCntReset; // Accept FCnt 0 once, set until the first valid frame after boot
+    bool dirty;          // Counters changed since the last onSave, see LoRaWanP2P::flush()
+
+    AdrState adr;        // Not persisted, ADR starts over after a reboot
+    MacState mac;
+};
+
+class LoRaWanSession
+{
+public:
+    uint32_t address; // DevAddr of the device these contexts belong to
+    AES_Context appSKey;
+    AES_Context nwkSKey;
+
+    bool valid;
+    uint32_t lastUsed;
+};
+
+// Sorted table of all devices, looked up by DevAddr with a binary search.
+// Frames for unknown addresses can therefore be dropped before any AES work.
+class DeviceTable
+{
+public:
+    // Add a device or replace the keys of an existing one. Returns NULL if the table is full.
+    LoRaWanDevice *add(uint8_t *devAddr, uint8_t *nwkSKey, uint8_t *appSKey, uint8_t id);
+    LoRaWanDevice *find(uint8_t *devAddr);
+
+    uint16_t count() { return _count; }
+    LoRaWanDevice *get(uint16_t index) { return index < _count ? &_devices[index] : NULL; }
+
+    // Expanded session keys of a device, built on a cache miss.
+    LoRaWanSession *session(LoRaWanDevice *device);
+
+    // Next cached session, cycling through the cache. NULL if empty.
+    LoRaWanSession *nextSession();
+
+    // Drop the cached contexts after the keys of a device changed.
+    void invalidate(LoRaWanDevice *device);
+
+private:
+    LoRaWanDevice _devices[DEVICE_TABLE_SIZE];
+    uint16_t _count = 0;
+
+    LoRaWanSession _sessions[DEVICE_CONTEXT_CACHE_SIZE] = {};
+    uint32_t _clock = 0;
+    uint8_t _nextSession = 0;
+
+    static uint32_t _address(uint8_t *devAddr);
+    int _search(uint32_t address, bool *found);
+};
+
+#else
+#error "DEVICETABLE_H not defined"
+#endif
@@ -0,0 +1,162 @@
+#include "DownlinkQueue.h"
+#include <string.h>
+
+uint32_t DownlinkQueue::_address(uint8_t *devAddr)
+{
+    return (uint32_t)devAddr[0] << 24 | (uint32_t)devAddr[1] << 16 | (uint32_t)devAddr[2] << 8 | devAddr[3];
+}
+
+bool DownlinkQueue::add(uint8_t *devAddr, uint8_t port, const uint8_t *payload, uint8_t length, bool confirmed, uint32_t now)
+{
+    if (length > DOWNLINK_MAX_PAYLOAD || depth(devAddr) >= DOWNLINK_QUEUE_DEPTH)
+    {
+        rejected++;
+        return false;
+    }
+
+    for (uint8_t i = 0; i < DOWNLINK_QUEUE_SIZE; i++)
+    {
+        QueuedDownlink *downlink = &_downlinks[i];
+        if (downlink->used)
+        {
+            continue;
+        }
+
+        downlink->used = true;
+        downlink->taken = false;
+        downlink->sent = false;
+        downlink->address = _address(devAddr);
+        downlink->sequence = _sequence++;
+        downlink->queued = now;
+        downlink->port = port;
+        downlink->confirmed = confirmed;
+        downlink->attempts = 0;
+        downlink->length = length;
+        memcpy(downlink->payload, payload, length);
+
+        queued++;
+        uint8_t total = depth();
+        if (total > maxDepth)
+        {
+            maxDepth = total;
+        }
+        return true;
+    }
+
+    rejected++;
+    return false;
+}
+
+QueuedDownlink *DownlinkQueue::next(uint8_t *devAddr)
+{
+    uint32_t address = _address(devAddr);
+    QueuedDownlink *oldest = NULL;
+    for (uint8_t i = 0; i < DOWNLINK_QUEUE_SIZE; i++)
+    {
+        QueuedDownlink *downlink = &_downlinks[i];
+        if (downlink->used && downlink->address == address &&
+            (!oldest || (int32_t)(downlink->sequence - oldest->sequence) < 0))
+        {
+            oldest = downlink;
+        }
+    }
+    return oldest;
+}
+
+uint8_t DownlinkQueue::depth(uint8_t *devAddr)
+{
+    uint32_t address = _address(devAddr);
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < DOWNLINK_QUEUE_SIZE; i++)
+    {
+        if (_downlinks[i].used && _downlinks[i].address == address)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+uint8_t DownlinkQueue::depth()
+{
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < DOWNLINK_QUEUE_SIZE; i++)
+    {
+        if (_downlinks[i].used)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+void DownlinkQueue::uplink(uint8_t *devAddr, bool ack, uint32_t now)
+{
+    QueuedDownlink *downlink = next(devAddr);
+    if (!downlink || !downlink->sent)
+    {
+        return;
+    }
+
+    if (ack)
+    {
+        _delivered(downlink, now);
+    }
+    else if (downlink->attempts >= DOWNLINK_RETRIES)
+    {
+        failed++;
+        downlink->used = false;
+    }
+    else
+    {
+        // Lost, goes out again with the downlink to this uplink
+        downlink->sent = false;
+    }
+}
+
+void DownlinkQueue::take(QueuedDownlink *downlink)
+{
+    downlink->taken = true;
+}
+
+QueuedDownlink *DownlinkQueue::taken(uint8_t *devAddr)
+{
+    QueuedDownlink *downlink = next(devAddr);
+    return downlink && downlink->taken ? downlink : NULL;
+}
+
+void DownlinkQueue::sent(QueuedDownlink *downlink, uint32_t now)
+{
+    downlink->taken = false;
+    if (downlink->attempts > 0)
+    {
+        retransmits++;
+    }
+    downlink->attempts++;
+
+    if (downlink->confirmed)
+    {
+        downlink->sent = true;
+    }
+    else
+    {
+        _delivered(downlink, now);
+    }
+}
+
+void DownlinkQueue::returned(QueuedDownlink *downlink)
+{
+    downlink->taken = false;
+}
+
+void DownlinkQueue::_delivered(QueuedDownlink *downlink, uint32_t now)
+{
+    uint32_t latency = now - downlink->queued;
+    latencyTotal += latency;
+    if (latency > latencyMax)
+    {
+        latencyMax = latency;
+    }
+    delivered++;
+    downlink->used = false;
+}
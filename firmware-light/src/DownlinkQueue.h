@@ -0,0 +1,81 @@
+#ifndef DOWNLINKQUEUE_H
+#define DOWNLINKQUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DOWNLINK_QUEUE_SIZE 8   // Downlinks queued over all devices
+#define DOWNLINK_QUEUE_DEPTH 4  // Downlinks queued per device
+#define DOWNLINK_MAX_PAYLOAD 32 // Fits in one frame next to a full FOpts
+#define DOWNLINK_RETRIES 3      // Sends of a confirmed downlink before it failed
+
+typedef struct QueuedDownlink
+{
+    bool used;
+    bool taken; // In a response that is not transmitted yet
+    bool sent;  // Confirmed and waiting for the ACK in the next uplink
+    uint32_t address;
+    uint32_t sequence; // Order of adding
+    uint32_t queued;   // millis() when added
+    uint8_t port;
+    bool confirmed;
+    uint8_t attempts;
+    uint8_t length;
+    uint8_t payload[DOWNLINK_MAX_PAYLOAD];
+} QueuedDownlink;
+
+// Application downlinks waiting for the next uplink of their device, as a
+// class A device only listens right after it sent. One pool is shared by all
+// devices, each device has its downlinks sent in order. A downlink put in a
+// response is taken, and only counts as sent once the radio transmitted the
+// response. An unconfirmed downlink is done once sent, a confirmed one once
+// the device ACKs it in its next uplink, and is sent again when that uplink
+// has no ACK. Times are millis().
+class DownlinkQueue
+{
+public:
+    uint32_t queued = 0;
+    uint32_t delivered = 0;   // Sent, and ACKed if confirmed
+    uint32_t failed = 0;      // Confirmed, but not ACKed after DOWNLINK_RETRIES sends
+    uint32_t rejected = 0;    // Queue full, or too long
+    uint32_t retransmits = 0;
+    uint32_t latencyTotal = 0; // Millis from adding to delivery, over all delivered
+    uint32_t latencyMax = 0;
+    uint8_t maxDepth = 0; // Most downlinks queued at the same time
+
+    // Add a downlink for devAddr. Returns false if it does not fit.
+    bool add(uint8_t *devAddr, uint8_t port, const uint8_t *payload, uint8_t length, bool confirmed, uint32_t now);
+
+    // Oldest downlink of devAddr, NULL if there is none.
+    QueuedDownlink *next(uint8_t *devAddr);
+
+    // Downlinks queued for devAddr, or in total.
+    uint8_t depth(uint8_t *devAddr);
+    uint8_t depth();
+
+    // devAddr sent an uplink, with or without the ACK bit.
+    void uplink(uint8_t *devAddr, bool ack, uint32_t now);
+
+    // downlink, returned by next(), is in a response about to be sent.
+    void take(QueuedDownlink *downlink);
+
+    // Downlink of devAddr taken for a response, NULL if there is none.
+    QueuedDownlink *taken(uint8_t *devAddr);
+
+    // downlink, returned by next() or taken(), was sent.
+    void sent(QueuedDownlink *downlink, uint32_t now);
+
+    // downlink, taken for a response that was not sent, stays queued as it was.
+    void returned(QueuedDownlink *downlink);
+
+private:
+    QueuedDownlink _downlinks[DOWNLINK_QUEUE_SIZE] = {};
+    uint32_t _sequence = 0;
+
+    static uint32_t _address(uint8_t *devAddr);
+    void _delivered(QueuedDownlink *downlink, uint32_t now);
+};
+
+#else
+#error "DOWNLINKQUEUE_H not defined"
+#endif
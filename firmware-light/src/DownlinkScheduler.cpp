@@ -0,0 +1,97 @@
+#include "DownlinkScheduler.h"
+#include <string.h>
+
+bool DownlinkScheduler::schedule(const uint8_t *buffer, uint8_t length, uint32_t rxDone, uint32_t rxDelay)
+{
+    if (_pending || length > DOWNLINK_MAX_LENGTH)
+    {
+        dropped++;
+        return false;
+    }
+
+    memcpy(_buffer, buffer, length);
+    _length = length;
+    _target = rxDone + rxDelay;
+    _rx2 = false;
+    _pending = true;
+    return true;
+}
+
+DownlinkAction DownlinkScheduler::poll(uint32_t now, uint32_t *wait)
+{
+    if (!_pending)
+    {
+        return DOWNLINK_IDLE;
+    }
+
+    // Signed differences, so this keeps working when micros() wraps
+    int32_t early = (int32_t)(_target - lead - now);
+    if (early > 0)
+    {
+        *wait = early;
+        return DOWNLINK_WAIT;
+    }
+
+    if ((int32_t)(now + lead - _target) <= (int32_t)DOWNLINK_LATE_LIMIT)
+    {
+        return _rx2 ? DOWNLINK_SEND_RX2 : DOWNLINK_SEND_RX1;
+    }
+
+    if (_rx2)
+    {
+        // Too late for both windows
+        _pending = false;
+        missed++;
+        return DOWNLINK_MISSED;
+    }
+
+    // RX1 is gone, try again in RX2
+    _rx2 = true;
+    _target += DOWNLINK_RX2_DELAY;
+    return poll(now, wait);
+}
+
+void DownlinkScheduler::sent(uint32_t now)
+{
+    // Move the lead a quarter of the way to the measured latency
+    int32_t error = (int32_t)(now - _target);
+    int32_t newLead = (int32_t)lead + error / 4;
+    if (newLead < 0)
+    {
+        newLead = 0;
+    }
+    else if (newLead > (int32_t)DOWNLINK_MAX_LEAD)
+    {
+        newLead = DOWNLINK_MAX_LEAD;
+    }
+    lead = newLead;
+
+    if (_rx2)
+    {
+        sentRX2++;
+    }
+    else
+    {
+        sentRX1++;
+    }
+    _pending = false;
+}
+
+void DownlinkScheduler::skip()
+{
+    if (!_pending)
+    {
+        return;
+    }
+
+    if (_rx2)
+    {
+        _pending = false;
+        suppressed++;
+        return;
+    }
+
+    _rx2 = true;
+    _target += DOWNLINK_RX2_DELAY;
+    deferred++;
+}
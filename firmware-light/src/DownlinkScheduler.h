@@ -0,0 +1,71 @@
+#ifndef DOWNLINKSCHEDULER_H
+#define DOWNLINKSCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DOWNLINK_MAX_LENGTH 64
+#define DOWNLINK_RX2_DELAY 1000000UL // RX2 opens 1 s after RX1
+#define DOWNLINK_LATE_LIMIT 10000UL  // Give up on a window when this late, ~2 symbols at SF9
+#define DOWNLINK_MAX_LEAD 20000UL    // Upper bound of the calibrated latency
+
+enum DownlinkAction : uint8_t
+{
+    DOWNLINK_IDLE = 0, // Nothing pending
+    DOWNLINK_WAIT,     // Pending, poll again after the returned wait time
+    DOWNLINK_SEND_RX1, // Transmit now on the uplink channel
+    DOWNLINK_SEND_RX2, // Transmit now on the RX2 channel
+    DOWNLINK_MISSED,   // Both windows were missed, the downlink is dropped
+};
+
+// Times a single downlink into the receive windows of the device, without
+// blocking. All times are micros(). The time between the due time and the
+// radio actually starting to transmit is measured by sent() and subtracted
+// from later due times, so timer and SPI latency do not make us late.
+class DownlinkScheduler
+{
+public:
+    uint32_t lead = 0; // Calibrated latency from poll() to transmit, in micros
+
+    uint32_t sentRX1 = 0;
+    uint32_t sentRX2 = 0;
+    uint32_t missed = 0;
+    uint32_t dropped = 0;    // Rejected because another downlink was pending
+    uint32_t deferred = 0;   // Moved from RX1 to RX2 by skip()
+    uint32_t suppressed = 0; // Dropped by skip() in RX2
+
+    // Queue a downlink for RX1 at rxDone + rxDelay. Returns false if another
+    // downlink is still pending or the buffer is too long.
+    bool schedule(const uint8_t *buffer, uint8_t length, uint32_t rxDone, uint32_t rxDelay);
+
+    // Decide what to do at time now. On DOWNLINK_WAIT, wait is set to the
+    // number of micros until the next poll.
+    DownlinkAction poll(uint32_t now, uint32_t *wait);
+
+    // The radio started transmitting the downlink returned by poll() at time now.
+    void sent(uint32_t now);
+
+    // The window returned by poll() can not be used, e.g. because there is no
+    // duty cycle budget left. RX1 moves to RX2, RX2 drops the downlink.
+    void skip();
+
+    // Drop the pending downlink, e.g. because another light sends it.
+    void cancel() { _pending = false; }
+
+    bool rx2() { return _rx2; }
+
+    bool pending() { return _pending; }
+    const uint8_t *buffer() { return _buffer; }
+    uint8_t length() { return _length; }
+
+private:
+    uint8_t _buffer[DOWNLINK_MAX_LENGTH];
+    uint8_t _length = 0;
+    bool _pending = false;
+    bool _rx2 = false;
+    uint32_t _target = 0; // Opening of the current window
+};
+
+#else
+#error "DOWNLINKSCHEDULER_H not defined"
+#endif
@@ -0,0 +1,99 @@
+#include "DutyCycle.h"
+
+typedef struct struct_duty_band
+{
+    uint32_t low; // Hz
+    uint32_t high;
+    uint16_t permille;
+} struct_duty_band;
+
+static const struct_duty_band dutyBands[DUTY_BANDS] = {
+    {863000000, 868000000, 10},
+    {868000000, 868600000, 10},
+    {868700000, 869200000, 1},
+    {869400000, 869650000, 100},
+    {869700000, 870000000, 10},
+};
+
+uint8_t DutyCycle::band(uint32_t frequency)
+{
+    for (uint8_t band = 0; band < DUTY_BANDS; band++)
+    {
+        if (frequency >= dutyBands[band].low && frequency < dutyBands[band].high)
+        {
+            return band;
+        }
+    }
+    return DUTY_BANDS;
+}
+
+uint32_t DutyCycle::budget(uint8_t band)
+{
+    // Millis of the window times permille gives micros
+    return band < DUTY_BANDS ? DUTY_WINDOW * dutyBands[band].permille : 0;
+}
+
+bool DutyCycle::allowed(uint32_t frequency, uint32_t airtime, uint32_t now)
+{
+    return airtime <= remaining(band(frequency), now);
+}
+
+void DutyCycle::add(uint32_t frequency, uint32_t airtime, uint32_t now)
+{
+    uint8_t b = band(frequency);
+    if (b >= DUTY_BANDS)
+    {
+        return;
+    }
+
+    _advance(now);
+    _airtime[b][_current] += airtime;
+}
+
+uint32_t DutyCycle::remaining(uint8_t band, uint32_t now)
+{
+    if (band >= DUTY_BANDS)
+    {
+        return 0;
+    }
+
+    _advance(now);
+    uint32_t used = _used(band);
+    uint32_t limit = budget(band);
+    return used < limit ? limit - used : 0;
+}
+
+void DutyCycle::_advance(uint32_t now)
+{
+    // Clear the slots that left the window. Unsigned differences, so this
+    // keeps working when millis() wraps.
+    uint32_t passed = (now - _slotStart) / DUTY_SLOT_TIME;
+    if (passed == 0)
+    {
+        return;
+    }
+    _slotStart += passed * DUTY_SLOT_TIME;
+
+    if (passed > DUTY_SLOTS)
+    {
+        passed = DUTY_SLOTS + 1;
+    }
+    for (uint32_t i = 0; i < passed; i++)
+    {
+        _current = (_current + 1) % (DUTY_SLOTS + 1);
+        for (uint8_t band = 0; band < DUTY_BANDS; band++)
+        {
+            _airtime[band][_current] = 0;
+        }
+    }
+}
+
+uint32_t DutyCycle::_used(uint8_t band)
+{
+    uint32_t used = 0;
+    for (uint8_t i = 0; i <= DUTY_SLOTS; i++)
+    {
+        used += _airtime[band][i];
+    }
+    return used;
+}
@@ -0,0 +1,54 @@
+#ifndef DUTYCYCLE_H
+#define DUTYCYCLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DUTY_WINDOW 3600000UL // Observation time in millis, one hour
+#define DUTY_SLOTS 12         // The window is kept in slots of 5 minutes
+#define DUTY_SLOT_TIME (DUTY_WINDOW / DUTY_SLOTS)
+
+// EU868 sub-bands of ETSI EN 300 220 used by LoRaWAN
+enum DutyBand : uint8_t
+{
+    DUTY_BAND_G = 0, // 863.0 - 868.0 MHz, 1%
+    DUTY_BAND_G1,    // 868.0 - 868.6 MHz, 1%, RX1 of the default channels
+    DUTY_BAND_G2,    // 868.7 - 869.2 MHz, 0.1%
+    DUTY_BAND_G3,    // 869.4 - 869.65 MHz, 10%, RX2
+    DUTY_BAND_G4,    // 869.7 - 870.0 MHz, 1%
+    DUTY_BANDS,
+};
+
+// Airtime spent per sub-band over the last hour, against the duty cycle
+// limit of the band. Airtime is in micros, times are millis(). The hour is
+// kept in DUTY_SLOTS slots plus the current one, so a transmission counts for
+// between one hour and one hour and a slot.
+class DutyCycle
+{
+public:
+    // Band of frequency, DUTY_BANDS if we may not transmit there.
+    static uint8_t band(uint32_t frequency);
+
+    // Whether airtime fits in what is left of the budget of the band of frequency.
+    bool allowed(uint32_t frequency, uint32_t airtime, uint32_t now);
+
+    // Airtime was spent on frequency.
+    void add(uint32_t frequency, uint32_t airtime, uint32_t now);
+
+    // Airtime left in the budget of band.
+    uint32_t remaining(uint8_t band, uint32_t now);
+
+    static uint32_t budget(uint8_t band);
+
+private:
+    uint32_t _airtime[DUTY_BANDS][DUTY_SLOTS + 1] = {};
+    uint32_t _slotStart = 0; // millis() at the start of the current slot
+    uint8_t _current = 0;    // Index of the current slot
+
+    void _advance(uint32_t now);
+    uint32_t _used(uint8_t band);
+};
+
+#else
+#error "DUTYCYCLE_H not defined"
+#endif
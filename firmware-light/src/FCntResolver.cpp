@@ -0,0 +1,49 @@
+#include "FCntResolver.h"
+
+uint8_t FCntResolver::resolve(uint32_t last, bool allowReset, uint16_t fCnt, uint32_t *candidates, bool *old)
+{
+    uint8_t count = 0;
+    *old = false;
+
+    // Nothing received from this device yet, no window to keep to
+    if (last == 0)
+    {
+        candidates[count++] = fCnt;
+        return count;
+    }
+
+    // The first counter from last on with these lower bits
+    bool wrapped = false;
+    uint32_t next = (last & 0xFFFF0000) | fCnt;
+    if (next < last)
+    {
+        next += 0x10000;
+        wrapped = true;
+    }
+
+    if (next - last <= maxGap)
+    {
+        candidates[count++] = next;
+    }
+
+    // The device started over, e.g. after a new battery
+    if (allowReset && fCnt == 0 && next != 0)
+    {
+        candidates[count++] = 0;
+    }
+
+    if (count == 0)
+    {
+        // Far ahead after wrapping is most likely a frame from the past
+        *old = wrapped;
+        if (wrapped)
+        {
+            behind++;
+        }
+        else
+        {
+            ahead++;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,34 @@
+#ifndef FCNTRESOLVER_H
+#define FCNTRESOLVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FCNT_MAX_GAP 16384     // MAX_FCNT_GAP of LoRaWAN 1.0
+#define FCNT_MAX_CANDIDATES 2
+
+// Finds the full 32 bit frame counter of an uplink, of which only the lower
+// 16 bits are sent. Every guess costs a CMAC, so only counters from the last
+// one received up to maxGap ahead are tried, the most likely first. Frames
+// outside that window are rejected before any AES work.
+class FCntResolver
+{
+public:
+    uint32_t maxGap = FCNT_MAX_GAP; // Frames a device may be ahead of the last one received
+
+    uint32_t cmacs = 0;    // MICs computed to resolve counters
+    uint32_t accepted = 0; // Frames whose counter was resolved
+    uint32_t behind = 0;   // Rejected before any MIC: older than the last frame
+    uint32_t ahead = 0;    // Rejected before any MIC: more than maxGap ahead
+
+    // Write the possible counters of a frame with the lower bits fCnt to
+    // candidates, most likely first. last is the counter of the last frame
+    // received, allowReset also allows a device that started over at 0.
+    // Returns the number of candidates, 0 if the frame is outside the window,
+    // with old set if it is behind.
+    uint8_t resolve(uint32_t last, bool allowReset, uint16_t fCnt, uint32_t *candidates, bool *old);
+};
+
+#else
+#error "FCNTRESOLVER_H not defined"
+#endif
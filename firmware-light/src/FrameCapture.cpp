@@ -0,0 +1,115 @@
+#include "FrameCapture.h"
+
+bool FrameCapture::begin(const char *path, uint16_t capacity)
+{
+    _capacity = capacity;
+
+    if (!LittleFS.begin())
+    {
+        return false;
+    }
+
+    size_t size = (size_t)capacity * sizeof(struct_capture_record);
+    _file = LittleFS.open(path, "r+");
+    if (!_file || _file.size() != size)
+    {
+        // Create the file at full size, so the ring never grows
+        if (_file)
+        {
+            _file.close();
+        }
+
+        _file = LittleFS.open(path, "w+");
+        if (!_file)
+        {
+            return false;
+        }
+
+        memset(&_record, 0, sizeof(_record));
+        for (uint16_t i = 0; i < capacity; i++)
+        {
+            _file.write((uint8_t *)&_record, sizeof(_record));
+        }
+        _file.flush();
+    }
+
+    // Continue after the newest record
+    _sequence = 0;
+    for (uint16_t slot = 0; slot < capacity; slot++)
+    {
+        uint32_t sequence;
+        _file.seek(slot * sizeof(struct_capture_record));
+        if (_file.read((uint8_t *)&sequence, 4) == 4 && sequence > _sequence)
+        {
+            _sequence = sequence;
+        }
+    }
+
+    return true;
+}
+
+void FrameCapture::stage(uint8_t *frame, uint8_t length, uint32_t time, int rssi, float snr)
+{
+    if (length > CAPTURE_MAX_FRAME)
+    {
+        length = CAPTURE_MAX_FRAME;
+    }
+
+    _record.time = time;
+    _record.rssi = rssi;
+    _record.snr = snr * 4;
+    _record.length = length;
+    memcpy(_record.frame, frame, length);
+    memset(&_record.frame[length], 0, CAPTURE_MAX_FRAME - length);
+    _staged = true;
+}
+
+void FrameCapture::commit(uint8_t outcome)
+{
+    if (!_staged || !_file || _capacity == 0)
+    {
+        return;
+    }
+
+    _record.sequence = ++_sequence;
+    _record.outcome = outcome;
+
+    _file.seek(((_record.sequence - 1) % _capacity) * sizeof(struct_capture_record));
+    _file.write((uint8_t *)&_record, sizeof(_record));
+    _file.flush();
+    _staged = false;
+}
+
+void FrameCapture::dump(Print &out)
+{
+    if (!_file || _capacity == 0)
+    {
+        return;
+    }
+
+    struct_capture_record record;
+    uint32_t first = _sequence > _capacity ? _sequence - _capacity + 1 : 1;
+
+    for (uint32_t sequence = first; sequence <= _sequence; sequence++)
+    {
+        if (!_read((sequence - 1) % _capacity, &record) || record.sequence != sequence)
+        {
+            continue;
+        }
+
+        out.print(CAPTURE_LINE_PREFIX);
+        uint8_t *bytes = (uint8_t *)&record;
+        for (uint8_t i = 0; i < sizeof(record); i++)
+        {
+            out.print(bytes[i] < 16 ? "0" : "");
+            out.print(bytes[i], HEX);
+        }
+        out.println();
+    }
+}
+
+bool FrameCapture::_read(uint16_t slot, struct_capture_record *record)
+{
+    _file.seek(slot * sizeof(struct_capture_record));
+    return _file.read((uint8_t *)record, sizeof(*record)) == sizeof(*record);
+}
@@ -0,0 +1,39 @@
+#ifndef FRAMECAPTURE_H
+#define FRAMECAPTURE_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "CaptureRecord.h"
+
+// Ring of the last received raw frames in a fixed size file on LittleFS.
+// Slot n holds record n modulo capacity, the newest record is found by its
+// sequence number on boot, so there is no header to rewrite on every frame.
+class FrameCapture
+{
+public:
+    bool begin(const char *path, uint16_t capacity);
+
+    // Keep a copy of the raw frame. Call before parseMessage(), which decrypts in place.
+    void stage(uint8_t *frame, uint8_t length, uint32_t time, int rssi, float snr);
+
+    // Append the staged frame with the outcome of parseMessage().
+    void commit(uint8_t outcome);
+
+    // Print all records, oldest first, as CAPTURE_LINE_PREFIX followed by the record in hex.
+    void dump(Print &out);
+
+    uint32_t count() { return _sequence; }
+
+private:
+    File _file;
+    uint16_t _capacity = 0;
+    uint32_t _sequence = 0;
+    bool _staged = false;
+    struct_capture_record _record;
+
+    bool _read(uint16_t slot, struct_capture_record *record);
+};
+
+#else
+#error "FRAMECAPTURE_H not defined"
+#endif
@@ -0,0 +1,105 @@
+#include "KeystreamCache.h"
+#include <string.h>
+
+void KeystreamCache::clear()
+{
+    for (uint8_t i = 0; i < KEYSTREAM_CACHE_SIZE; i++)
+    {
+        _entries[i].valid = false;
+    }
+}
+
+bool KeystreamCache::fill(uint8_t *devAddr, uint32_t fCnt, uint8_t direction, AES_Context *ctx)
+{
+    for (uint32_t next = fCnt + 1; next <= fCnt + KEYSTREAM_LOOKAHEAD; next++)
+    {
+        if (_find(devAddr, next, direction))
+        {
+            continue;
+        }
+
+        // Replace an empty entry or one of this device that can no longer be used.
+        // Otherwise evict the entries of other devices in turn.
+        Entry *entry = NULL;
+        for (uint8_t i = 0; i < KEYSTREAM_CACHE_SIZE; i++)
+        {
+            Entry *candidate = &_entries[i];
+            if (!candidate->valid ||
+                (candidate->direction == direction &&
+                 memcmp(candidate->devAddr, devAddr, 4) == 0 &&
+                 (candidate->fCnt <= fCnt || candidate->fCnt > fCnt + KEYSTREAM_LOOKAHEAD)))
+            {
+                entry = candidate;
+                break;
+            }
+        }
+
+        if (!entry)
+        {
+            entry = &_entries[_nextVictim];
+            _nextVictim = (_nextVictim + 1) % KEYSTREAM_CACHE_SIZE;
+        }
+
+        for (uint8_t block = 0; block < KEYSTREAM_BLOCKS; block++)
+        {
+            AES_Keystream(&entry->keystream[16 * block], next, devAddr, ctx, direction, block + 1);
+        }
+
+        memcpy(entry->devAddr, devAddr, 4);
+        entry->fCnt = next;
+        entry->direction = direction;
+        entry->valid = true;
+        return true;
+    }
+
+    return false;
+}
+
+void KeystreamCache::apply(uint8_t *data, uint8_t length, uint8_t *devAddr, uint32_t fCnt, uint8_t direction, AES_Context *ctx)
+{
+    Entry *entry = _find(devAddr, fCnt, direction);
+    uint8_t cached = 0;
+
+    if (entry)
+    {
+        hits++;
+        cached = length < KEYSTREAM_BLOCKS * 16 ? length : KEYSTREAM_BLOCKS * 16;
+        for (uint8_t i = 0; i < cached; i++)
+        {
+            data[i] ^= entry->keystream[i];
+        }
+        entry->valid = false; // A frame counter is only used once
+    }
+    else
+    {
+        misses++;
+    }
+
+    // Remaining blocks on demand
+    uint8_t block[16];
+    for (uint8_t offset = cached; offset < length; offset += 16)
+    {
+        AES_Keystream(block, fCnt, devAddr, ctx, direction, offset / 16 + 1);
+
+        for (uint8_t i = 0; i < 16 && offset + i < length; i++)
+        {
+            data[offset + i] ^= block[i];
+        }
+    }
+}
+
+KeystreamCache::Entry *KeystreamCache::_find(uint8_t *devAddr, uint32_t fCnt, uint8_t direction)
+{
+    for (uint8_t i = 0; i < KEYSTREAM_CACHE_SIZE; i++)
+    {
+        Entry *entry = &_entries[i];
+        if (entry->valid &&
+            entry->fCnt == fCnt &&
+            entry->direction == direction &&
+            memcmp(entry->devAddr, devAddr, 4) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef KEYSTREAMCACHE_H
+#define KEYSTREAMCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "encryption.h"
+
+#define KEYSTREAM_CACHE_SIZE 8 // Cached frames, shared by all devices. At least DEVICE_CONTEXT_CACHE_SIZE * KEYSTREAM_LOOKAHEAD
+#define KEYSTREAM_LOOKAHEAD 2  // Number of upcoming frame counters computed ahead per device
+#define KEYSTREAM_BLOCKS 1     // Blocks of 16 bytes per frame. The LDS02 payload fits in one.
+
+// Keystream of frames that are expected next. It is filled while the radio
+// is idle, so decrypting a frame on arrival is only an XOR. Frames that are
+// not in the cache, or blocks beyond KEYSTREAM_BLOCKS, are computed on demand.
+class KeystreamCache
+{
+public:
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+
+    void clear();
+
+    // Compute at most one missing entry for the frames following fCnt.
+    // Returns false if there was nothing left to compute.
+    bool fill(uint8_t *devAddr, uint32_t fCnt, uint8_t direction, AES_Context *ctx);
+
+    // Encrypt or decrypt data in place, identical to encodePacket().
+    void apply(uint8_t *data, uint8_t length, uint8_t *devAddr, uint32_t fCnt, uint8_t direction, AES_Context *ctx);
+
+private:
+    struct Entry
+    {
+        bool valid;
+        uint8_t devAddr[4];
+        uint32_t fCnt;
+        uint8_t direction;
+        uint8_t keystream[KEYSTREAM_BLOCKS * 16];
+    };
+
+    Entry _entries[KEYSTREAM_CACHE_SIZE] = {};
+    uint8_t _nextVictim = 0;
+
+    Entry *_find(uint8_t *devAddr, uint32_t fCnt, uint8_t direction);
+};
+
+#else
+#error "KEYSTREAMCACHE_H not defined"
+#endif
@@ -0,0 +1,138 @@
+#include "LightEngine.h"
+
+void LightEngine::begin(CRGB *leds, uint16_t numLeds)
+{
+    _leds = leds;
+    _numLeds = numLeds;
+    _dirty = true;
+}
+
+void LightEngine::play(uint8_t layer, const LightPattern *pattern, uint32_t color, uint16_t firstLed, uint16_t numLeds, uint32_t now)
+{
+    if (layer >= LIGHT_LAYERS)
+    {
+        return;
+    }
+
+    // Never draw outside of the strip
+    if (firstLed >= _numLeds)
+    {
+        numLeds = 0;
+    }
+    else if (numLeds > _numLeds - firstLed)
+    {
+        numLeds = _numLeds - firstLed;
+    }
+
+    Layer *l = &_layers[layer];
+    l->pattern = pattern;
+    l->start = now;
+    l->color = color;
+    l->firstLed = firstLed;
+    l->numLeds = numLeds;
+    _dirty = true;
+
+    // Show the first keyframe on the next render, regardless of the frame rate
+    _lastFrame = now - LIGHT_FRAME_INTERVAL;
+}
+
+void LightEngine::stop(uint8_t layer)
+{
+    if (layer < LIGHT_LAYERS && _layers[layer].pattern)
+    {
+        _layers[layer].pattern = NULL;
+        _dirty = true;
+    }
+}
+
+bool LightEngine::playing(uint8_t layer)
+{
+    return layer < LIGHT_LAYERS && _layers[layer].pattern;
+}
+
+bool LightEngine::render(uint32_t now)
+{
+    if (now - _lastFrame < LIGHT_FRAME_INTERVAL)
+    {
+        return false;
+    }
+    _lastFrame = now;
+    frames++;
+
+    bool changed = _dirty;
+    for (uint8_t i = 0; i < LIGHT_LAYERS; i++)
+    {
+        Layer *layer = &_layers[i];
+        if (!layer->pattern)
+        {
+            continue;
+        }
+
+        uint32_t elapsed = now - layer->start;
+        if (elapsed >= layer->pattern->length)
+        {
+            if (!layer->pattern->repeat)
+            {
+                layer->pattern = NULL;
+                changed = true;
+                continue;
+            }
+            elapsed %= layer->pattern->length;
+        }
+
+        uint8_t level = _level(layer->pattern, elapsed);
+        if (level != layer->level)
+        {
+            layer->level = level;
+            changed = true;
+        }
+    }
+
+    if (!changed || !_leds)
+    {
+        return false;
+    }
+
+    _draw();
+    _dirty = false;
+    pushes++;
+    return true;
+}
+
+uint8_t LightEngine::_level(const LightPattern *pattern, uint32_t elapsed)
+{
+    // Last keyframe that has started, patterns only have a handful
+    uint8_t level = 0;
+    for (uint8_t i = 0; i < pattern->count && pattern->keyframes[i].time <= elapsed; i++)
+    {
+        level = pattern->keyframes[i].level;
+    }
+    return level;
+}
+
+void LightEngine::_draw()
+{
+    for (uint16_t i = 0; i < _numLeds; i++)
+    {
+        _leds[i] = CRGB(0, 0, 0);
+    }
+
+    for (uint8_t i = 0; i < LIGHT_LAYERS; i++)
+    {
+        Layer *layer = &_layers[i];
+        if (!layer->pattern || layer->level == 0)
+        {
+            continue;
+        }
+
+        uint16_t scale = layer->level + 1;
+        CRGB color((((layer->color >> 16) & 0xFF) * scale) >> 8,
+                   (((layer->color >> 8) & 0xFF) * scale) >> 8,
+                   ((layer->color & 0xFF) * scale) >> 8);
+
+        for (uint16_t led = layer->firstLed; led < layer->firstLed + layer->numLeds; led++)
+        {
+            _leds[led] = color;
+        }
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef LIGHTENGINE_H
+#define LIGHTENGINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <FastLED.h>
+
+#ifndef LIGHT_LAYERS
+#define LIGHT_LAYERS 8 // Layer slots, a higher slot is drawn on top
+#endif
+#define LIGHT_FRAME_INTERVAL 20 // ms between frames
+
+// From time (ms since the start of the pattern) on, the layer shows its color
+// at level. Level 0 is transparent, 255 is the full color.
+typedef struct LightKeyframe
+{
+    uint16_t time;
+    uint8_t level;
+} LightKeyframe;
+
+// Keyframes sorted by time. After length ms the pattern starts over, or
+// the layer stops if it does not repeat.
+typedef struct LightPattern
+{
+    const LightKeyframe *keyframes;
+    uint8_t count;
+    uint16_t length;
+    bool repeat;
+} LightPattern;
+
+// Renders layers of keyframe patterns onto a led strip at a fixed frame
+// rate. The leds are only redrawn, and render() only returns true, when the
+// level of a layer changed since the last frame.
+class LightEngine
+{
+public:
+    uint32_t frames = 0; // Frames evaluated
+    uint32_t pushes = 0; // Frames that changed the leds
+
+    void begin(CRGB *leds, uint16_t numLeds);
+
+    // Show pattern on numLeds leds from firstLed in color, starting at now.
+    void play(uint8_t layer, const LightPattern *pattern, uint32_t color, uint16_t firstLed, uint16_t numLeds, uint32_t now);
+    void stop(uint8_t layer);
+    bool playing(uint8_t layer);
+
+    // Returns true if the leds changed and have to be shown.
+    bool render(uint32_t now);
+
+private:
+    struct Layer
+    {
+        const LightPattern *pattern;
+        uint32_t start;
+        uint32_t color;
+        uint16_t firstLed;
+        uint16_t numLeds;
+        uint8_t level; // Level drawn in the last frame
+    };
+
+    CRGB *_leds = NULL;
+    uint16_t _numLeds = 0;
+    Layer _layers[LIGHT_LAYERS] = {};
+    uint32_t _lastFrame = 0;
+    bool _dirty = true;
+
+    static uint8_t _level(const LightPattern *pattern, uint32_t elapsed);
+    void _draw();
+};
+
+#else
+#error "LIGHTENGINE_H not defined"
+#endif
@@ -1,19 +1,19 @@
 #include "LoRaWanP2P.h"
-#include "encryption.h"
+#include "Trace.h"
 #include <string.h>
 #include <Arduino.h>
 
-void LoRaWanP2P::onSave(void (*callback)())
+void LoRaWanP2P::onSave(void (*callback)(LoRaWanDevice *device))
 {
     _onSave = callback;
 }
 
-void LoRaWanP2P::onJoin(void (*callback)())
+void LoRaWanP2P::onJoin(void (*callback)(LoRaWanDevice *device))
 {
     _onJoin = callback;
 }
 
-void LoRaWanP2P::onMessage(void (*callback)(uint8_t port, uint8_t *msg, uint8_t length))
+void LoRaWanP2P::onMessage(void (*callback)(LoRaWanDevice *device, uint8_t port, uint8_t *msg, uint8_t length))
 {
     _onMessage = callback;
 }
@@ -23,53 +23,180 @@ void LoRaWanP2P::onResponse(void (*callback)(uint8_t *buffer, uint8_t length, ui
     _onResponse = callback;
 }
 
-void LoRaWanP2P::parseMessage(uint8_t *buffer, uint8_t length, int rssi, bool allowFCntReset)
+LoRaWanDevice *LoRaWanP2P::addDevice(uint8_t *devAddr, uint8_t *nwkSKey, uint8_t *appSKey, uint8_t id)
 {
-    LoRaWanPHYPayload PHYPayload;
+    keystreamCache.clear();
+    return devices.add(devAddr, nwkSKey, appSKey, id);
+}
+
+bool LoRaWanP2P::enqueueDownlink(uint8_t *devAddr, uint8_t port, const uint8_t *payload, uint8_t length, bool confirmed)
+{
+    if (port == 0 || port > 223 || !devices.find(devAddr))
+    {
+        return false;
+    }
+    return queue.add(devAddr, port, payload, length, confirmed, millis());
+}
+
+void LoRaWanP2P::responseSent(const uint8_t *response)
+{
+    uint8_t devAddr[4];
+    if (!_responseAddress(response, devAddr))
+    {
+        return;
+    }
+
+    QueuedDownlink *downlink = queue.taken(devAddr);
+    if (downlink)
+    {
+        queue.sent(downlink, millis());
+    }
+}
+
+void LoRaWanP2P::responseDropped(const uint8_t *response)
+{
+    uint8_t devAddr[4];
+    if (!_responseAddress(response, devAddr))
+    {
+        return;
+    }
+
+    QueuedDownlink *downlink = queue.taken(devAddr);
+    if (downlink)
+    {
+        queue.returned(downlink);
+    }
+
+    // After another uplink of the device its answers are newer
+    LoRaWanDevice *device = devices.find(devAddr);
+    uint16_t fCnt = response[6] | response[7] << 8;
+    if (!device || _consumed.fCntDown == 0 || !_compare(devAddr, _consumed.devAddr, 4) ||
+        device->fCntUp != _consumed.fCntUp || device->fCntDown != _consumed.fCntDown ||
+        (uint16_t)device->fCntDown != fCnt)
+    {
+        return;
+    }
+
+    // The frame counter is kept. After a yield the winning light sent it, and
+    // the device would drop it as a replay if it were used again.
+    device->mac = _consumed.mac;
+    device->adr.retries = _consumed.adrRetries;
+    _consumed.fCntDown = 0;
+}
+
+bool LoRaWanP2P::_responseAddress(const uint8_t *response, uint8_t *devAddr)
+{
+    // Only data down, a join accept is encrypted as a whole
+    if (response[0] != 0x60 && response[0] != 0xa0)
+    {
+        return false;
+    }
+
+    devAddr[0] = response[4];
+    devAddr[1] = response[3];
+    devAddr[2] = response[2];
+    devAddr[3] = response[1];
+    return true;
+}
+
+void LoRaWanP2P::updateKeys()
+{
+    AES_Setup(&_appKeyCtx, &appKey[0]);
+}
+
+void LoRaWanP2P::precompute()
+{
+    // Only devices that were recently active have their keys expanded
+    LoRaWanSession *session = devices.nextSession();
+    if (!session)
+    {
+        return;
+    }
+
+    uint8_t address[4];
+    address[0] = session->address >> 24;
+    address[1] = session->address >> 16;
+    address[2] = session->address >> 8;
+    address[3] = session->address;
+
+    LoRaWanDevice *device = devices.find(&address[0]);
+    if (device)
+    {
+        keystreamCache.fill(&device->devAddr[0], device->fCntUp, 0, &session->appSKey);
+    }
+}
+
+bool LoRaWanP2P::flush()
+{
+    bool saved = false;
+    for (uint16_t i = 0; i < devices.count(); i++)
+    {
+        LoRaWanDevice *device = devices.get(i);
+        if (!device->dirty)
+        {
+            continue;
+        }
+
+        device->dirty = false;
+        if (_onSave)
+        {
+            _onSave(device);
+        }
+        saved = true;
+    }
+    return saved;
+}
+
+LoRaWanResult LoRaWanP2P::parseMessage(uint8_t *buffer, uint8_t length, int rssi, int8_t snr, uint8_t spreadingFactor)
+{
+    LoRaWanPHYPayloadView PHYPayload;
 
     if (!PHYPayload.populate(buffer, length))
     {
         // Invalid message, ignore
-        return;
+        return LORAWAN_MALFORMED;
     }
+    TRACE_MARK(TRACE_POPULATE);
 
     if (PHYPayload.mhdr == 0 && OTAAEnabled)
     {
         // Join Request
-        _parseJoinRequest(&PHYPayload);
+        return _parseJoinRequest(&PHYPayload);
     }
 
     if (PHYPayload.isDataPackage)
     {
-        _parseDataRequest(&PHYPayload, rssi, allowFCntReset);
+        return _parseDataRequest(&PHYPayload, rssi, snr, spreadingFactor);
     }
+
+    return LORAWAN_IGNORED;
 }
 
-void LoRaWanP2P::_parseJoinRequest(LoRaWanPHYPayload *PHYPayload)
+LoRaWanResult LoRaWanP2P::_parseJoinRequest(LoRaWanPHYPayloadView *PHYPayload)
 {
     LoRaWanJoinRequest request;
-    if (!request.populate(PHYPayload->payload, PHYPayload->payloadLength))
+    if (!request.populate(PHYPayload->payload))
     {
         // Invalid Payload
-        return;
+        return LORAWAN_MALFORMED;
     }
 
     if (!_compare(&devEUI[0], &request.devEUI[0], 8))
     {
         // Message not for us. Ignore
-        return;
+        return LORAWAN_UNKNOWN_DEVICE;
     }
 
     if (!_compare(&appEUI[0], &request.appEUI[0], 8))
     {
         // Message not for us. Ignore
-        return;
+        return LORAWAN_UNKNOWN_DEVICE;
     }
 
-    if (!PHYPayload->validateMIC(&appKey[0]))
+    if (!PHYPayload->validateMIC(&_appKeyCtx))
     {
         // Invalid MIC ignore
-        return;
+        return LORAWAN_INVALID_MIC;
     }
 
     LoRaWanJoinAccept accept;
@@ -95,22 +222,31 @@ void LoRaWanP2P::_parseJoinRequest(LoRaWanPHYPayload *PHYPayload)
     }
 
     // Generate network keys and save settings
-    _generateNwkSKey(&nwkSKey[0], &appKey[0], &accept.appNonce[0], &accept.netID[0], &request.devNonce[0]);
-    _generateAppSKey(&appSKey[0], &appKey[0], &accept.appNonce[0], &accept.netID[0], &request.devNonce[0]);
-    fCntDown = 0;
-    fCntUp = 0;
+    uint8_t nwkSKey[16];
+    uint8_t appSKey[16];
+    _generateNwkSKey(&nwkSKey[0], &_appKeyCtx, &accept.appNonce[0], &accept.netID[0], &request.devNonce[0]);
+    _generateAppSKey(&appSKey[0], &_appKeyCtx, &accept.appNonce[0], &accept.netID[0], &request.devNonce[0]);
+
+    LoRaWanDevice *device = addDevice(&devAddr[0], &nwkSKey[0], &appSKey[0], 0);
+    if (!device)
+    {
+        // Table full
+        return LORAWAN_IGNORED;
+    }
+    device->fCntDown = 0;
+    device->fCntUp = 0;
 
     LoRaWanPHYPayload response;
     response.mhdr = 0x20; // Join Accept
     response.payloadLength = accept.toBuffer(&response.payload[0]);
     response.isDataPackage = false;
-    response.generateMIC(&appKey[0]);
+    response.generateMIC(&_appKeyCtx);
 
     uint8_t buf[64];
     uint8_t len = response.toBuffer(&buf[0]);
 
-    AES_Decrypt(&buf[1], &appKey[0]);
-    AES_Decrypt(&buf[17], &appKey[0]);
+    AES_Decrypt(&buf[1], &_appKeyCtx);
+    AES_Decrypt(&buf[17], &_appKeyCtx);
 
     // First send away as this is time critical
     if (_onResponse)
@@ -118,148 +254,213 @@ void LoRaWanP2P::_parseJoinRequest(LoRaWanPHYPayload *PHYPayload)
         _onResponse(buf, len, 5000);
     }
 
-    // Next Save data
-    if (!_onSave)
-    {
-        _onSave();
-    }
+    // Save data later, see flush()
+    device->dirty = true;
 
     // Give control back to user
     if (_onJoin)
     {
-        _onJoin();
+        _onJoin(device);
     }
+
+    return LORAWAN_JOINED;
 }
 
-void LoRaWanP2P::_parseDataRequest(LoRaWanPHYPayload *PHYPayload, int rssi, bool allowFCntReset)
+LoRaWanResult LoRaWanP2P::_parseDataRequest(LoRaWanPHYPayloadView *PHYPayload, int rssi, int8_t snr, uint8_t spreadingFactor)
 {
-    LoRaWanMACPayload macPayload;
+    LoRaWanMACPayloadView macPayload;
     bool replay = false;
-    bool linkCheck = false;
-    bool toSave = false;
+    bool adrRequest = false;
 
-    if (!macPayload.populate(PHYPayload->payload, PHYPayload->payloadLength))
+    if (!macPayload.populate(PHYPayload->payload))
     {
         // Invalid Payload
-        return;
+        return LORAWAN_MALFORMED;
     }
 
-    if (!_compare(&devAddr[0], &macPayload.devAddr[0], 4))
+    uint32_t now = millis();
+    uint32_t key = DedupCache::key(&macPayload.devAddr[0], macPayload.fCnt, PHYPayload->mic);
+    if (dedup.seen(key, now))
     {
-        // Message not for us. Ignore
-        return;
+        // Handled already, neither forwarded nor answered again
+        return LORAWAN_DUPLICATE;
     }
 
-    uint32_t possibleFCnt = (fCntUp & 0xFFFF0000) | macPayload.fCnt;
-    if (!PHYPayload->validateMIC(&nwkSKey[0], possibleFCnt))
+    LoRaWanDevice *device = devices.find(&macPayload.devAddr[0]);
+    if (!device)
     {
-        possibleFCnt += (1 << 16);
-        if (!PHYPayload->validateMIC(&nwkSKey[0], possibleFCnt))
-        {
-            if (allowFCntReset)
-            {
-                if (!PHYPayload->validateMIC(&nwkSKey[0], 0))
-                {
-                    // Invalid MIC, ignore message
-                    return;
-                }              
-            }
-        }
+        // Message not for us. Ignore before doing any AES work
+        return LORAWAN_UNKNOWN_DEVICE;
     }
 
+    bool allowFCntReset = device->allowFCntReset;
+
+    uint32_t candidates[FCNT_MAX_CANDIDATES];
+    bool old;
+    uint8_t count = fCntResolver.resolve(device->fCntUp, allowFCntReset, macPayload.fCnt, candidates, &old);
+    if (count == 0)
+    {
+        // Outside the window, not worth a MIC
+        return old ? LORAWAN_OLD_FCNT : LORAWAN_FCNT_GAP;
+    }
+
+    LoRaWanSession *session = devices.session(device);
+
+    uint32_t possibleFCnt = 0;
+    bool valid = false;
+    for (uint8_t i = 0; i < count && !valid; i++)
+    {
+        possibleFCnt = candidates[i];
+        fCntResolver.cmacs++;
+        valid = PHYPayload->validateMIC(&session->nwkSKey, possibleFCnt);
+    }
+
+    if (!valid)
+    {
+        // Invalid MIC, ignore message
+        return LORAWAN_INVALID_MIC;
+    }
+    fCntResolver.accepted++;
+    dedup.add(key, now);
+
+    device->allowFCntReset = false;
+
     if(possibleFCnt == 0 && allowFCntReset) {
-        fCntUp = 0;
-        toSave = true;
+        device->fCntUp = 0;
+        device->dirty = true;
     }
 
-    if (fCntUp > possibleFCnt)
+    if (device->fCntUp > possibleFCnt)
     {
         // Old message, ignore
-        return;
+        return LORAWAN_OLD_FCNT;
     }
 
-    if (fCntUp == possibleFCnt && fCntUp != 0)
+    if (device->fCntUp == possibleFCnt && device->fCntUp != 0)
     {
         replay = true; // We do answer this message, but we do not forward it to the user.
     }
     else
     {
-        fCntUp = possibleFCnt;
-        toSave = true;
+        device->fCntUp = possibleFCnt;
+        device->dirty = true;
+    }
+
+    if (macPayload.frmPayload.length > 0)
+    {
+        // Decode packet in place. As one uses xor for encryption, the encode and decode function is identical.
+        uint8_t direction = PHYPayload->mhdr != 0x40 && PHYPayload->mhdr != 0x80;
+        if (macPayload.fPort == 0)
+        {
+            // MAC commands, encrypted with the NwkSKey and rare, so not cached
+            encodePacket(macPayload.frmPayload.data, macPayload.frmPayload.length, possibleFCnt,
+                         &macPayload.devAddr[0], &session->nwkSKey, direction);
+        }
+        else
+        {
+            keystreamCache.apply(macPayload.frmPayload.data,
+                                 macPayload.frmPayload.length,
+                                 &macPayload.devAddr[0],
+                                 possibleFCnt,
+                                 direction,
+                                 &session->appSKey);
+        }
+        TRACE_MARK(TRACE_DECRYPT);
     }
 
-    if (macPayload.frmPayloadLength > 0)
+    // MAC commands are decoded for replays too, the device may not have
+    // received our answers. Answering twice is harmless.
+    int margin = rssi + 120; // Assume lowest is 120
+    if (margin < 0)
     {
-        // Decode packet. As one uses xor for encryption, the encode and decode function is identical.
-        encodePacket(&macPayload.frmPayload[0],
-                     macPayload.frmPayloadLength,
-                     possibleFCnt,
-                     &macPayload.devAddr[0],
-                     &appSKey[0],
-                     PHYPayload->mhdr != 0x40 && PHYPayload->mhdr != 0x80);
+        margin = 0;
+    }
+    mac.parse(device, macPayload.fOpts.data, macPayload.fOpts.length, margin);
+    if (macPayload.fPort == 0)
+    {
+        mac.parse(device, macPayload.frmPayload.data, macPayload.frmPayload.length, margin);
     }
 
-    if (macPayload.fOptsLength != 0 && macPayload.fOpts[0] == 0x02)
+    if (!replay)
     {
-        linkCheck = true;
+        queue.uplink(device->devAddr, macPayload.ack, now);
+        mac.uplink(device);
+        if (spreadingFactor != 0)
+        {
+            uint8_t length = PHYPayload->payload.length + 5;
+            adrRequest = adr.uplink(&device->adr, spreadingFactor, snr, length, macPayload.adr);
+        }
     }
 
-    if (macPayload.frmPayloadLength > 0 && macPayload.fPort == 0 && macPayload.frmPayload[0] == 0x02)
+    // Before the response, onResponse may save the frame counter to flash
+    // and the door should not wait for that
+    if (!replay && macPayload.fPort != 0 && _onMessage)
     {
-        linkCheck = true;
+        _onMessage(device, macPayload.fPort, macPayload.frmPayload.data, macPayload.frmPayload.length);
     }
 
-    if (PHYPayload->mhdr == 0x80 || linkCheck)
+    QueuedDownlink *downlink = queue.next(device->devAddr);
+
+    if (PHYPayload->mhdr == 0x80 || mac.due(device) || macPayload.adrAckReq || adrRequest || downlink)
     {
-        // Endnode requests confirmation or a link check
+        // Endnode requests confirmation, a MAC answer or any downlink, or we have something to send
         LoRaWanMACPayload responsePayload;
 
-        responsePayload.devAddr[0] = devAddr[0];
-        responsePayload.devAddr[1] = devAddr[1];
-        responsePayload.devAddr[2] = devAddr[2];
-        responsePayload.devAddr[3] = devAddr[3];
+        responsePayload.devAddr[0] = device->devAddr[0];
+        responsePayload.devAddr[1] = device->devAddr[1];
+        responsePayload.devAddr[2] = device->devAddr[2];
+        responsePayload.devAddr[3] = device->devAddr[3];
 
-        responsePayload.adr = false; // Not implemented
+        responsePayload.adr = macPayload.adr;
         responsePayload.adrAckReq = false;
         responsePayload.ack = PHYPayload->mhdr == 0x80; // confirmed message
+        responsePayload.pending = downlink && queue.depth(device->devAddr) > 1;
 
-        fCntDown++;
-        toSave = true;
+        // Given back by responseDropped()
+        memcpy(_consumed.devAddr, device->devAddr, 4);
+        _consumed.fCntUp = device->fCntUp;
+        _consumed.mac = device->mac;
+        _consumed.adrRetries = device->adr.retries;
 
-        responsePayload.fCnt = fCntDown;
+        device->fCntDown++;
+        device->dirty = true;
+        _consumed.fCntDown = device->fCntDown;
 
-        if (linkCheck)
+        responsePayload.fCnt = device->fCntDown;
+
+        // All answers in one downlink
+        responsePayload.fOptsLength = mac.build(device, &responsePayload.fOpts[0], MAC_MAX_FOPTS);
+        if (adrRequest)
         {
-            responsePayload.fOptsLength = 3;
-            responsePayload.fOpts[0] = 0x02;
+            responsePayload.fOptsLength += adr.request(&device->adr,
+                                                       &responsePayload.fOpts[responsePayload.fOptsLength],
+                                                       MAC_MAX_FOPTS - responsePayload.fOptsLength);
+        }
 
-            int margin = rssi + 120; // Assume lowest is 120
-            if (margin < 0)
-            {
-                responsePayload.fOpts[1] = 0;
-            }
-            else
+        LoRaWanPHYPayload response;
+        response.mhdr = 0x60; // Unconfirmed data down
+
+        if (downlink)
+        {
+            if (downlink->confirmed)
             {
-                responsePayload.fOpts[1] = margin;
+                response.mhdr = 0xa0; // Confirmed data down
             }
-
-            responsePayload.fOpts[2] = 0x01; // only 1 gateway
+            responsePayload.fPort = downlink->port;
+            responsePayload.frmPayloadLength = downlink->length;
+            memcpy(responsePayload.frmPayload, downlink->payload, downlink->length);
+            encodePacket(responsePayload.frmPayload, downlink->length, device->fCntDown, device->devAddr, &session->appSKey, 1);
+            queue.take(downlink); // Sent once transmitted, see responseSent()
         }
         else
         {
-            responsePayload.fOptsLength = 0;
+            responsePayload.fPort = 0;
+            responsePayload.frmPayloadLength = 0;
         }
 
-        responsePayload.fPort = 0;
-        responsePayload.frmPayloadLength = 0;
-
-        LoRaWanPHYPayload response;
-        response.mhdr = 0x60; // Unconfirmed data down
         response.payloadLength = responsePayload.toBuffer(&response.payload[0]);
         response.isDataPackage = true;
-        response.generateMIC(&nwkSKey[0], fCntDown);
-
-        // No contents to encrypt.
+        response.generateMIC(&session->nwkSKey, device->fCntDown);
 
         // Send away
         if (_onResponse)
@@ -271,16 +472,7 @@ void LoRaWanP2P::_parseDataRequest(LoRaWanPHYPayload *PHYPayload, int rssi, bool
         }
     }
 
-    if (toSave && _onSave)
-    {
-        _onSave();
-    }
-
-    if (!replay && macPayload.fPort != 0 && _onMessage)
-    {
-        _onMessage(macPayload.fPort, &macPayload.frmPayload[0], macPayload.frmPayloadLength);
-    }
-
+    return replay ? LORAWAN_REPLAY : LORAWAN_ACCEPTED;
 }
 
 uint8_t LoRaWanPHYPayload::toBuffer(uint8_t *buf)
@@ -381,7 +573,22 @@ bool LoRaWanP2P::_compare(uint8_t *a, uint8_t *b, uint8_t length)
     return true;
 }
 
-bool LoRaWanPHYPayload::populate(uint8_t *buf, uint8_t length)
+LoRaWanSpan LoRaWanSpan::sub(uint8_t offset, uint8_t count) const
+{
+    if (offset >= length)
+    {
+        return LoRaWanSpan(data + length, 0);
+    }
+
+    if (count > length - offset)
+    {
+        count = length - offset;
+    }
+
+    return LoRaWanSpan(data + offset, count);
+}
+
+bool LoRaWanPHYPayloadView::populate(uint8_t *buf, uint8_t length)
 {
     if (length < 12 || length > 64) // Message is too small or too large
     {
@@ -389,11 +596,9 @@ bool LoRaWanPHYPayload::populate(uint8_t *buf, uint8_t length)
     }
 
     mhdr = buf[0];
-    payloadLength = length - 5;
-
-    memcpy(&mic[0], &buf[length - 4], 4);
-    memset(&payload[0], 0, 64);
-    memcpy(&payload, &buf[1], payloadLength);
+    payload = LoRaWanSpan(&buf[1], length - 5);
+    mic = &buf[length - 4];
+    _frame = buf;
 
     switch (mhdr)
     {
@@ -417,14 +622,20 @@ bool LoRaWanPHYPayload::populate(uint8_t *buf, uint8_t length)
     return true;
 }
 
-bool LoRaWanMACPayload::populate(uint8_t *buf, uint8_t length)
+bool LoRaWanMACPayloadView::populate(LoRaWanSpan buf)
 {
+    if (buf.length < 7)
+    {
+        // Too short for FHDR
+        return false;
+    }
+
     devAddr[3] = buf[0];
     devAddr[2] = buf[1];
     devAddr[1] = buf[2];
     devAddr[0] = buf[3];
 
-    fOptsLength = buf[4] & 0x0f;
+    uint8_t fOptsLength = buf[4] & 0x0f;
     pending = (buf[4] & 0x10) >> 4;
     ack = (buf[4] & 0x20) >> 5;
     adrAckReq = (buf[4] & 0x40) >> 6;
@@ -432,33 +643,28 @@ bool LoRaWanMACPayload::populate(uint8_t *buf, uint8_t length)
 
     fCnt = buf[6] << 8 | buf[5];
 
-    memset(fOpts, 0, 16);
-
-    if (length < 7 + fOptsLength)
+    if (buf.length < 7 + fOptsLength)
     {
         // fOptsLength too large
         return false;
     }
 
-    memcpy(fOpts, &buf[7], fOptsLength);
+    fOpts = buf.sub(7, fOptsLength);
 
     fPort = 0;
-    frmPayloadLength = length - 7 - fOptsLength;
+    frmPayload = buf.sub(8 + fOptsLength, buf.length);
 
-    memset(frmPayload, 0, 64);
-    if (frmPayloadLength > 0)
+    if (buf.length > 7 + fOptsLength)
     {
         fPort = buf[7 + fOptsLength];
-        frmPayloadLength--;
-        memcpy(frmPayload, &buf[8 + fOptsLength], frmPayloadLength);
     }
 
     return true;
 }
 
-bool LoRaWanJoinRequest::populate(uint8_t *buf, uint8_t length)
+bool LoRaWanJoinRequest::populate(LoRaWanSpan buf)
 {
-    if (length != 18)
+    if (buf.length != 18)
     {
         return false;
     }
@@ -479,7 +685,7 @@ bool LoRaWanJoinRequest::populate(uint8_t *buf, uint8_t length)
     return true;
 }
 
-void LoRaWanP2P::_generateNwkSKey(uint8_t *result, uint8_t *key, uint8_t *AppNonce, uint8_t *NetID, uint8_t *DevNonce)
+void LoRaWanP2P::_generateNwkSKey(uint8_t *result, AES_Context *key, uint8_t *AppNonce, uint8_t *NetID, uint8_t *DevNonce)
 {
     memset(result, 0, 16);
     result[0] = 0x01;
@@ -496,7 +702,7 @@ void LoRaWanP2P::_generateNwkSKey(uint8_t *result, uint8_t *key, uint8_t *AppNon
     return;
 }
 
-void LoRaWanP2P::_generateAppSKey(uint8_t *result, uint8_t *key, uint8_t *AppNonce, uint8_t *NetID, uint8_t *DevNonce)
+void LoRaWanP2P::_generateAppSKey(uint8_t *result, AES_Context *key, uint8_t *AppNonce, uint8_t *NetID, uint8_t *DevNonce)
 {
     memset(result, 0, 16);
     result[0] = 0x02;
@@ -513,92 +719,94 @@ void LoRaWanP2P::_generateAppSKey(uint8_t *result, uint8_t *key, uint8_t *AppNon
     return;
 }
 
-void LoRaWanPHYPayload::generateMIC(uint8_t *key)
+// B0 = ( 0x49 | 4 x 0x00 | Dir | 4 x DevAddr | 4 x FCnt |  0x00 | len )
+// MIC is cmac [0:3] of ( aes128_cmac(NwkSKey, B0 | MHDR | MACPayload )
+static void _generateB0(uint8_t *b0, uint8_t mhdr, uint8_t *devAddr, uint32_t fCnt, uint8_t length)
 {
-    _generateMIC(key, &mic[0], 0);
-}
+    b0[0] = 0x49; // 1 byte MIC code
 
-void LoRaWanPHYPayload::generateMIC(uint8_t *key, uint32_t fCnt)
-{
-    _generateMIC(key, &mic[0], fCnt);
-}
+    b0[1] = 0x00; // 4 byte 0x00
+    b0[2] = 0x00;
+    b0[3] = 0x00;
+    b0[4] = 0x00;
 
-bool LoRaWanPHYPayload::validateMIC(uint8_t *key, uint32_t fCnt)
-{
-    uint8_t newMIC[] = {0, 0, 0, 0};
+    if (mhdr == 0x40 || mhdr == 0x80)
+    {
+        b0[5] = 0;
+    }
+    else
+    {
+        b0[5] = 1;
+    }
 
-    _generateMIC(key, &newMIC[0], fCnt);
+    // DevAddr, as on air
+    b0[6] = devAddr[0];
+    b0[7] = devAddr[1];
+    b0[8] = devAddr[2];
+    b0[9] = devAddr[3];
 
-    return mic[0] == newMIC[0] &&
-           mic[1] == newMIC[1] &&
-           mic[2] == newMIC[2] &&
-           mic[3] == newMIC[3];
+    b0[10] = (fCnt & 0x000000FF); // 4 byte FCNT
+    b0[11] = ((fCnt >> 8) & 0x000000FF);
+    b0[12] = ((fCnt >> 16) & 0x000000FF);
+    b0[13] = ((fCnt >> 24) & 0x000000FF);
+
+    b0[14] = 0x00; // 1 byte 0x00
+
+    b0[15] = length; // 1 byte len
 }
 
-bool LoRaWanPHYPayload::validateMIC(uint8_t *key)
+void LoRaWanPHYPayload::generateMIC(AES_Context *key)
 {
-    return validateMIC(key, 0);
+    generateMIC(key, 0);
 }
 
-void LoRaWanPHYPayload::_generateMIC(uint8_t *key, uint8_t *result, uint32_t fCnt)
+void LoRaWanPHYPayload::generateMIC(AES_Context *key, uint32_t fCnt)
 {
-    uint8_t buf[128];
-    uint8_t len = 0;
+    uint8_t buf[65];
+    uint8_t cmac[16];
+
+    buf[0] = mhdr;
+    memcpy(&buf[1], payload, payloadLength);
 
     if (isDataPackage)
     {
-        // B0 = ( 0x49 | 4 x 0x00 | Dir | 4 x DevAddr | 4 x FCnt |  0x00 | len )
-        // MIC is cmac [0:3] of ( aes128_cmac(NwkSKey, B0 | Data )
-
-        buf[0] = 0x49; // 1 byte MIC code
-
-        buf[1] = 0x00; // 4 byte 0x00
-        buf[2] = 0x00;
-        buf[3] = 0x00;
-        buf[4] = 0x00;
-
-        if (mhdr == 0x40 || mhdr == 0x80)
-        {
-            buf[5] = 0;
-        }
-        else
-        {
-            buf[5] = 1;
-        }
-
-        // DevAddr
-        buf[6] = payload[0];
-        buf[7] = payload[1];
-        buf[8] = payload[2];
-        buf[9] = payload[3];
-
-        buf[10] = (fCnt & 0x000000FF); // 4 byte FCNT
-        buf[11] = ((fCnt >> 8) & 0x000000FF);
-        buf[12] = ((fCnt >> 16) & 0x000000FF);
-        buf[13] = ((fCnt >> 24) & 0x000000FF);
-
-        buf[14] = 0x00; // 1 byte 0x00
+        uint8_t b0[16];
+        _generateB0(&b0[0], mhdr, &payload[0], fCnt, payloadLength + 1);
+        AES_CMAC_B0(&b0[0], &buf[0], payloadLength + 1, &cmac[0], key);
+    }
+    else
+    {
+        // Join Request or Join Accept
+        // MIC is cmac [0:3] of ( aes128_cmac(AppKey, Data )
+        AES_CMAC(&buf[0], payloadLength + 1, &cmac[0], key);
+    }
 
-        buf[15] = payloadLength + 1; // 1 byte len
+    memcpy(&mic[0], &cmac[0], 4);
+}
 
-        buf[16] = mhdr;
+bool LoRaWanPHYPayloadView::validateMIC(AES_Context *key, uint32_t fCnt)
+{
+    uint8_t cmac[16];
 
-        memcpy(&buf[17], payload, payloadLength);
-        len = payloadLength + 17;
+    if (isDataPackage)
+    {
+        uint8_t b0[16];
+        _generateB0(&b0[0], mhdr, payload.data, fCnt, payload.length + 1);
+        AES_CMAC_B0(&b0[0], _frame, payload.length + 1, &cmac[0], key);
     }
-
-    // Join Request or Join Accept
-    if (mhdr == 0x00 || mhdr == 0x20)
+    else
     {
-        // MIC is cmac [0:3] of ( aes128_cmac(AppKey, Data )
-        buf[0] = mhdr;
-        memcpy(&buf[1], payload, payloadLength);
-        len = payloadLength + 1;
+        AES_CMAC(_frame, payload.length + 1, &cmac[0], key);
     }
+    TRACE_MARK(TRACE_VALIDATE_MIC);
 
-    uint8_t cmac[16];
-    AES_CMAC(&buf[0], len, &cmac[0], key);
-    memcpy(&result[0], &cmac[0], 4);
+    return mic[0] == cmac[0] &&
+           mic[1] == cmac[1] &&
+           mic[2] == cmac[2] &&
+           mic[3] == cmac[3];
+}
 
-    return;
+bool LoRaWanPHYPayloadView::validateMIC(AES_Context *key)
+{
+    return validateMIC(key, 0);
 }
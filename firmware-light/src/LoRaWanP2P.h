@@ -2,8 +2,46 @@
 #define LORAPACKET_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "DeviceTable.h"
+#include "DownlinkQueue.h"
+#include "FCntResolver.h"
+#include "DedupCache.h"
 
+// Outcome of parseMessage()
+enum LoRaWanResult : uint8_t
+{
+    LORAWAN_ACCEPTED = 0,   // Valid data frame
+    LORAWAN_JOINED,         // Valid join request, join accept sent
+    LORAWAN_REPLAY,         // Valid data frame that was already received
+    LORAWAN_MALFORMED,      // Not a valid LoRaWAN frame
+    LORAWAN_UNKNOWN_DEVICE, // Not for one of our devices
+    LORAWAN_INVALID_MIC,    // MIC did not match
+    LORAWAN_OLD_FCNT,       // Frame counter lower than the last one received
+    LORAWAN_IGNORED,        // Valid, but not handled, e.g. a downlink
+    LORAWAN_FCNT_GAP,       // Frame counter too far ahead of the last one received
+    LORAWAN_DUPLICATE,      // Copy of a frame received a moment ago, dropped
+};
+
+// Non-owning view of a range of bytes inside a received frame.
+// Reads past the end return 0 instead of touching memory outside the frame.
+class LoRaWanSpan
+{
+public:
+    uint8_t *data = NULL;
+    uint8_t length = 0;
+
+    LoRaWanSpan() {}
+    LoRaWanSpan(uint8_t *data, uint8_t length) : data(data), length(length) {}
+
+    uint8_t operator[](uint8_t index) const { return index < length ? data[index] : 0; }
+
+    // View of count bytes starting at offset, clamped to this span.
+    LoRaWanSpan sub(uint8_t offset, uint8_t count) const;
+};
+
+// Outgoing PHYPayload, owns its buffer.
 class LoRaWanPHYPayload
 {
 public:   
@@ -14,19 +52,32 @@ public:
 
     bool isDataPackage;
 
-    void generateMIC(uint8_t *key);
-    void generateMIC(uint8_t *key, uint32_t fCnt);
+    void generateMIC(AES_Context *key);
+    void generateMIC(AES_Context *key, uint32_t fCnt);
 
-    bool validateMIC(uint8_t *key);
-    bool validateMIC(uint8_t *key, uint32_t fCnt);
+    uint8_t toBuffer(uint8_t *buf);
+};
+
+// Received PHYPayload. A view over the receive buffer, nothing is copied.
+class LoRaWanPHYPayloadView
+{
+public:
+    uint8_t mhdr;
+    LoRaWanSpan payload;
+    uint8_t *mic;
+
+    bool isDataPackage;
+
+    bool validateMIC(AES_Context *key);
+    bool validateMIC(AES_Context *key, uint32_t fCnt);
 
     bool populate(uint8_t *buf, uint8_t length);
-    uint8_t toBuffer(uint8_t *buf);
 
 private:
-    void _generateMIC(uint8_t *key, uint8_t *result, uint32_t fCnt);
+    uint8_t *_frame; // MHDR | payload, the MIC input
 };
 
+// Outgoing MACPayload, owns its buffers.
 class LoRaWanMACPayload
 {
 public: 
@@ -45,10 +96,30 @@ public:
     uint8_t frmPayloadLength;
     uint8_t frmPayload[64];
   
-    bool populate(uint8_t *buf, uint8_t length);
     uint8_t toBuffer(uint8_t *buf);
 };
 
+// Received MACPayload. FOpts and FRMPayload point into the receive buffer,
+// so FRMPayload is decrypted in place.
+class LoRaWanMACPayloadView
+{
+public:
+    uint8_t devAddr[4];
+
+    bool adr;
+    bool adrAckReq;
+    bool ack;
+    bool pending;
+
+    uint16_t fCnt;
+    LoRaWanSpan fOpts;
+
+    int fPort;
+    LoRaWanSpan frmPayload;
+
+    bool populate(LoRaWanSpan buf);
+};
+
 class LoRaWanJoinRequest
 {
 public:   
@@ -56,7 +127,7 @@ public:
     uint8_t devEUI[8];
     uint8_t devNonce[2];
 
-    bool populate(uint8_t *buf, uint8_t length);
+    bool populate(LoRaWanSpan buf);
 };
 
 class LoRaWanJoinAccept
@@ -75,37 +146,83 @@ public:
 class LoRaWanP2P
 {
 public:
+    // OTAA settings. A device that joins gets devAddr and is added to devices.
     uint8_t devEUI[8];
     uint8_t appEUI[8];
     uint8_t appKey[16];
-
     uint8_t devAddr[4];
-    uint8_t appSKey[16];
-    uint8_t nwkSKey[16];
-
-    uint32_t fCntDown;
-    uint32_t fCntUp;
 
     bool OTAAEnabled = true;
 
-    void onSave(void (*callback)());
-    void onJoin(void (*callback)());
-    void onMessage(void (*callback)(uint8_t port, uint8_t *msg, uint8_t length));
+    DeviceTable devices;
+    KeystreamCache keystreamCache;
+    AdrEngine adr;
+    MacCommands mac;
+    DownlinkQueue queue;
+    FCntResolver fCntResolver;
+    DedupCache dedup;
+
+    // Add an ABP device, or update its keys. Returns NULL if the table is full.
+    LoRaWanDevice *addDevice(uint8_t *devAddr, uint8_t *nwkSKey, uint8_t *appSKey, uint8_t id);
+
+    // Send payload on port to a device with the downlink to its next uplink.
+    // A confirmed downlink is sent again until the device ACKs it. Returns
+    // false for an unknown device, port 0 or above 223, or a full queue.
+    bool enqueueDownlink(uint8_t *devAddr, uint8_t port, const uint8_t *payload, uint8_t length, bool confirmed);
+
+    // The response passed to onResponse was transmitted, or will not be.
+    // A queued downlink in it is only sent once transmitted, and stays
+    // queued for the next uplink otherwise. Dropping the last response also
+    // gives back the MAC answers and LinkADRReq it carried, unless the device
+    // sent another uplink since. Its frame counter is never used again.
+    void responseSent(const uint8_t *response);
+    void responseDropped(const uint8_t *response);
+
+    // Rebuild the cached key schedule. Call after changing appKey.
+    void updateKeys();
+
+    void onSave(void (*callback)(LoRaWanDevice *device));
+    void onJoin(void (*callback)(LoRaWanDevice *device));
+    void onMessage(void (*callback)(LoRaWanDevice *device, uint8_t port, uint8_t *msg, uint8_t length));
     void onResponse(void (*callback)(uint8_t *buffer, uint8_t length, uint32_t rxDelay));
 
-    void parseMessage(uint8_t *buffer, uint8_t length, int rssi, bool allowFCntReset);
+    // snr is in steps of 0.25 dB. spreadingFactor is the one the frame was
+    // received on, 0 if unknown, which leaves the frame out of ADR.
+    LoRaWanResult parseMessage(uint8_t *buffer, uint8_t length, int rssi, int8_t snr = 0, uint8_t spreadingFactor = 0);
+
+    // Use idle time to compute the keystream of the next expected frames.
+    void precompute();
+
+    // Call onSave for every device whose counters changed. parseMessage()
+    // only marks devices dirty, so saving never delays onMessage. Call it when
+    // idle, and before sending a response. Returns true if anything was saved.
+    bool flush();
 
 private:
-    void (*_onSave)();
-    void (*_onJoin)();
-    void (*_onMessage)(uint8_t port, uint8_t *msg, uint8_t length);
-    void (*_onResponse)(uint8_t *buffer, uint8_t length, uint32_t rxDelay);
+    void (*_onSave)(LoRaWanDevice *device) = NULL;
+    void (*_onJoin)(LoRaWanDevice *device) = NULL;
+    void (*_onMessage)(LoRaWanDevice *device, uint8_t port, uint8_t *msg, uint8_t length) = NULL;
+    void (*_onResponse)(uint8_t *buffer, uint8_t length, uint32_t rxDelay) = NULL;
+
+    AES_Context _appKeyCtx;
+
+    // What the last data response took from its device
+    struct Consumed
+    {
+        uint8_t devAddr[4];
+        uint32_t fCntUp;   // Of the uplink it answers
+        uint32_t fCntDown; // Of the response, 0 once given back
+        MacState mac;
+        uint8_t adrRetries;
+    };
+    Consumed _consumed = {};
 
     bool _compare(uint8_t *a, uint8_t *b, uint8_t length);
-    void _generateNwkSKey(uint8_t *result, uint8_t *key, uint8_t *AppNonce, uint8_t *NetID, uint8_t *DevNonce);
-    void _generateAppSKey(uint8_t *result, uint8_t *key, uint8_t *AppNonce, uint8_t *NetID, uint8_t *DevNonce);
-    void _parseJoinRequest(LoRaWanPHYPayload * PHYPayload);
-    void _parseDataRequest(LoRaWanPHYPayload * PHYPayload, int rssi, bool allowFCntReset);
+    static bool _responseAddress(const uint8_t *response, uint8_t *devAddr);
+    void _generateNwkSKey(uint8_t *result, AES_Context *key, uint8_t *AppNonce, uint8_t *NetID, uint8_t *DevNonce);
+    void _generateAppSKey(uint8_t *result, AES_Context *key, uint8_t *AppNonce, uint8_t *NetID, uint8_t *DevNonce);
+    LoRaWanResult _parseJoinRequest(LoRaWanPHYPayloadView * PHYPayload);
+    LoRaWanResult _parseDataRequest(LoRaWanPHYPayloadView * PHYPayload, int rssi, int8_t snr, uint8_t spreadingFactor);
 };
 
 #else
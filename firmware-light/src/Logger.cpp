@@ -0,0 +1,190 @@
+#include "Logger.h"
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+
+static_assert((LOG_BUFFER_SIZE & (LOG_BUFFER_SIZE - 1)) == 0, "LOG_BUFFER_SIZE must be a power of 2");
+
+#define LOG_KIND_TEXT 0
+#define LOG_KIND_DUMP 1
+
+Logger logger;
+
+static const char logLevels[] = {'-', 'E', 'W', 'I', 'D'};
+
+static const char *logCategories[] = {
+    "radio",
+    "lorawan",
+    "door",
+    "link",
+    "storage",
+    "system",
+};
+
+static const char *logCategory(uint8_t category)
+{
+    for (uint8_t i = 0; i < sizeof(logCategories) / sizeof(logCategories[0]); i++)
+    {
+        if (category & (1 << i))
+        {
+            return logCategories[i];
+        }
+    }
+    return "";
+}
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+void Logger::write(uint8_t level, uint8_t category, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vwrite(level, category, format, args);
+    va_end(args);
+}
+
+void Logger::vwrite(uint8_t level, uint8_t category, const char *format, va_list args)
+{
+    char text[LOG_MAX_MESSAGE];
+    int length = vsnprintf(text, sizeof(text), format, args);
+    if (length < 0)
+    {
+        return;
+    }
+    if (length >= (int)sizeof(text))
+    {
+        length = sizeof(text) - 1;
+    }
+    _append(level, category, LOG_KIND_TEXT, text, length, NULL, 0);
+}
+
+void Logger::dump(uint8_t level, uint8_t category, const char *label, const uint8_t *data, size_t length)
+{
+    if (length > LOG_MAX_DUMP)
+    {
+        length = LOG_MAX_DUMP;
+    }
+    _append(level, category, LOG_KIND_DUMP, &label, sizeof(label), data, length);
+}
+
+size_t Logger::read(char *buffer, size_t size)
+{
+    size_t copied = 0;
+    while (copied < size)
+    {
+        if (_linePosition == _lineLength && !_format())
+        {
+            break;
+        }
+
+        size_t n = _lineLength - _linePosition;
+        if (n > size - copied)
+        {
+            n = size - copied;
+        }
+        memcpy(buffer + copied, _line + _linePosition, n);
+        _linePosition += n;
+        copied += n;
+    }
+    return copied;
+}
+
+bool Logger::pending()
+{
+    return _linePosition != _lineLength || _head != _tail || dropped != _reportedDropped;
+}
+
+bool Logger::_append(uint8_t level, uint8_t category, uint8_t kind, const void *a, size_t aLength, const void *b, size_t bLength)
+{
+    size_t total = sizeof(Record) + aLength + bLength;
+    if (total > (size_t)(LOG_BUFFER_SIZE - (uint16_t)(_head - _tail)))
+    {
+        dropped++;
+        return false;
+    }
+
+    Record record = {(uint32_t)millis(), level, category, kind, (uint8_t)(aLength + bLength)};
+    _put(&record, sizeof(record));
+    _put(a, aLength);
+    _put(b, bLength);
+    return true;
+}
+
+void Logger::_put(const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < length; i++)
+    {
+        _buffer[_head++ & (LOG_BUFFER_SIZE - 1)] = bytes[i];
+    }
+}
+
+void Logger::_get(void *data, size_t length)
+{
+    uint8_t *bytes = (uint8_t *)data;
+    for (size_t i = 0; i < length; i++)
+    {
+        bytes[i] = _buffer[_tail++ & (LOG_BUFFER_SIZE - 1)];
+    }
+}
+
+// Format the oldest record into _line. Returns false when there is nothing left.
+bool Logger::_format()
+{
+    _linePosition = 0;
+    _lineLength = 0;
+
+    if (_head == _tail)
+    {
+        if (dropped == _reportedDropped)
+        {
+            return false;
+        }
+        _lineLength = snprintf(_line, sizeof(_line), "%lu messages dropped\r\n", (unsigned long)(dropped - _reportedDropped));
+        _reportedDropped = dropped;
+        return true;
+    }
+
+    Record record;
+    _get(&record, sizeof(record));
+    int n = snprintf(_line, sizeof(_line), "%lu %c %s: ", (unsigned long)record.time,
+                     record.level < sizeof(logLevels) ? logLevels[record.level] : '?', logCategory(record.category));
+
+    // Keep room for the line end
+    const int end = sizeof(_line) - 2;
+    size_t length = record.length;
+    if (record.kind == LOG_KIND_DUMP)
+    {
+        const char *label;
+        _get(&label, sizeof(label));
+        length -= sizeof(label);
+        n += snprintf(_line + n, end - n, "%s: ", label);
+        if (n > end)
+        {
+            n = end;
+        }
+    }
+
+    for (size_t i = 0; i < length; i++)
+    {
+        uint8_t c;
+        _get(&c, 1);
+        if (record.kind == LOG_KIND_DUMP)
+        {
+            if (n + 2 <= end)
+            {
+                _line[n++] = hexDigits[c >> 4];
+                _line[n++] = hexDigits[c & 0x0F];
+            }
+        }
+        else if (n < end)
+        {
+            _line[n++] = c;
+        }
+    }
+
+    _line[n++] = '\r';
+    _line[n++] = '\n';
+    _lineLength = n;
+    return true;
+}
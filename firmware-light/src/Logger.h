@@ -0,0 +1,128 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Messages above LOG_LEVEL are compiled out, set as build flag.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RADIO 0x01   // Frames from the radio
+#define LOG_LORAWAN 0x02 // Parsed messages and downlinks
+#define LOG_DOOR 0x04    // Door events
+#define LOG_LINK 0x08    // ESP-NOW
+#define LOG_STORAGE 0x10 // Journal and capture
+#define LOG_SYSTEM 0x20  // Setup
+#define LOG_ALL 0xFF
+
+// Categories left out of LOG_CATEGORIES are compiled out too.
+#ifndef LOG_CATEGORIES
+#define LOG_CATEGORIES LOG_ALL
+#endif
+
+#define LOG_BUFFER_SIZE 1024 // Bytes of records, must be a power of 2
+#define LOG_MAX_MESSAGE 96   // Longer messages are cut
+#define LOG_MAX_DUMP 64      // Longer dumps are cut
+#define LOG_MAX_LINE 192     // Longest formatted line
+
+// Buffered log. Messages are stored as records in a RAM ring and only
+// formatted into text when read() drains them, so logging from loop() costs
+// a copy instead of UART time. Hex dumps are kept as the raw bytes.
+// Not interrupt safe, log from loop() only.
+class Logger
+{
+public:
+    void write(uint8_t level, uint8_t category, const char *format, ...) __attribute__((format(printf, 4, 5)));
+    void vwrite(uint8_t level, uint8_t category, const char *format, va_list args);
+
+    // Label must outlive the record, a string literal.
+    void dump(uint8_t level, uint8_t category, const char *label, const uint8_t *data, size_t length);
+
+    // Copy up to size bytes of formatted lines to buffer, lines can be split
+    // over calls. Returns the number of bytes copied, 0 when empty.
+    size_t read(char *buffer, size_t size);
+    bool pending();
+
+    uint32_t dropped = 0; // Records that did not fit
+
+private:
+    typedef struct __attribute__((packed)) Record
+    {
+        uint32_t time; // millis()
+        uint8_t level;
+        uint8_t category;
+        uint8_t kind;
+        uint8_t length; // Bytes after the header
+    } Record;
+
+    uint8_t _buffer[LOG_BUFFER_SIZE];
+    uint16_t _head = 0; // Free running, masked on access
+    uint16_t _tail = 0;
+    uint32_t _reportedDropped = 0;
+
+    char _line[LOG_MAX_LINE];
+    uint16_t _lineLength = 0;
+    uint16_t _linePosition = 0;
+
+    bool _append(uint8_t level, uint8_t category, uint8_t kind, const void *a, size_t aLength, const void *b, size_t bLength);
+    void _put(const void *data, size_t length);
+    void _get(void *data, size_t length);
+    bool _format();
+};
+
+extern Logger logger;
+
+#define LOG_WRITE(level, category, ...)                 \
+    do                                                  \
+    {                                                   \
+        if ((category) & LOG_CATEGORIES)                \
+        {                                               \
+            logger.write(level, category, __VA_ARGS__); \
+        }                                               \
+    } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(category, ...) LOG_WRITE(LOG_LEVEL_ERROR, category, __VA_ARGS__)
+#else
+#define LOG_ERROR(category, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(category, ...) LOG_WRITE(LOG_LEVEL_WARN, category, __VA_ARGS__)
+#else
+#define LOG_WARN(category, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(category, ...) LOG_WRITE(LOG_LEVEL_INFO, category, __VA_ARGS__)
+#else
+#define LOG_INFO(category, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(category, ...) LOG_WRITE(LOG_LEVEL_DEBUG, category, __VA_ARGS__)
+#define LOG_DUMP(category, label, data, length)                          \
+    do                                                                   \
+    {                                                                    \
+        if ((category) & LOG_CATEGORIES)                                 \
+        {                                                                \
+            logger.dump(LOG_LEVEL_DEBUG, category, label, data, length); \
+        }                                                                \
+    } while (0)
+#else
+#define LOG_DEBUG(category, ...) ((void)0)
+#define LOG_DUMP(category, label, data, length) ((void)0)
+#endif
+
+#else
+#error "LOGGER_H not defined"
+#endif
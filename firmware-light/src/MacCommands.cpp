@@ -0,0 +1,116 @@
+#include "DeviceTable.h" // Includes MacCommands.h
+#include <string.h>
+
+void MacState::reset()
+{
+    memset(this, 0, sizeof(*this));
+    battery = MAC_BATTERY_UNKNOWN;
+}
+
+static void handleLinkCheck(MacCommands *commands, LoRaWanDevice *device, const uint8_t *args)
+{
+    device->mac.due |= MAC_DUE_LINK_CHECK;
+}
+
+static void handleLinkADR(MacCommands *commands, LoRaWanDevice *device, const uint8_t *args)
+{
+    AdrEngine::answer(&device->adr, args[0]);
+}
+
+static void handleDevStatus(MacCommands *commands, LoRaWanDevice *device, const uint8_t *args)
+{
+    device->mac.statusSent = false;
+    device->mac.battery = args[0];
+
+    // 6 bit signed
+    int8_t margin = args[1] & 0x3f;
+    device->mac.statusMargin = margin & 0x20 ? margin - 64 : margin;
+}
+
+static void handleSticky(MacCommands *commands, LoRaWanDevice *device, const uint8_t *args)
+{
+    device->mac.due |= MAC_DUE_DOWNLINK;
+}
+
+// Indexed by CID - MAC_LINK_CHECK
+static const MacCommandType macCommandTypes[] = {
+    {0, 2, handleLinkCheck}, // LinkCheck: margin, gateway count
+    {1, 4, handleLinkADR},   // LinkADR: status / data rate and power, channel mask, redundancy
+    {0, 1, NULL},            // DutyCycle: / max duty cycle
+    {1, 4, handleSticky},    // RXParamSetup: status / DL settings, frequency
+    {2, 0, handleDevStatus}, // DevStatus: battery, margin /
+    {1, 5, NULL},            // NewChannel: status / index, frequency, data rate range
+    {0, 1, handleSticky},    // RXTimingSetup: / delay
+    {0, 1, NULL},            // TxParamSetup: / dwell time and max EIRP
+    {1, 4, handleSticky},    // DlChannel: status / index, frequency
+};
+
+const MacCommandType *MacCommands::type(uint8_t cid)
+{
+    if (cid < MAC_LINK_CHECK || cid >= MAC_LINK_CHECK + sizeof(macCommandTypes) / sizeof(macCommandTypes[0]))
+    {
+        return NULL;
+    }
+    return &macCommandTypes[cid - MAC_LINK_CHECK];
+}
+
+bool MacCommands::parse(LoRaWanDevice *device, const uint8_t *data, uint8_t length, uint8_t margin)
+{
+    device->mac.margin = margin;
+
+    uint8_t i = 0;
+    while (i < length)
+    {
+        const MacCommandType *command = type(data[i]);
+        if (!command || command->upLength >= length - i)
+        {
+            // The length of what follows is unknown
+            unknown++;
+            return false;
+        }
+
+        if (command->handle)
+        {
+            command->handle(this, device, &data[i + 1]);
+        }
+        commands++;
+        i += 1 + command->upLength;
+    }
+    return true;
+}
+
+void MacCommands::uplink(LoRaWanDevice *device)
+{
+    if (device->mac.sinceStatus < UINT16_MAX)
+    {
+        device->mac.sinceStatus++;
+    }
+}
+
+bool MacCommands::due(LoRaWanDevice *device)
+{
+    return device->mac.due != 0;
+}
+
+uint8_t MacCommands::build(LoRaWanDevice *device, uint8_t *fOpts, uint8_t room)
+{
+    MacState *state = &device->mac;
+    uint8_t length = 0;
+
+    if (state->due & MAC_DUE_LINK_CHECK && room - length > type(MAC_LINK_CHECK)->downLength)
+    {
+        fOpts[length++] = MAC_LINK_CHECK;
+        fOpts[length++] = state->margin;
+        fOpts[length++] = 1; // Only 1 gateway
+    }
+
+    if (statusInterval != 0 && state->sinceStatus >= statusInterval && room - length > type(MAC_DEV_STATUS)->downLength)
+    {
+        fOpts[length++] = MAC_DEV_STATUS;
+        state->statusSent = true;
+        state->sinceStatus = 0;
+    }
+
+    state->due = 0;
+    return length;
+}
@@ -0,0 +1,84 @@
+#ifndef MACCOMMANDS_H
+#define MACCOMMANDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// LoRaWAN 1.0.2 MAC commands of class A. A request and its answer share the CID.
+#define MAC_LINK_CHECK 0x02      // LinkCheckReq up, LinkCheckAns down
+#define MAC_LINK_ADR 0x03        // LinkADRReq down, LinkADRAns up
+#define MAC_DUTY_CYCLE 0x04      // DutyCycleReq down, DutyCycleAns up
+#define MAC_RX_PARAM_SETUP 0x05  // RXParamSetupReq down, RXParamSetupAns up
+#define MAC_DEV_STATUS 0x06      // DevStatusReq down, DevStatusAns up
+#define MAC_NEW_CHANNEL 0x07     // NewChannelReq down, NewChannelAns up
+#define MAC_RX_TIMING_SETUP 0x08 // RXTimingSetupReq down, RXTimingSetupAns up
+#define MAC_TX_PARAM_SETUP 0x09  // TxParamSetupReq down, TxParamSetupAns up
+#define MAC_DL_CHANNEL 0x0A      // DlChannelReq down, DlChannelAns up
+
+#define MAC_MAX_FOPTS 15
+
+// Flags of MacState::due, what the next downlink has to carry
+#define MAC_DUE_LINK_CHECK 0x01 // LinkCheckAns
+#define MAC_DUE_DOWNLINK 0x02   // Anything, the device repeats a sticky answer until it gets a downlink
+
+#define MAC_BATTERY_UNKNOWN 255
+
+class LoRaWanDevice;
+class MacCommands;
+
+// MAC command state of one device. Kept in the device table, zeroed by reset().
+class MacState
+{
+public:
+    uint8_t due;    // MAC_DUE_ flags
+    uint8_t margin; // dB, for the LinkCheckAns
+
+    bool statusSent;      // DevStatusReq without an answer yet
+    uint16_t sinceStatus; // Uplinks since the last DevStatusReq
+    uint8_t battery;      // Of the last DevStatusAns: 0 external power, 1 to 254 level, 255 unknown
+    int8_t statusMargin;  // Of the last DevStatusAns: SNR in dB of our last downlink
+
+    void reset();
+};
+
+typedef struct MacCommandType
+{
+    uint8_t upLength;   // Bytes after the CID, sent by the device
+    uint8_t downLength; // Bytes after the CID, sent by us
+    void (*handle)(MacCommands *commands, LoRaWanDevice *device, const uint8_t *args); // Uplink, NULL if nothing to do
+} MacCommandType;
+
+// Decoder and encoder of the MAC commands in FOpts and in the FRMPayload of
+// port 0. Every command of an uplink is looked up in a table by CID for its
+// length and handler, so commands after the first are not lost. Answers
+// are collected in the MacState of the device and sent together in the next
+// downlink. LinkADRReq is added by the AdrEngine.
+class MacCommands
+{
+public:
+    uint16_t statusInterval = 0; // Uplinks between DevStatusReq, 0 to never ask. Only sent along with another downlink.
+
+    uint32_t commands = 0; // Decoded
+    uint32_t unknown = 0;  // Uplinks with an unknown or cut off command, what followed it was lost
+
+    // Decode the commands of an uplink of device. margin is the link margin
+    // of the uplink in dB. Returns false if decoding stopped early.
+    bool parse(LoRaWanDevice *device, const uint8_t *data, uint8_t length, uint8_t margin);
+
+    // Count an uplink of device, for statusInterval.
+    void uplink(LoRaWanDevice *device);
+
+    // Whether device needs a downlink for its answers.
+    bool due(LoRaWanDevice *device);
+
+    // Encode what is due for device into fOpts. Returns the bytes written,
+    // at most room. What did not fit is dropped.
+    uint8_t build(LoRaWanDevice *device, uint8_t *fOpts, uint8_t room);
+
+    // Type of cid, NULL if unknown.
+    static const MacCommandType *type(uint8_t cid);
+};
+
+#else
+#error "MACCOMMANDS_H not defined"
+#endif
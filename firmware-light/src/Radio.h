@@ -0,0 +1,190 @@
+//
+//  Radio.h
+//  LoRa radio used by main.cpp. Both backends expose the same interface, the
+//  one used is selected at compile time:
+//
+//    RadioLoRa  SX127x through the sandeepmistry LoRa library, on the board.
+//    RadioSim   Simulated SX127x on the host, for tests and benchmarks. It
+//               has its own clock, models time on air, turnaround, IQ
+//               inversion, collisions and a packet error rate.
+//
+
+#ifndef RADIO_H
+#define RADIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "Airtime.h"
+
+#define RADIO_SYNC_WORD 0x34 // LoRaWAN public network
+
+class RadioLoRa
+{
+public:
+    void setPins(int8_t cs, int8_t reset, int8_t irq);
+    bool begin(uint32_t frequency);
+
+    void setFrequency(uint32_t frequency);
+    void setSpreadingFactor(uint8_t spreadingFactor);
+    void setBandwidth(uint32_t bandwidth);
+    void setCodingRate(uint8_t denominator);
+    void setSyncWord(uint8_t syncWord);
+    void setInvertIQ(bool inverted);
+
+    void receive(); // Continuous, onReceive for every frame
+    void cad();     // Channel activity detection, onCadDone when done
+    void idle();
+
+    // Start sending buffer, onTxDone when done.
+    bool transmit(const uint8_t *buffer, uint8_t length);
+
+    // Only from onReceive. Copies at most size bytes of the frame, returns the number copied.
+    uint8_t read(uint8_t *buffer, uint8_t size);
+    int16_t packetRssi();
+    int8_t packetSnr(); // In steps of 0.25 dB
+
+    void onReceive(void (*callback)(int));
+    void onTxDone(void (*callback)());
+    void onCadDone(void (*callback)(bool));
+};
+
+#define RADIO_SIM_FRAMES 32       // Frames on the air at the same time
+#define RADIO_SIM_MAX_FRAME 64
+#define RADIO_SIM_TRANSMISSIONS 16 // Own transmissions kept for inspection
+#define RADIO_SIM_TURNAROUND 100   // Micros to switch between receive and transmit
+#define RADIO_SIM_CAD_SYMBOLS 2    // Duration of a CAD
+#define RADIO_SIM_LOCK_SYMBOLS 4   // Preamble symbols the receiver needs to sync
+#define RADIO_SIM_CAPTURE 6        // dB stronger to survive a collision
+
+typedef struct RadioSimTransmission
+{
+    uint32_t start; // First symbol on the air
+    uint32_t end;
+    uint32_t frequency;
+    uint8_t spreadingFactor;
+    bool invertIQ;
+    uint8_t length;
+} RadioSimTransmission;
+
+class RadioSim
+{
+public:
+    void setPins(int8_t cs, int8_t reset, int8_t irq) {}
+    bool begin(uint32_t frequency);
+
+    void setFrequency(uint32_t frequency);
+    void setSpreadingFactor(uint8_t spreadingFactor);
+    void setBandwidth(uint32_t bandwidth);
+    void setCodingRate(uint8_t denominator);
+    void setSyncWord(uint8_t syncWord) {}
+    void setInvertIQ(bool inverted);
+
+    void receive();
+    void cad();
+    void idle();
+
+    bool transmit(const uint8_t *buffer, uint8_t length);
+
+    uint8_t read(uint8_t *buffer, uint8_t size);
+    int16_t packetRssi() { return _rssi; }
+    int8_t packetSnr() { return _snr; }
+
+    void onReceive(void (*callback)(int)) { _onReceive = callback; }
+    void onTxDone(void (*callback)()) { _onTxDone = callback; }
+    void onCadDone(void (*callback)(bool)) { _onCadDone = callback; }
+
+    // Simulation. Times are micros on the clock of the simulator.
+    uint32_t now() { return _now; }
+
+    // Move the clock to until, calling the callbacks of everything that happens on the way.
+    void run(uint32_t until);
+
+    // Put a frame from another device on the air. Returns false if too many are on the air.
+    bool inject(uint32_t frequency, uint8_t spreadingFactor, bool invertIQ, uint32_t start,
+                const uint8_t *data, uint8_t length, int16_t rssi = -80, int8_t snr = 28);
+
+    void seed(uint32_t seed) { _random = seed ? seed : 1; }
+
+    // Own transmissions, oldest first
+    uint8_t transmissions();
+    const RadioSimTransmission *transmission(uint8_t index);
+
+    uint16_t packetErrorRate = 0; // Frames per 1000 with a CRC error
+    uint32_t turnaround = RADIO_SIM_TURNAROUND;
+
+    // Outcome of injected frames
+    uint32_t received = 0;
+    uint32_t collisions = 0;
+    uint32_t corrupted = 0;
+    uint32_t missed = 0; // Not receiving on that channel, or not in time for the preamble
+    uint32_t transmitted = 0;
+
+private:
+    enum Mode : uint8_t
+    {
+        MODE_STANDBY = 0,
+        MODE_RECEIVE,
+        MODE_TRANSMIT,
+        MODE_CAD,
+    };
+
+    typedef struct Frame
+    {
+        bool used;
+        bool collided;
+        bool corrupt;
+        uint32_t frequency;
+        uint8_t spreadingFactor;
+        bool invertIQ;
+        uint32_t start;
+        uint32_t preambleEnd;
+        uint32_t end;
+        int16_t rssi;
+        int8_t snr;
+        uint8_t length;
+        uint8_t data[RADIO_SIM_MAX_FRAME];
+    } Frame;
+
+    uint32_t _now = 0;
+    Mode _mode = MODE_STANDBY;
+    uint32_t _modeSince = 0; // Receiving with the current settings since
+    uint32_t _modeEnd = 0;   // End of the transmission or CAD
+
+    uint32_t _frequency = 0;
+    uint8_t _spreadingFactor = 7;
+    uint32_t _bandwidth = LORA_BANDWIDTH;
+    uint8_t _codingRate = LORA_CODING_RATE;
+    bool _invertIQ = false;
+
+    Frame _frames[RADIO_SIM_FRAMES] = {};
+    uint8_t _fifo[RADIO_SIM_MAX_FRAME];
+    uint8_t _fifoLength = 0;
+    int16_t _rssi = 0;
+    int8_t _snr = 0;
+
+    RadioSimTransmission _transmissions[RADIO_SIM_TRANSMISSIONS];
+    uint32_t _transmissionCount = 0;
+
+    uint32_t _random = 1;
+
+    void (*_onReceive)(int) = NULL;
+    void (*_onTxDone)() = NULL;
+    void (*_onCadDone)(bool) = NULL;
+
+    void _setMode(Mode mode);
+    bool _matches(Frame *frame);
+    void _endFrame(Frame *frame);
+    bool _detect(uint32_t start);
+    uint32_t _nextRandom();
+};
+
+#if defined(ESP8266)
+typedef RadioLoRa Radio;
+#else
+typedef RadioSim Radio;
+#endif
+
+#else
+#error "RADIO_H not defined"
+#endif
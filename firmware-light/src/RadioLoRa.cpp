@@ -0,0 +1,118 @@
+#include "Radio.h"
+
+#if defined(ESP8266)
+#include <LoRa.h>
+
+void RadioLoRa::setPins(int8_t cs, int8_t reset, int8_t irq)
+{
+    LoRa.setPins(cs, reset, irq);
+}
+
+bool RadioLoRa::begin(uint32_t frequency)
+{
+    return LoRa.begin(frequency);
+}
+
+void RadioLoRa::setFrequency(uint32_t frequency)
+{
+    LoRa.setFrequency(frequency);
+}
+
+void RadioLoRa::setSpreadingFactor(uint8_t spreadingFactor)
+{
+    LoRa.setSpreadingFactor(spreadingFactor);
+}
+
+void RadioLoRa::setBandwidth(uint32_t bandwidth)
+{
+    LoRa.setSignalBandwidth(bandwidth);
+}
+
+void RadioLoRa::setCodingRate(uint8_t denominator)
+{
+    LoRa.setCodingRate4(denominator);
+}
+
+void RadioLoRa::setSyncWord(uint8_t syncWord)
+{
+    LoRa.setSyncWord(syncWord);
+}
+
+void RadioLoRa::setInvertIQ(bool inverted)
+{
+    if (inverted)
+    {
+        LoRa.enableInvertIQ();
+    }
+    else
+    {
+        LoRa.disableInvertIQ();
+    }
+}
+
+void RadioLoRa::receive()
+{
+    LoRa.receive();
+}
+
+void RadioLoRa::cad()
+{
+    LoRa.channelActivityDetection();
+}
+
+void RadioLoRa::idle()
+{
+    LoRa.idle();
+}
+
+bool RadioLoRa::transmit(const uint8_t *buffer, uint8_t length)
+{
+    if (!LoRa.beginPacket())
+    {
+        return false;
+    }
+    LoRa.write(buffer, length);
+    return LoRa.endPacket(true); // Async, onTxDone when sent
+}
+
+uint8_t RadioLoRa::read(uint8_t *buffer, uint8_t size)
+{
+    // Drain the whole FIFO, also what does not fit
+    uint8_t length = 0;
+    while (LoRa.available())
+    {
+        uint8_t value = LoRa.read();
+        if (length < size)
+        {
+            buffer[length++] = value;
+        }
+    }
+    return length;
+}
+
+int16_t RadioLoRa::packetRssi()
+{
+    return LoRa.packetRssi();
+}
+
+int8_t RadioLoRa::packetSnr()
+{
+    return LoRa.packetSnr() * 4;
+}
+
+void RadioLoRa::onReceive(void (*callback)(int))
+{
+    LoRa.onReceive(callback);
+}
+
+void RadioLoRa::onTxDone(void (*callback)())
+{
+    LoRa.onTxDone(callback);
+}
+
+void RadioLoRa::onCadDone(void (*callback)(bool))
+{
+    LoRa.onCadDone(callback);
+}
+
+#endif
@@ -0,0 +1,277 @@
+#include "Radio.h"
+
+#if !defined(ESP8266)
+#include <string.h>
+
+bool RadioSim::begin(uint32_t frequency)
+{
+    _frequency = frequency;
+    _setMode(MODE_STANDBY);
+    return true;
+}
+
+void RadioSim::setFrequency(uint32_t frequency)
+{
+    _frequency = frequency;
+    _modeSince = _now;
+}
+
+void RadioSim::setSpreadingFactor(uint8_t spreadingFactor)
+{
+    _spreadingFactor = spreadingFactor;
+    _modeSince = _now;
+}
+
+void RadioSim::setBandwidth(uint32_t bandwidth)
+{
+    _bandwidth = bandwidth;
+    _modeSince = _now;
+}
+
+void RadioSim::setCodingRate(uint8_t denominator)
+{
+    _codingRate = denominator;
+}
+
+void RadioSim::setInvertIQ(bool inverted)
+{
+    _invertIQ = inverted;
+    _modeSince = _now;
+}
+
+void RadioSim::receive()
+{
+    _setMode(MODE_RECEIVE);
+    if (_transmissionCount && _now < _transmissions[(_transmissionCount - 1) % RADIO_SIM_TRANSMISSIONS].end + turnaround)
+    {
+        // Still switching from transmit
+        _modeSince = _transmissions[(_transmissionCount - 1) % RADIO_SIM_TRANSMISSIONS].end + turnaround;
+    }
+}
+
+void RadioSim::cad()
+{
+    _setMode(MODE_CAD);
+    _modeEnd = _now + RADIO_SIM_CAD_SYMBOLS * loraSymbolTime(_spreadingFactor, _bandwidth);
+}
+
+void RadioSim::idle()
+{
+    _setMode(MODE_STANDBY);
+}
+
+bool RadioSim::transmit(const uint8_t *buffer, uint8_t length)
+{
+    if (_mode == MODE_TRANSMIT)
+    {
+        return false;
+    }
+
+    _setMode(MODE_TRANSMIT);
+    RadioSimTransmission *t = &_transmissions[_transmissionCount++ % RADIO_SIM_TRANSMISSIONS];
+    t->start = _now + turnaround;
+    t->end = t->start + loraAirtime(_spreadingFactor, length, _bandwidth, _codingRate);
+    t->frequency = _frequency;
+    t->spreadingFactor = _spreadingFactor;
+    t->invertIQ = _invertIQ;
+    t->length = length;
+    _modeEnd = t->end;
+    return true;
+}
+
+uint8_t RadioSim::read(uint8_t *buffer, uint8_t size)
+{
+    uint8_t length = _fifoLength < size ? _fifoLength : size;
+    memcpy(buffer, _fifo, length);
+    _fifoLength = 0;
+    return length;
+}
+
+void RadioSim::run(uint32_t until)
+{
+    while (true)
+    {
+        // Next event: the end of a frame, a transmission or a CAD
+        uint32_t next = until;
+        Frame *frame = NULL;
+        for (uint8_t i = 0; i < RADIO_SIM_FRAMES; i++)
+        {
+            if (_frames[i].used && (int32_t)(_frames[i].end - next) <= 0 && (!frame || _frames[i].end < frame->end))
+            {
+                frame = &_frames[i];
+            }
+        }
+        bool modeEnds = (_mode == MODE_TRANSMIT || _mode == MODE_CAD) && (int32_t)(_modeEnd - next) <= 0 &&
+                        (!frame || _modeEnd <= frame->end);
+
+        if (modeEnds)
+        {
+            _now = _modeEnd > _now ? _modeEnd : _now;
+            if (_mode == MODE_TRANSMIT)
+            {
+                transmitted++;
+                _setMode(MODE_STANDBY);
+                if (_onTxDone)
+                {
+                    _onTxDone();
+                }
+            }
+            else
+            {
+                bool detected = _detect(_modeEnd - RADIO_SIM_CAD_SYMBOLS * loraSymbolTime(_spreadingFactor, _bandwidth));
+                _setMode(MODE_STANDBY);
+                if (_onCadDone)
+                {
+                    _onCadDone(detected);
+                }
+            }
+        }
+        else if (frame)
+        {
+            _now = frame->end > _now ? frame->end : _now;
+            _endFrame(frame);
+        }
+        else
+        {
+            _now = until;
+            return;
+        }
+    }
+}
+
+bool RadioSim::inject(uint32_t frequency, uint8_t spreadingFactor, bool invertIQ, uint32_t start,
+                      const uint8_t *data, uint8_t length, int16_t rssi, int8_t snr)
+{
+    Frame *frame = NULL;
+    for (uint8_t i = 0; i < RADIO_SIM_FRAMES && !frame; i++)
+    {
+        if (!_frames[i].used)
+        {
+            frame = &_frames[i];
+        }
+    }
+    if (!frame || length > RADIO_SIM_MAX_FRAME)
+    {
+        return false;
+    }
+
+    frame->used = true;
+    frame->collided = false;
+    frame->corrupt = _nextRandom() % 1000 < packetErrorRate;
+    frame->frequency = frequency;
+    frame->spreadingFactor = spreadingFactor;
+    frame->invertIQ = invertIQ;
+    frame->start = start;
+    frame->preambleEnd = start + loraPreambleTime(spreadingFactor, _bandwidth);
+    frame->end = start + loraAirtime(spreadingFactor, length, _bandwidth, _codingRate);
+    frame->rssi = rssi;
+    frame->snr = snr;
+    frame->length = length;
+    memcpy(frame->data, data, length);
+
+    // Frames on the same channel and spreading factor that overlap destroy
+    // each other, unless one is RADIO_SIM_CAPTURE dB stronger.
+    for (uint8_t i = 0; i < RADIO_SIM_FRAMES; i++)
+    {
+        Frame *other = &_frames[i];
+        if (other == frame || !other->used || other->frequency != frequency || other->spreadingFactor != spreadingFactor ||
+            other->end <= frame->start || frame->end <= other->start)
+        {
+            continue;
+        }
+        if (frame->rssi < other->rssi + RADIO_SIM_CAPTURE)
+        {
+            frame->collided = true;
+        }
+        if (other->rssi < frame->rssi + RADIO_SIM_CAPTURE)
+        {
+            other->collided = true;
+        }
+    }
+    return true;
+}
+
+uint8_t RadioSim::transmissions()
+{
+    return _transmissionCount < RADIO_SIM_TRANSMISSIONS ? _transmissionCount : RADIO_SIM_TRANSMISSIONS;
+}
+
+const RadioSimTransmission *RadioSim::transmission(uint8_t index)
+{
+    if (index >= transmissions())
+    {
+        return NULL;
+    }
+    uint32_t first = _transmissionCount - transmissions();
+    return &_transmissions[(first + index) % RADIO_SIM_TRANSMISSIONS];
+}
+
+void RadioSim::_setMode(Mode mode)
+{
+    _mode = mode;
+    _modeSince = _now;
+}
+
+bool RadioSim::_matches(Frame *frame)
+{
+    return frame->frequency == _frequency && frame->spreadingFactor == _spreadingFactor && frame->invertIQ == _invertIQ;
+}
+
+void RadioSim::_endFrame(Frame *frame)
+{
+    frame->used = false;
+
+    // Receiving on its channel all the time since early enough in the preamble
+    uint32_t lock = frame->preambleEnd - RADIO_SIM_LOCK_SYMBOLS * loraSymbolTime(frame->spreadingFactor, _bandwidth);
+    if (_mode != MODE_RECEIVE || !_matches(frame) || (int32_t)(_modeSince - lock) > 0)
+    {
+        missed++;
+        return;
+    }
+    if (frame->collided)
+    {
+        collisions++;
+        return;
+    }
+    if (frame->corrupt)
+    {
+        corrupted++;
+        return;
+    }
+
+    received++;
+    memcpy(_fifo, frame->data, frame->length);
+    _fifoLength = frame->length;
+    _rssi = frame->rssi;
+    _snr = frame->snr;
+    if (_onReceive)
+    {
+        _onReceive(frame->length);
+    }
+}
+
+// A preamble on the current channel covers the whole CAD from start
+bool RadioSim::_detect(uint32_t start)
+{
+    uint32_t end = start + RADIO_SIM_CAD_SYMBOLS * loraSymbolTime(_spreadingFactor, _bandwidth);
+    for (uint8_t i = 0; i < RADIO_SIM_FRAMES; i++)
+    {
+        Frame *frame = &_frames[i];
+        if (frame->used && _matches(frame) && (int32_t)(start - frame->start) >= 0 && (int32_t)(frame->preambleEnd - end) >= 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t RadioSim::_nextRandom()
+{
+    // xorshift32, reproducible runs
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    return _random;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#include "ReceiveQueue.h"
+
+#if defined(ESP8266)
+#include <Arduino.h>
+#define QUEUE_ISR IRAM_ATTR // Called from the DIO0 interrupt
+#else
+#define QUEUE_ISR
+#endif
+
+// Keep the compiler from moving slot accesses across an index update.
+// The ESP8266 has a single core, so no hardware barrier is needed.
+#define BARRIER() __asm__ __volatile__("" ::: "memory")
+
+QUEUE_ISR struct_received_frame *ReceiveQueue::reserve()
+{
+    if ((uint8_t)(_head - _tail) >= RECEIVE_QUEUE_SIZE)
+    {
+        overflows++;
+        return NULL;
+    }
+
+    return &_slots[_head & (RECEIVE_QUEUE_SIZE - 1)];
+}
+
+QUEUE_ISR void ReceiveQueue::publish()
+{
+    BARRIER();
+    _head++;
+}
+
+struct_received_frame *ReceiveQueue::peek()
+{
+    if (_head == _tail)
+    {
+        return NULL;
+    }
+
+    BARRIER();
+    return &_slots[_tail & (RECEIVE_QUEUE_SIZE - 1)];
+}
+
+void ReceiveQueue::pop()
+{
+    BARRIER();
+    _tail++;
+}
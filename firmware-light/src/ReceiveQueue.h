@@ -0,0 +1,46 @@
+#ifndef RECEIVEQUEUE_H
+#define RECEIVEQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECEIVE_QUEUE_SIZE 8 // Frame slots, must be a power of 2
+#define RECEIVE_MAX_FRAME 64
+
+typedef struct struct_received_frame
+{
+    uint32_t time;      // millis() at RxDone
+    uint32_t timestamp; // micros() at RxDone, for downlink timing
+    uint32_t cycles;    // traceCycles() at RxDone, see Trace.h
+    int16_t rssi;  // dBm
+    int8_t snr;    // In steps of 0.25 dB
+    uint8_t length;
+    uint8_t data[RECEIVE_MAX_FRAME];
+} struct_received_frame;
+
+// Single producer, single consumer ring of received frames. The DIO0
+// interrupt drains the radio FIFO into a slot right away, so a second frame
+// can not overwrite the first while loop() is busy. Lock free: only the
+// producer writes _head and only the consumer writes _tail.
+class ReceiveQueue
+{
+public:
+    // Producer, called from the interrupt. Returns NULL if the queue is full.
+    struct_received_frame *reserve();
+    void publish();
+
+    // Consumer, called from loop(). Returns NULL if the queue is empty.
+    struct_received_frame *peek();
+    void pop();
+
+    volatile uint32_t overflows = 0;
+
+private:
+    struct_received_frame _slots[RECEIVE_QUEUE_SIZE];
+    volatile uint8_t _head = 0;
+    volatile uint8_t _tail = 0;
+};
+
+#else
+#error "RECEIVEQUEUE_H not defined"
+#endif
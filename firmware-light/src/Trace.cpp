@@ -0,0 +1,155 @@
+#include "Trace.h"
+#include <string.h>
+
+#if !defined(ESP8266)
+#include <chrono>
+
+uint32_t traceHostCycles()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+Trace trace;
+
+static const char *traceNames[TRACE_STAGES] = {
+    "fifo drain",
+    "populate",
+    "validate mic",
+    "decrypt",
+    "handle",
+    "show",
+    "esp-now",
+    "loop",
+};
+
+void Trace::begin(uint32_t origin)
+{
+    _origin = origin;
+    _active = true;
+}
+
+void Trace::mark(uint8_t stage)
+{
+    if (_active)
+    {
+        record(stage, traceCycles() - _origin);
+    }
+}
+
+void Trace::loop()
+{
+    uint32_t now = traceCycles();
+    if (_lastLoop != 0)
+    {
+        record(TRACE_LOOP, now - _lastLoop);
+    }
+    _lastLoop = now;
+}
+
+TRACE_ISR void Trace::record(uint8_t stage, uint32_t cycles)
+{
+    if (stage >= TRACE_STAGES)
+    {
+        return;
+    }
+
+    Histogram *h = &_histograms[stage];
+    if (h->count == 0 || cycles < h->min)
+    {
+        h->min = cycles;
+    }
+    if (cycles > h->max)
+    {
+        h->max = cycles;
+    }
+    h->count++;
+    h->sum += cycles;
+
+    uint16_t *bucket = &h->buckets[_bucket(cycles)];
+    if (*bucket != UINT16_MAX)
+    {
+        (*bucket)++;
+    }
+}
+
+TraceStats Trace::stats(uint8_t stage)
+{
+    TraceStats stats = {};
+    if (stage >= TRACE_STAGES || _histograms[stage].count == 0)
+    {
+        return stats;
+    }
+
+    Histogram *h = &_histograms[stage];
+    stats.count = h->count;
+    stats.min = h->min / TRACE_CYCLES_PER_US;
+    stats.avg = h->sum / h->count / TRACE_CYCLES_PER_US;
+    stats.max = h->max / TRACE_CYCLES_PER_US;
+
+    // Upper bound of the bucket that holds the 99th percentile. Bucket counts
+    // saturate, so use their sum instead of h->count.
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < TRACE_BUCKETS; i++)
+    {
+        total += h->buckets[i];
+    }
+
+    uint32_t rank = total - total / 100;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < TRACE_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+        {
+            uint32_t top = _bucketTop(i);
+            stats.p99 = (top < h->max ? top : h->max) / TRACE_CYCLES_PER_US;
+            break;
+        }
+    }
+    return stats;
+}
+
+void Trace::reset()
+{
+    memset(_histograms, 0, sizeof(_histograms));
+    _lastLoop = 0;
+}
+
+const char *Trace::name(uint8_t stage)
+{
+    return stage < TRACE_STAGES ? traceNames[stage] : "";
+}
+
+TRACE_ISR uint8_t Trace::_bucket(uint32_t cycles)
+{
+    // Values below TRACE_SUB_BUCKETS get a bucket each, above that the
+    // octave of the highest bit is split by the TRACE_SUB_BITS below it.
+    // No __builtin_clz, it is not in IRAM on the ESP8266.
+    if (cycles < TRACE_SUB_BUCKETS)
+    {
+        return cycles;
+    }
+
+    uint8_t octave = TRACE_SUB_BITS;
+    for (uint32_t rest = cycles >> (TRACE_SUB_BITS + 1); rest; rest >>= 1)
+    {
+        octave++;
+    }
+
+    uint8_t sub = (cycles >> (octave - TRACE_SUB_BITS)) & (TRACE_SUB_BUCKETS - 1);
+    return (octave - TRACE_SUB_BITS + 1) * TRACE_SUB_BUCKETS + sub;
+}
+
+uint32_t Trace::_bucketTop(uint8_t bucket)
+{
+    if (bucket < TRACE_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    uint8_t octave = bucket / TRACE_SUB_BUCKETS + TRACE_SUB_BITS - 1;
+    uint8_t sub = bucket % TRACE_SUB_BUCKETS;
+    uint64_t top = ((uint64_t)(TRACE_SUB_BUCKETS + sub + 1) << (octave - TRACE_SUB_BITS)) - 1;
+    return top > UINT32_MAX ? UINT32_MAX : top;
+}
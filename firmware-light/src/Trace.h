@@ -0,0 +1,120 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Set TRACE_ENABLED to 0 as build flag to compile all trace points out.
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+#define TRACE_SUB_BITS 2 // Split every power of 2 in 4 histogram buckets, p99 is accurate to 1/4 of its octave
+#define TRACE_SUB_BUCKETS (1 << TRACE_SUB_BITS)
+#define TRACE_BUCKETS (32 * TRACE_SUB_BUCKETS)
+
+#if defined(ESP8266)
+#include <Arduino.h>
+#define TRACE_ISR IRAM_ATTR // Called from the DIO0 interrupt
+#define TRACE_CYCLES_PER_US (F_CPU / 1000000)
+#else
+#define TRACE_ISR
+#define TRACE_CYCLES_PER_US 1000 // The host counts nanoseconds
+uint32_t traceHostCycles();
+#endif
+
+// Points of the receive path, from the radio interrupt to the leds and the relay.
+// All but TRACE_LOOP are measured from the start of the radio interrupt.
+enum TraceStage : uint8_t
+{
+    TRACE_FIFO_DRAIN = 0, // Frame copied out of the radio FIFO
+    TRACE_POPULATE,       // PHYPayload parsed
+    TRACE_VALIDATE_MIC,   // After every MIC attempt
+    TRACE_DECRYPT,        // FRMPayload decrypted
+    TRACE_HANDLE,         // handleLDS02 done
+    TRACE_SHOW,           // FastLED.show done
+    TRACE_ESPNOW,         // esp_now_send done
+    TRACE_LOOP,           // Time between two loop() passes
+    TRACE_STAGES
+};
+
+typedef struct TraceStats
+{
+    uint32_t count;
+    uint32_t min; // All in micros
+    uint32_t avg;
+    uint32_t p99;
+    uint32_t max;
+} TraceStats;
+
+static inline uint32_t traceCycles()
+{
+#if defined(ESP8266)
+    uint32_t ccount;
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+#else
+    return traceHostCycles();
+#endif
+}
+
+// Histograms of the time to every trace point. Values are kept in cycles,
+// in buckets that grow with powers of 2, so recording is a few shifts and
+// an increment. Durations of more than 2^32 cycles, 53 s at 80 MHz, wrap.
+class Trace
+{
+public:
+    // Start timing a frame whose radio interrupt started at cycle origin.
+    void begin(uint32_t origin);
+    void end() { _active = false; }
+
+    // Record the time since begin() for stage, if a frame is being timed.
+    void mark(uint8_t stage);
+
+    // Record the time since the previous call for TRACE_LOOP.
+    void loop();
+
+    TRACE_ISR void record(uint8_t stage, uint32_t cycles);
+    TraceStats stats(uint8_t stage);
+    void reset();
+
+    static const char *name(uint8_t stage);
+
+private:
+    struct Histogram
+    {
+        uint32_t count;
+        uint32_t min;
+        uint32_t max;
+        uint64_t sum;
+        uint16_t buckets[TRACE_BUCKETS];
+    };
+
+    Histogram _histograms[TRACE_STAGES] = {};
+    uint32_t _origin = 0;
+    bool _active = false;
+    uint32_t _lastLoop = 0;
+
+    TRACE_ISR static uint8_t _bucket(uint32_t cycles);
+    static uint32_t _bucketTop(uint8_t bucket);
+};
+
+extern Trace trace;
+
+#if TRACE_ENABLED
+#define TRACE_BEGIN(origin) trace.begin(origin)
+#define TRACE_END() trace.end()
+#define TRACE_MARK(stage) trace.mark(stage)
+#define TRACE_RECORD(stage, cycles) trace.record(stage, cycles)
+#define TRACE_LOOP_MARK() trace.loop()
+#else
+#define TRACE_BEGIN(origin) ((void)0)
+#define TRACE_END() ((void)0)
+#define TRACE_MARK(stage) ((void)0)
+#define TRACE_RECORD(stage, cycles) ((void)0)
+#define TRACE_LOOP_MARK() ((void)0)
+#endif
+
+#else
+#error "TRACE_H not defined"
+#endif
@@ -1,30 +1,70 @@
-#include <SPI.h>
-#include <LoRa.h>
 #define FASTLED_ESP8266_RAW_PIN_ORDER
 #include <FastLED.h>
 #include <Preferences.h>
 #include <espnow.h>
 #include <ESP8266WiFi.h>
+#include <Ticker.h>
 #include "LoRaWanP2P.h"
-
-// We can only use a single channel
+#include "FrameCapture.h"
+#include "CounterJournal.h"
+#include "ReceiveQueue.h"
+#include "DownlinkScheduler.h"
+#include "LightEngine.h"
+#include "Arbiter.h"
+#include "Trace.h"
+#include "Logger.h"
+#include "ChannelScanner.h"
+#include "Radio.h"
+#include "DutyCycle.h"
+
+// A single channel, unless SCAN_ENABLED
 #define FREQUENCY 868100000 // LoRa Frequency
 #define SPREADING_FACTOR 9  // DR3
-uint8_t devAddr[4] = {0x00, 0x98, 0x13, 0x59};
-uint8_t appSKey[16] = {0x3e, 0x3e, 0x4c, 0x4b, 0xe1, 0xa6, 0x91, 0x12,
-                       0xa2, 0xa2, 0x86, 0x37, 0x9a, 0xd6, 0x34, 0x14};
-uint8_t nwkSKey[16] = {0xef, 0x9c, 0x2a, 0x59, 0xaa, 0x21, 0x45, 0xeb,
-                       0x41, 0xac, 0x61, 0xf4, 0xd3, 0x21, 0xe9, 0x1f};
 
-// Forward message via ESP-NOW
+// Scan the EU868 channels of a stock LDS02 at all spreading factors with
+// channel activity detection, instead of listening on FREQUENCY only. A
+// frame is only caught when its preamble is seen, so fewer spreading
+// factors catch more frames. Send 'r' over serial to see the hit rates.
+#define SCAN_ENABLED false
+#define SCAN_MIN_SF 7
+#define SCAN_MAX_SF 12
+const uint32_t scanFrequencies[] = {868100000, 868300000, 868500000, 867100000, 867300000, 867500000, 867700000, 867900000};
+static_assert(sizeof(scanFrequencies) / sizeof(scanFrequencies[0]) <= SCAN_MAX_CHANNELS, "Too many scan channels");
+
+// Adaptive data rate for devices that set the ADR bit: after 20 uplinks they
+// are asked to lower their spreading factor, then their power, as far as the
+// SNR allows. Only spreading factors we receive on are offered. The channel
+// mask enables the channels we listen on, channel 0 is FREQUENCY and with
+// SCAN_ENABLED channels 0 to 7 are scanFrequencies. Send 'a' for the
+// airtime saved per door.
+#define ADR_ENABLED true
+#define ADR_CHANNEL_MASK (SCAN_ENABLED ? 0x00FF : 0x0001)
+
+// Ask doors for their battery level and link margin with a DevStatusReq
+// every this many uplinks, 0 to never ask. It only goes along with a
+// downlink that is sent anyway. Shown with 'a' too.
+#define DEV_STATUS_INTERVAL 64
+
+// Downlinks that miss RX1 are sent in RX2 (EU868 defaults)
+#define RX2_FREQUENCY 869525000
+#define RX2_SPREADING_FACTOR 12 // DR0
+
+// Forward door events via ESP-NOW, see DoorLink.h
 uint8_t broadcastAddress[] = {0xF4, 0xCF, 0xA2, 0x16, 0x47, 0x4D};
-typedef struct struct_esp_now_message
-{
-  unsigned int batteryVoltage;
-  bool doorOpened;
-} struct_esp_now_message;
+uint8_t linkKey[16] = {0x20, 0xe4, 0x33, 0xb6, 0x6f, 0xa1, 0xcd, 0x5f, 0xba, 0xa5, 0x38, 0x85, 0x0a, 0xe3, 0xc6, 0x4b}; // Same as the relay
+#define LIGHT_ID 0    // Sender id of this light on the link, unique per light
+#define LINK_ACK true // Resend events until the relay acks them
 
-struct_esp_now_message espNowMessage;
+// When several lights hear the same uplink, only the one that heard it best
+// answers, the others still show it. The lights broadcast claims to each
+// other, see Arbiter.h. Send 's' to see how often this light answered.
+#define ARBITRATION_ENABLED true
+uint8_t claimAddress[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}; // All lights
+static_assert(ARBITER_WINDOW + DOWNLINK_MAX_LEAD < 1000000UL, "Arbitration must end before RX1");
+
+AES_Context linkContext;
+DoorLink doorLink;
+Arbiter arbiter;
 
 // Colors
 #define COLOR_BOOT 0x7F5500
@@ -33,9 +73,50 @@ struct_esp_now_message espNowMessage;
 
 #define LOW_BATTERY_VOLTAGE 2200
 
+// Capture every received frame into a ring file on LittleFS, for debugging.
+// Send 'c' over serial to dump it, replay it on a computer with tools/replay.cpp.
+#define CAPTURE_FRAMES false
+#define CAPTURE_SIZE 256 // Number of frames kept, 77 bytes each
+#define CAPTURE_PATH "/capture.bin"
+
+// Frame counters are journaled on LittleFS, see CounterJournal.h
+#define JOURNAL_PATH "/fcnt.jnl"
+#define JOURNAL_BLOCK 4096 // Flash sector
+// Room for four compacted journals, in whole sectors. 4096 bytes, 256
+// records, up to 63 devices; 20480 bytes for 256 devices.
+#define JOURNAL_SIZE (((JOURNAL_DEVICES + 1) * sizeof(struct_journal_record) * 4 + JOURNAL_BLOCK - 1) / JOURNAL_BLOCK * JOURNAL_BLOCK)
+static_assert(JOURNAL_DEVICES >= DEVICE_TABLE_SIZE, "The journal must keep the counters of every device");
+static_assert((JOURNAL_DEVICES + 1) * sizeof(struct_journal_record) < JOURNAL_SIZE, "A compacted journal must leave room to append");
+
+// Save frame counters when idle, after the leds are updated. Set to false to
+// save them before a message is handled, e.g. to compare the latency.
+#define PERSIST_DEFERRED true
+
 // Led strip config
 #define NUM_LEDS 44 // Number of leds on strip
 
+// Door sensors. Every sensor blinks its own segment of the strip in its own color.
+typedef struct struct_door
+{
+  uint8_t devAddr[4];
+  uint8_t appSKey[16];
+  uint8_t nwkSKey[16];
+  uint8_t firstLed;
+  uint8_t numLeds;
+  uint32_t color;
+} struct_door;
+
+struct_door doors[] = {
+    {{0x00, 0x98, 0x13, 0x59},
+     {0x3e, 0x3e, 0x4c, 0x4b, 0xe1, 0xa6, 0x91, 0x12, 0xa2, 0xa2, 0x86, 0x37, 0x9a, 0xd6, 0x34, 0x14},
+     {0xef, 0x9c, 0x2a, 0x59, 0xaa, 0x21, 0x45, 0xeb, 0x41, 0xac, 0x61, 0xf4, 0xd3, 0x21, 0xe9, 0x1f},
+     0,
+     NUM_LEDS,
+     COLOR_DOOR},
+};
+
+#define NUM_DOORS (sizeof(doors) / sizeof(doors[0]))
+
 // Pinout config
 #define LORA_CS_PIN 15    // D8
 #define LORA_RESET_PIN 16 // D0
@@ -43,136 +124,426 @@ struct_esp_now_message espNowMessage;
 #define WS2812B_PIN 0     // D3
 
 // Persistent Storage
-Preferences prefs;
+Preferences prefs; // Only read, counters saved before the journal
+CounterJournal journal;
+FrameCapture capture;
+bool captureEnabled = false;
 
 // Led strip variables
 CRGB leds[NUM_LEDS];
+LightEngine lights;
+
+// Layers, a higher layer is drawn on top
+#define LAYER_DOOR 0                           // One per door
+#define LAYER_BATTERY (LAYER_DOOR + NUM_DOORS) // One per door, last 3 leds of the segment
+#define LAYER_BOOT (LAYER_BATTERY + NUM_DOORS)
+static_assert(LAYER_BOOT < LIGHT_LAYERS, "Too many doors for LIGHT_LAYERS");
+
+// Door open: 0000-1000 on, 1000-2000 off, 2000-3000 on, 3000-4000 off, 4000-5000 on
+const LightKeyframe blinkKeyframes[] = {{0, 255}, {1000, 0}, {2000, 255}, {3000, 0}, {4000, 255}};
+const LightPattern blinkPattern = {blinkKeyframes, 5, 5000, false};
+
+// Boot color until 2.5s after boot
+const LightKeyframe bootKeyframes[] = {{0, 255}};
+const LightPattern bootPattern = {bootKeyframes, 1, 2500, false};
 
 // LoRa (not LoRaWAN!) Variables
-bool msgAvailable = false;
-bool sendingDone = false;
-uint32_t msgTime = 0;
-uint8_t msg[64];
-int msgLen = 0;
+ReceiveQueue receiveQueue;
+volatile bool sendingDone = false;
+uint32_t msgTimestamp = 0; // micros() at RxDone of the frame being handled
+int16_t msgRssi = 0;
+const uint8_t *msgData = NULL; // Frame being handled, only valid while it is parsed
+uint8_t msgLength = 0;
+uint32_t msgFrequency = FREQUENCY; // Channel of the frame being handled, RX1 uses the same
+uint8_t msgSpreadingFactor = SPREADING_FACTOR;
+DownlinkScheduler downlinks;
+bool downlinkSaved = false; // The frame counter of the pending downlink is in the journal
+// What handleDownlink() did, logged by handleDownlinkEvents() from loop(), as it runs from the timer
+#define DOWNLINK_YIELDED 0x01    // Left to another light
+#define DOWNLINK_DEFERRED 0x02   // Moved to RX2, duty cycle used up
+#define DOWNLINK_SUPPRESSED 0x04 // Dropped in RX2, duty cycle used up
+#define DOWNLINK_NOT_SAVED 0x08  // Dropped, frame counter not saved
+#define DOWNLINK_LATE 0x10       // Missed both receive windows
+volatile uint8_t downlinkEvents = 0;
+uint8_t downlinkWinner = 0; // Light the last yielded downlink was left to
+DutyCycle dutyCycle;
+Ticker downlinkTimer;
+Radio radio;
+bool rx2Active = false;
+bool transmitting = false;
+ChannelScanner scanner;
+volatile bool cadDone = false;
+volatile bool cadDetected = false;
 LoRaWanP2P loRaWAN;
 
-unsigned long lastJoined;
-unsigned long doorOpened;
-bool isBlinking = false;
-bool ledState = false;
-unsigned int battVoltage;
+// State per door, indexed like doors
+typedef struct struct_door_state
+{
+  unsigned int battVoltage;
+} struct_door_state;
 
-uint32_t prevFCntUp;
-uint32_t prevFCntDown;
-bool firstMsg = true;
+struct_door_state doorStates[NUM_DOORS];
 
-void handleLDS02(uint8_t *buf, uint8_t len)
+void handleLDS02(uint8_t door, uint8_t *buf, uint8_t len)
 {
-  if (len != 10)
+  if (len != 10 || door >= NUM_DOORS)
   {
     // Invalid msg;
     return;
   }
 
-  battVoltage = ((buf[0] << 8 | buf[1]) & 0x3FFF);
+  struct_door_state *doorState = &doorStates[door];
+  unsigned int battVoltage = ((buf[0] << 8 | buf[1]) & 0x3FFF);
   bool state = buf[0] & 0x80;
+  doorState->battVoltage = battVoltage;
 
-  Serial.print("Batt(mV)s: ");
-  Serial.println(battVoltage);
+  LOG_INFO(LOG_DOOR, "Door %u %s, batt(mV): %u", door, state ? "opened" : "closed", battVoltage);
 
   if (state)
   {
-    Serial.println("Door opened.");
-    if (!isBlinking)
+    if (!lights.playing(LAYER_DOOR + door))
     {
-      isBlinking = true;
-      doorOpened = millis(); // Set timer for constant light to turn on
+      struct_door *d = &doors[door];
+      uint32_t now = millis();
+      lights.play(LAYER_DOOR + door, &blinkPattern, d->color, d->firstLed, d->numLeds, now);
+      if (battVoltage < LOW_BATTERY_VOLTAGE && d->numLeds >= 3)
+      {
+        lights.play(LAYER_BATTERY + door, &blinkPattern, COLOR_BATTERY, d->firstLed + d->numLeds - 3, 3, now);
+      }
     }
   }
-  else
+
+  // Forward message via ESP-NOW, sent by handleLink()
+  doorLink.add(door, state ? DOORLINK_EVENT_OPENED : DOORLINK_EVENT_CLOSED, battVoltage, msgRssi);
+  TRACE_MARK(TRACE_HANDLE);
+}
+
+/*
+ * ESP-NOW functions
+ */
+void handleLink()
+{
+  // All doors that reported in this pass go out in one frame
+  uint8_t buffer[DOORLINK_MAX_FRAME];
+  uint8_t length = doorLink.poll(millis(), buffer);
+  if (length)
   {
-    Serial.println("Door closed.");
+    esp_now_send(broadcastAddress, buffer, length);
+    TRACE_MARK(TRACE_ESPNOW);
   }
+}
 
-  // Forward message via ESP-NOW
-  espNowMessage.batteryVoltage = battVoltage;
-  espNowMessage.doorOpened = state;
-  esp_now_send(broadcastAddress, (uint8_t *) &espNowMessage, sizeof(espNowMessage));
+void onLinkReceive(uint8_t *mac, uint8_t *data, uint8_t len)
+{
+  // Acks of the relay and claims of other lights
+  DoorLinkFrame frame;
+  if (doorLink.parse(data, len, &frame) == DOORLINK_CLAIMED)
+  {
+    arbiter.receive(frame.header->sender, frame.claim, micros());
+  }
 }
 
 /*
  * LoRa functions
  */
+
+// CAD on the channel and spreading factor the scanner is at
+void startCad()
+{
+  // Keep the radio interrupt from using SPI halfway through
+  noInterrupts();
+  radio.idle();
+  radio.setFrequency(scanner.frequency());
+  radio.setSpreadingFactor(scanner.spreadingFactor());
+  radio.cad();
+  interrupts();
+}
+
 void LoRa_rxMode()
 {
-  LoRa.disableInvertIQ(); // normal mode
-  LoRa.receive();         // set receive mode
+  if (SCAN_ENABLED)
+  {
+    radio.setInvertIQ(false);
+    cadDone = false;
+    scanner.cancel(micros());
+    startCad();
+    return;
+  }
+
+  if (rx2Active)
+  {
+    // Back to the uplink channel
+    radio.setFrequency(FREQUENCY);
+    radio.setSpreadingFactor(SPREADING_FACTOR);
+    rx2Active = false;
+  }
+
+  radio.setInvertIQ(false); // normal mode
+  radio.receive();          // set receive mode
 }
 
-void LoRa_txMode()
+void LoRa_txMode(bool rx2)
 {
-  LoRa.idle();           // set standby mode
-  LoRa.enableInvertIQ(); // active invert I and Q signals
+  radio.idle(); // set standby mode
+  if (rx2)
+  {
+    radio.setFrequency(RX2_FREQUENCY);
+    radio.setSpreadingFactor(RX2_SPREADING_FACTOR);
+    rx2Active = true;
+  }
+  else if (SCAN_ENABLED)
+  {
+    // RX1 is on the channel of the uplink
+    radio.setFrequency(msgFrequency);
+    radio.setSpreadingFactor(msgSpreadingFactor);
+  }
+  radio.setInvertIQ(true); // active invert I and Q signals
 }
 
-void onTxDone()
+void IRAM_ATTR onTxDone()
 {
   sendingDone = true;
 }
 
-void onReceive(int packetSize)
+void IRAM_ATTR onCadDone(bool detected)
 {
-  msgTime = millis();
-  msgAvailable = true;
+  cadDetected = detected;
+  cadDone = true;
+}
+
+// Move the scan on after every CAD, or when a detected frame never came
+void handleScan()
+{
+  if (!SCAN_ENABLED || transmitting)
+  {
+    return;
+  }
+
+  ScanAction action;
+  if (cadDone)
+  {
+    cadDone = false;
+    action = scanner.cadDone(cadDetected, micros());
+  }
+  else
+  {
+    action = scanner.poll(micros());
+  }
+
+  if (action == SCAN_RECEIVE)
+  {
+    // Still on the channel of the preamble
+    radio.receive();
+  }
+  else if (action == SCAN_CAD)
+  {
+    startCad();
+  }
+}
+
+// Called from the DIO0 interrupt. Drain the FIFO right away, so the next
+// frame can not overwrite this one before loop() gets to it.
+void IRAM_ATTR onReceive(int packetSize)
+{
+  uint32_t start = traceCycles();
+  struct_received_frame *frame = receiveQueue.reserve();
+  if (!frame)
+  {
+    // Queue full, the frame is dropped and counted
+    return;
+  }
+
+  frame->time = millis();
+  frame->timestamp = micros();
+  frame->cycles = start;
+  frame->rssi = radio.packetRssi();
+  frame->snr = radio.packetSnr();
+  frame->length = radio.read(frame->data, RECEIVE_MAX_FRAME);
+
+  TRACE_RECORD(TRACE_FIFO_DRAIN, traceCycles() - start);
+  receiveQueue.publish();
 }
 
 /*
  * LoRaWAN Callbacks
  */
 
-void LoRaWAN_onSave()
+// Preferences key of a counter, e.g. U00981359 for the FCntUp of device 00981359. Only used to migrate to the journal.
+void prefsKey(char *key, char prefix, LoRaWanDevice *device)
+{
+  sprintf(key, "%c%02X%02X%02X%02X", prefix, device->devAddr[0], device->devAddr[1], device->devAddr[2], device->devAddr[3]);
+}
+
+// Save the counters of all devices that changed
+void persist()
+{
+  loRaWAN.flush();
+  if (!journal.sync())
+  {
+    LOG_ERROR(LOG_STORAGE, "Counter journal could not be written.");
+  }
+}
+
+void LoRaWAN_onSave(LoRaWanDevice *device)
 {
-  // If nothing changes, the library automatically stops copying.
-  uint32_t newFCntUp = loRaWAN.fCntUp >> 7;
-  uint32_t newFCntDown = loRaWAN.fCntDown >> 7;
+  // Only updates RAM, written by journal.sync()
+  if (!journal.append(device->devAddr, device->fCntUp, device->fCntDown))
+  {
+    LOG_ERROR(LOG_STORAGE, "Counter journal full.");
+  }
+}
 
-  if (newFCntUp != prevFCntUp || newFCntDown != prevFCntDown)
+void LoRaWAN_onMessage(LoRaWanDevice *device, uint8_t port, uint8_t *msg, uint8_t length)
+{
+  if (!PERSIST_DEFERRED)
   {
-    // Actual new data. Save!
-    prefs.putUInt("FCntUp", newFCntUp);
-    prefs.putUInt("FCntDown", newFCntDown);
+    persist();
   }
+
+  LOG_DUMP(LOG_LORAWAN, "Payload", msg, length);
+
+  handleLDS02(device->id, msg, length);
+}
+
+// The pending downlink will not be sent, what it carried from the queue stays there.
+void dropDownlink()
+{
+  downlinks.cancel();
+  loRaWAN.responseDropped(downlinks.buffer());
 }
 
-void LoRaWAN_onMessage(uint8_t port, uint8_t *msg, uint8_t length)
+// Runs from downlinkTimer until the pending downlink is sent or both receive windows are missed.
+void handleDownlink()
 {
-  Serial.print("Payload: ");
-  for (int i = 0; i < length; i++)
+  uint32_t arbiterWait = 0;
+  ArbiterDecision decision = arbiter.decide(micros(), &arbiterWait);
+  if (decision == ARBITER_YIELD && downlinks.pending())
+  {
+    dropDownlink();
+    downlinkWinner = arbiter.winner();
+    downlinkEvents |= DOWNLINK_YIELDED;
+    return;
+  }
+
+  uint32_t wait;
+  DownlinkAction action = downlinks.poll(micros(), &wait);
+
+  switch (action)
   {
-    if (msg[i] < 16)
+  case DOWNLINK_WAIT:
+    if (decision == ARBITER_WAIT && arbiterWait < wait)
     {
-      Serial.print("0");
+      // Decide at the end of the arbitration, long before RX1
+      wait = arbiterWait;
     }
-    Serial.print(msg[i], HEX);
+    downlinkTimer.once_ms(wait / 1000, handleDownlink);
+    break;
+
+  case DOWNLINK_SEND_RX1:
+  case DOWNLINK_SEND_RX2:
+  {
+    bool rx2 = action == DOWNLINK_SEND_RX2;
+    uint32_t frequency = rx2 ? RX2_FREQUENCY : msgFrequency;
+    uint32_t airtime = loraAirtime(rx2 ? RX2_SPREADING_FACTOR : msgSpreadingFactor, downlinks.length());
+    if (!dutyCycle.allowed(frequency, airtime, millis()))
+    {
+      // No budget left in the band of this window. RX2 is in a band of its own, with 10%.
+      downlinks.skip();
+      downlinkEvents |= rx2 ? DOWNLINK_SUPPRESSED : DOWNLINK_DEFERRED;
+      if (rx2)
+      {
+        loRaWAN.responseDropped(downlinks.buffer());
+      }
+      handleDownlink();
+      break;
+    }
+
+    // Saved in LoRaWAN_onResponse(), no flash writes from the timer
+    if (!downlinkSaved)
+    {
+      dropDownlink();
+      downlinkEvents |= DOWNLINK_NOT_SAVED;
+      break;
+    }
+
+    // Keep the receive interrupt from using SPI halfway through
+    noInterrupts();
+    transmitting = true;
+    LoRa_txMode(action == DOWNLINK_SEND_RX2); // set tx mode
+    radio.transmit(downlinks.buffer(), downlinks.length());
+    downlinks.sent(micros());
+    interrupts();
+    loRaWAN.responseSent(downlinks.buffer());
+    dutyCycle.add(frequency, airtime, millis());
+    break;
   }
-  Serial.println();
 
-  handleLDS02(msg, length);
+  case DOWNLINK_MISSED:
+    loRaWAN.responseDropped(downlinks.buffer());
+    downlinkEvents |= DOWNLINK_LATE;
+    break;
+
+  default:
+    break;
+  }
+}
+
+// Log what handleDownlink() did since the last call
+void handleDownlinkEvents()
+{
+  uint8_t events = downlinkEvents;
+  if (!events)
+  {
+    return;
+  }
+  downlinkEvents = 0;
+
+  if (events & DOWNLINK_YIELDED)
+  {
+    LOG_INFO(LOG_LORAWAN, "Downlink left to light %u, it heard the uplink better.", downlinkWinner);
+  }
+  if (events & DOWNLINK_DEFERRED)
+  {
+    LOG_WARN(LOG_LORAWAN, "Downlink moved to RX2, duty cycle used up.");
+  }
+  if (events & DOWNLINK_SUPPRESSED)
+  {
+    LOG_WARN(LOG_LORAWAN, "Downlink suppressed, duty cycle used up.");
+  }
+  if (events & DOWNLINK_NOT_SAVED)
+  {
+    LOG_ERROR(LOG_STORAGE, "Downlink dropped, its frame counter could not be saved.");
+  }
+  if (events & DOWNLINK_LATE)
+  {
+    LOG_WARN(LOG_LORAWAN, "Downlink missed both receive windows.");
+  }
 }
 
 void LoRaWAN_onResponse(uint8_t *buffer, uint8_t length, uint32_t rxDelay)
 {
-  LoRa_txMode(); // set tx mode
+  // The radio keeps receiving until the downlink is due
+  if (!downlinks.schedule(buffer, length, msgTimestamp, rxDelay * 1000))
+  {
+    loRaWAN.responseDropped(buffer);
+    LOG_WARN(LOG_LORAWAN, "Downlink dropped, another one is pending.");
+    return;
+  }
+
+  // Never send a frame counter that is not saved yet. Done here, from
+  // loop(), as handleDownlink() runs from the timer right before RX1.
+  persist();
+  downlinkSaved = !journal.dirty();
 
-  unsigned int diff = millis() - msgTime;
-  if (diff < rxDelay)
+  // Tell the other lights, right away, as they decide before RX1 too
+  DoorLinkClaim claim;
+  if (arbiter.claim(msgData, msgLength, msgRssi, msgTimestamp, &claim))
   {
-    delay(rxDelay - diff);
+    uint8_t claimBuffer[DOORLINK_MAX_FRAME];
+    esp_now_send(claimAddress, claimBuffer, doorLink.claim(&claim, claimBuffer));
   }
 
-  LoRa.beginPacket();
-  LoRa.write(buffer, length);
-  LoRa.endPacket(true);
+  handleDownlink();
 }
 
 /*
@@ -180,137 +551,310 @@ void LoRaWAN_onResponse(uint8_t *buffer, uint8_t length, uint32_t rxDelay)
  */
 void handleLights()
 {
+  if (lights.render(millis()))
+  {
+    FastLED.show();
+    TRACE_MARK(TRACE_SHOW);
+  }
+}
 
-  /*
-   * Blink during boot
-   */
+/*
+ * Serial functions
+ */
 
-  if (millis() < 1000 && !ledState)
+// Write buffered log lines without waiting for the UART
+void handleLog()
+{
+  char buffer[64];
+  int room = Serial.availableForWrite();
+  while (room > 0)
   {
-    FastLED.showColor(COLOR_BOOT);
-    FastLED.showColor(COLOR_BOOT);
-    ledState = true;
-    return;
+    size_t length = logger.read(buffer, min(room, (int)sizeof(buffer)));
+    if (!length)
+    {
+      break;
+    }
+    Serial.write((const uint8_t *)buffer, length);
+    room -= length;
   }
+}
 
-  /*
-   * Door closes
-   */
-
-  if (millis() > 2500 && !isBlinking && ledState)
+// Write all buffered log lines, waiting for the UART
+void flushLog()
+{
+  while (logger.pending())
   {
-    FastLED.showColor(CRGB::Black);
-    FastLED.showColor(CRGB::Black);
-    ledState = false;
+    handleLog();
+    yield();
   }
+}
 
-  /*
-   * Door open
-   *
-   * 0000-1000 on
-   * 1000-2000 off
-   * 2000-3000 on
-   * 3000-4000 off
-   * 4000-5000 on
-   * 5000-.... off
-   */
+void printJournalStats()
+{
+  FSInfo info;
+  LittleFS.info(info);
+  float wear = journal.wear(info.totalBytes, info.blockSize);
+
+  Serial.print("Journal writes/compactions: ");
+  Serial.print(journal.writes);
+  Serial.print("/");
+  Serial.print(journal.compactions);
+  Serial.print(", failed syncs: ");
+  Serial.println(journal.failures);
+  Serial.print("Journal flash wear (erase cycles per block): ");
+  Serial.print(wear, 4);
+  Serial.print(", ");
+  Serial.print(wear * 100 / JOURNAL_RATED_CYCLES, 6);
+  Serial.println("% of rated endurance");
+}
 
-  // N.B. If no-one open the doors in 50 days,
-  // the unsigned long will overflow and the light will blink randomly.
-  // We ignore this
-  if (isBlinking && !ledState && (millis() - doorOpened) < 5000)
+void printTrace()
+{
+  // All stages but the loop are measured from the radio interrupt
+  Serial.println(PERSIST_DEFERRED ? "Trace (us), counters saved when idle:" : "Trace (us), counters saved before handling:");
+  Serial.println("stage         count     min     avg     p99     max");
+  for (uint8_t stage = 0; stage < TRACE_STAGES; stage++)
   {
-    if ((millis() - doorOpened) > 1000 && (millis() - doorOpened) < 2000)
-    {
-      return;
-    }
+    TraceStats stats = trace.stats(stage);
+    char line[64];
+    snprintf(line, sizeof(line), "%-12s %6u %7u %7u %7u %7u",
+             Trace::name(stage), stats.count, stats.min, stats.avg, stats.p99, stats.max);
+    Serial.println(line);
+  }
 
-    if ((millis() - doorOpened) > 3000 && (millis() - doorOpened) < 4000)
-    {
-      return;
-    }
+  TraceStats loop = trace.stats(TRACE_LOOP);
+  Serial.print("Loop jitter (p99 - min): ");
+  Serial.print(loop.p99 - loop.min);
+  Serial.print(" us, worst stall: ");
+  Serial.print(loop.max);
+  Serial.println(" us");
+}
 
-    for (int i = 0; i < NUM_LEDS; i++)
+void printAdr()
+{
+  Serial.println("door  SF  power  frames  saved (ms)  pending  battery  margin");
+  for (uint16_t i = 0; i < loRaWAN.devices.count(); i++)
+  {
+    LoRaWanDevice *device = loRaWAN.devices.get(i);
+    AdrState *state = &device->adr;
+    char battery[8] = "?";
+    if (device->mac.battery != MAC_BATTERY_UNKNOWN)
     {
-      leds[i] = COLOR_DOOR;
-      if (battVoltage < LOW_BATTERY_VOLTAGE)
-      {
-        leds[NUM_LEDS - 1] = COLOR_BATTERY;
-        leds[NUM_LEDS - 2] = COLOR_BATTERY;
-        leds[NUM_LEDS - 3] = COLOR_BATTERY;
-      }
+      snprintf(battery, sizeof(battery), "%u", device->mac.battery);
     }
-    FastLED.show();
-    FastLED.show();
-    ledState = true;
-    return;
+    char line[80];
+    snprintf(line, sizeof(line), "%4u %3u %6u %7u %11ld  %-7s %8s %7d",
+             device->id, state->spreadingFactor, state->power, (unsigned)state->frames,
+             (long)(state->airtimeSaved / 1000), loRaWAN.adr.pending(state) ? "yes" : "no",
+             battery, device->mac.statusMargin);
+    Serial.println(line);
   }
+}
 
-  if (isBlinking && ledState && (millis() - doorOpened) < 6000)
+void printScan()
+{
+  Serial.print("Scan cycles: ");
+  Serial.print(scanner.cycles);
+  Serial.print(", cycle time (ms) last/max: ");
+  Serial.print(scanner.cycleTime / 1000);
+  Serial.print("/");
+  Serial.println(scanner.maxCycleTime / 1000);
+  Serial.println("MHz      SF  cads  detected  frames  timeouts");
+  for (uint8_t sf = SCAN_MIN_SF; sf <= SCAN_MAX_SF; sf++)
   {
-    if ((millis() - doorOpened) < 1000)
-    {
-      return;
-    }
-
-    if ((millis() - doorOpened) > 2000 && (millis() - doorOpened) < 3000)
+    for (uint8_t channel = 0; channel < sizeof(scanFrequencies) / sizeof(scanFrequencies[0]); channel++)
     {
-      return;
+      ScanStats stats = scanner.stats(channel, sf);
+      char line[64];
+      snprintf(line, sizeof(line), "%7.1f %3u %6u %9u %7u %9u",
+               scanFrequencies[channel] / 1e6, sf, stats.cads, stats.detections, stats.frames, stats.timeouts);
+      Serial.println(line);
     }
+  }
+}
 
-    if ((millis() - doorOpened) > 4000 && (millis() - doorOpened) < 5000)
-    {
-      return;
-    }
+void handleSerial()
+{
+  if (!Serial.available())
+  {
+    return;
+  }
 
-    FastLED.showColor(CRGB::Black);
-    FastLED.showColor(CRGB::Black);
-    ledState = false;
+  // Keep command output apart from the log
+  flushLog();
 
-    if ((millis() - doorOpened) > 5000)
+  switch (Serial.read())
+  {
+  case 'c':
+    capture.dump(Serial);
+    break;
+
+  case 't':
+    printTrace();
+    break;
+
+  case 'r':
+    printScan();
+    break;
+
+  case 'a':
+    printAdr();
+    break;
+
+  case 'T':
+    trace.reset();
+    Serial.println("Trace reset.");
+    break;
+
+  case 's':
+    Serial.print("Receive queue overflows: ");
+    Serial.println(receiveQueue.overflows);
+    Serial.print("Frame counters resolved/MICs, rejected behind/ahead: ");
+    Serial.print(loRaWAN.fCntResolver.accepted);
+    Serial.print("/");
+    Serial.print(loRaWAN.fCntResolver.cmacs);
+    Serial.print(", ");
+    Serial.print(loRaWAN.fCntResolver.behind);
+    Serial.print("/");
+    Serial.println(loRaWAN.fCntResolver.ahead);
+    Serial.print("Duplicates dropped/lookups: ");
+    Serial.print(loRaWAN.dedup.hits);
+    Serial.print("/");
+    Serial.println(loRaWAN.dedup.lookups);
+    Serial.print("MAC commands decoded/unknown: ");
+    Serial.print(loRaWAN.mac.commands);
+    Serial.print("/");
+    Serial.println(loRaWAN.mac.unknown);
+    Serial.print("Keystream hits/misses: ");
+    Serial.print(loRaWAN.keystreamCache.hits);
+    Serial.print("/");
+    Serial.println(loRaWAN.keystreamCache.misses);
+    Serial.print("Downlinks RX1/RX2/missed/dropped: ");
+    Serial.print(downlinks.sentRX1);
+    Serial.print("/");
+    Serial.print(downlinks.sentRX2);
+    Serial.print("/");
+    Serial.print(downlinks.missed);
+    Serial.print("/");
+    Serial.println(downlinks.dropped);
+    Serial.print("Queued downlinks delivered/failed/rejected/retransmits: ");
+    Serial.print(loRaWAN.queue.delivered);
+    Serial.print("/");
+    Serial.print(loRaWAN.queue.failed);
+    Serial.print("/");
+    Serial.print(loRaWAN.queue.rejected);
+    Serial.print("/");
+    Serial.println(loRaWAN.queue.retransmits);
+    Serial.print("Downlink queue depth now/max, latency (ms) avg/max: ");
+    Serial.print(loRaWAN.queue.depth());
+    Serial.print("/");
+    Serial.print(loRaWAN.queue.maxDepth);
+    Serial.print(", ");
+    Serial.print(loRaWAN.queue.delivered ? loRaWAN.queue.latencyTotal / loRaWAN.queue.delivered : 0);
+    Serial.print("/");
+    Serial.println(loRaWAN.queue.latencyMax);
+    Serial.print("Downlink lead (us): ");
+    Serial.println(downlinks.lead);
+    Serial.print("Downlinks deferred to RX2/suppressed by duty cycle: ");
+    Serial.print(downlinks.deferred);
+    Serial.print("/");
+    Serial.println(downlinks.suppressed);
+    Serial.print("Duty cycle left (ms) per band g/g1/g2/g3/g4: ");
+    for (uint8_t band = 0; band < DUTY_BANDS; band++)
     {
-      isBlinking = false;
+      Serial.print(dutyCycle.remaining(band, millis()) / 1000);
+      Serial.print(band + 1 < DUTY_BANDS ? "/" : "\n");
     }
-
-    return;
+    Serial.print("ESP-NOW sent/retransmits/failed/dropped/invalid: ");
+    Serial.print(doorLink.sent);
+    Serial.print("/");
+    Serial.print(doorLink.retransmits);
+    Serial.print("/");
+    Serial.print(doorLink.failed);
+    Serial.print("/");
+    Serial.print(doorLink.dropped);
+    Serial.print("/");
+    Serial.println(doorLink.invalid);
+    Serial.print("Arbitration claimed/answered/left to others, claims heard/late: ");
+    Serial.print(arbiter.claims);
+    Serial.print("/");
+    Serial.print(arbiter.won);
+    Serial.print("/");
+    Serial.print(arbiter.yielded);
+    Serial.print(", ");
+    Serial.print(arbiter.heard);
+    Serial.print("/");
+    Serial.println(arbiter.late);
+    Serial.print("Log dropped: ");
+    Serial.println(logger.dropped);
+    printJournalStats();
+    break;
   }
 }
 
 void loop()
 {
+  TRACE_LOOP_MARK();
+
   if (sendingDone)
   {
+    transmitting = false;
     LoRa_rxMode();
     sendingDone = false;
   }
 
-  if (msgAvailable)
+  // Handle all frames received since the last pass
+  struct_received_frame *frame;
+  while ((frame = receiveQueue.peek()) != NULL)
   {
-    msgAvailable = false;
+    TRACE_BEGIN(frame->cycles);
+    msgTimestamp = frame->timestamp;
+    msgRssi = frame->rssi;
+    msgData = &frame->data[0];
+    msgLength = frame->length;
 
-    Serial.print("Receive msg: ");
-    msgLen = 0;
-    while (LoRa.available())
+    if (SCAN_ENABLED && scanner.locked())
     {
-      if (msgLen < 64)
-      {
-        msg[msgLen] = LoRa.read();
+      // Note the channel for RX1 and scan on while this frame is handled
+      msgFrequency = scanner.frequency();
+      msgSpreadingFactor = scanner.spreadingFactor();
+      scanner.received(micros());
+      startCad();
+    }
 
-        Serial.print(msg[msgLen] < 16 ? "0" : "");
-        Serial.print(msg[msgLen], HEX);
+    LOG_DUMP(LOG_RADIO, "Receive msg", &frame->data[0], frame->length);
 
-        msgLen++;
-      }
+    if (captureEnabled)
+    {
+      capture.stage(&frame->data[0], frame->length, frame->time, frame->rssi, frame->snr / 4.0);
     }
-    Serial.println();
 
-    loRaWAN.parseMessage(&msg[0], msgLen, LoRa.packetRssi(), firstMsg);
-    firstMsg = false;
+    LoRaWanResult result = loRaWAN.parseMessage(&frame->data[0], frame->length, frame->rssi, frame->snr, msgSpreadingFactor);
 
-    Serial.println("Message parsed");
+    if (captureEnabled)
+    {
+      capture.commit(result);
+    }
+
+    receiveQueue.pop();
+    LOG_DEBUG(LOG_LORAWAN, "Message parsed: %d", result);
   }
 
+  handleScan();
+  handleLink();
+  handleDownlinkEvents();
   handleLights();
+  TRACE_END();
+
+  // Idle work, only when no frame is waiting
+  if (!receiveQueue.peek())
+  {
+    persist();
+    loRaWAN.precompute();
+    handleLog();
+  }
+
+  handleSerial();
 }
 
 void setup()
@@ -328,49 +872,99 @@ void setup()
   FastLED.addLeds<WS2812B, WS2812B_PIN, GRB>(leds, NUM_LEDS).setCorrection(TypicalLEDStrip);
   FastLED.setTemperature(Tungsten100W);
   FastLED.setBrightness(255);
+  lights.begin(leds, NUM_LEDS);
+  lights.play(LAYER_BOOT, &bootPattern, COLOR_BOOT, 0, NUM_LEDS, millis());
 
   prefs.begin("LoRaWAN");
+  if (!journal.begin(JOURNAL_PATH, JOURNAL_SIZE))
+  {
+    LOG_ERROR(LOG_STORAGE, "Counter journal failed to start.");
+  }
+
+  if (CAPTURE_FRAMES)
+  {
+    captureEnabled = capture.begin(CAPTURE_PATH, CAPTURE_SIZE);
+    if (!captureEnabled)
+    {
+      LOG_ERROR(LOG_STORAGE, "Frame capture failed to start.");
+    }
+  }
 
   // Setup LoraWAN
   loRaWAN.OTAAEnabled = false;
-  memcpy(&loRaWAN.devAddr, devAddr, 4);
-  memcpy(&loRaWAN.appSKey, appSKey, 16);
-  memcpy(&loRaWAN.nwkSKey, nwkSKey, 16);
+  for (uint8_t d = 0; d < NUM_DOORS; d++)
+  {
+    LoRaWanDevice *device = loRaWAN.addDevice(doors[d].devAddr, doors[d].nwkSKey, doors[d].appSKey, d);
+    if (!device)
+    {
+      LOG_ERROR(LOG_SYSTEM, "Device table full.");
+      break;
+    }
+
+    // Load from persistent storage
+    if (!journal.load(device->devAddr, &device->fCntUp, &device->fCntDown))
+    {
+      // Not in the journal yet, take the counters saved in Preferences, which dropped the last 7 bits.
+      // The first door also accepts the keys used before multiple doors were supported.
+      char key[10];
+      prefsKey(key, 'U', device);
+      uint32_t fCntUp = prefs.getUInt(key, d == 0 ? prefs.getUInt("FCntUp", 0) : 0);
+      prefsKey(key, 'D', device);
+      uint32_t fCntDown = prefs.getUInt(key, d == 0 ? prefs.getUInt("FCntDown", 0) : 0);
+      device->fCntUp = fCntUp << 7;
+      device->fCntDown = (fCntDown + 1) << 7; // Also add extra so that we do not overlap frame counts.
+      journal.append(device->devAddr, device->fCntUp, device->fCntDown);
+    }
+  }
+  journal.sync();
 
-  // Load from persistent storage
-  prevFCntUp = prefs.getUInt("FCntUp", 0);
-  prevFCntDown = prefs.getUInt("FCntDown", 0);
-  loRaWAN.fCntUp = prevFCntUp << 7;           // ignore the last 128 bits to limit flash wear.
-  loRaWAN.fCntDown = (prevFCntDown + 1) << 7; // Also add extra so that we do not overlap frame counts.
+  loRaWAN.adr.enabled = ADR_ENABLED;
+  loRaWAN.adr.minSF = SCAN_ENABLED ? SCAN_MIN_SF : SPREADING_FACTOR;
+  loRaWAN.adr.maxSF = SCAN_ENABLED ? SCAN_MAX_SF : SPREADING_FACTOR;
+  loRaWAN.adr.channelMask = ADR_CHANNEL_MASK;
+  loRaWAN.mac.statusInterval = DEV_STATUS_INTERVAL;
 
   loRaWAN.onSave(LoRaWAN_onSave);
   loRaWAN.onMessage(LoRaWAN_onMessage);
   loRaWAN.onResponse(LoRaWAN_onResponse);
 
   // Setup LoRa
-  LoRa.setPins(LORA_CS_PIN, LORA_RESET_PIN, LORA_IRQ_PIN);
-  if (!LoRa.begin(FREQUENCY))
+  radio.setPins(LORA_CS_PIN, LORA_RESET_PIN, LORA_IRQ_PIN);
+  if (!radio.begin(FREQUENCY))
   {
-    Serial.println("LoRa init failed. Check your connections.");
+    LOG_ERROR(LOG_RADIO, "LoRa init failed. Check your connections.");
+    flushLog();
     while (true)
       ; // if failed, do nothing
   }
-  LoRa.setSpreadingFactor(SPREADING_FACTOR);
-  LoRa.setSyncWord(0x34);
-  LoRa.onReceive(onReceive);
-  LoRa.onTxDone(onTxDone);
+  radio.setSpreadingFactor(SPREADING_FACTOR);
+  radio.setSyncWord(RADIO_SYNC_WORD);
+  radio.onReceive(onReceive);
+  radio.onTxDone(onTxDone);
+  if (SCAN_ENABLED)
+  {
+    scanner.begin(scanFrequencies, sizeof(scanFrequencies) / sizeof(scanFrequencies[0]), SCAN_MIN_SF, SCAN_MAX_SF, RECEIVE_MAX_FRAME, micros());
+    radio.onCadDone(onCadDone);
+  }
 
-  Serial.println("LoRa init succeeded.");
+  LOG_INFO(LOG_RADIO, "LoRa init succeeded.");
   LoRa_rxMode();
 
+  // Setup ESP-NOW link
+  AES_Setup(&linkContext, linkKey);
+  doorLink.begin(&linkContext, LIGHT_ID, LINK_ACK);
+  arbiter.begin(LIGHT_ID);
+  arbiter.window = ARBITRATION_ENABLED ? ARBITER_WINDOW : 0;
+
   // Setup Wifi
   WiFi.mode(WIFI_STA);
   if (esp_now_init() != 0) {
-    Serial.println("Error initializing ESP-NOW");
+    LOG_ERROR(LOG_LINK, "Error initializing ESP-NOW");
     return;
   }
 
-  esp_now_set_self_role(ESP_NOW_ROLE_CONTROLLER);
-  // esp_now_register_send_cb(OnDataSent); // We don't need a callback
-  esp_now_add_peer(broadcastAddress, ESP_NOW_ROLE_SLAVE, 1, NULL, 0);
+  esp_now_set_self_role(ESP_NOW_ROLE_COMBO); // Send events and claims, receive acks and claims
+  esp_now_register_recv_cb(onLinkReceive);
+  esp_now_add_peer(broadcastAddress, ESP_NOW_ROLE_COMBO, 1, NULL, 0);
+  esp_now_add_peer(claimAddress, ESP_NOW_ROLE_COMBO, 1, NULL, 0);
 }
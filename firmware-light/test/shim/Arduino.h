@@ -0,0 +1,32 @@
+//
+//  Arduino.h
+//  Minimal stand-in for the Arduino core, so the protocol code can be
+//  compiled and benchmarked on the host with `pio test -e native`.
+//
+
+#ifndef ARDUINO_SHIM_H
+#define ARDUINO_SHIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+inline unsigned long micros()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+inline long random()
+{
+    return rand();
+}
+
+#endif
@@ -0,0 +1,33 @@
+//
+//  FastLED.h
+//  Minimal stand-in for FastLED, only the CRGB pixel type. Lets the light
+//  engine render into a plain array on the host.
+//
+
+#ifndef FASTLED_SHIM_H
+#define FASTLED_SHIM_H
+
+#include <stdint.h>
+
+struct CRGB
+{
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+
+    CRGB() : r(0), g(0), b(0) {}
+    CRGB(uint8_t red, uint8_t green, uint8_t blue) : r(red), g(green), b(blue) {}
+    CRGB(uint32_t colorcode) : r((colorcode >> 16) & 0xFF), g((colorcode >> 8) & 0xFF), b(colorcode & 0xFF) {}
+
+    bool operator==(const CRGB &other) const
+    {
+        return r == other.r && g == other.g && b == other.b;
+    }
+
+    bool operator!=(const CRGB &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+#endif
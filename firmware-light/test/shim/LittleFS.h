@@ -0,0 +1,123 @@
+//
+//  LittleFS.h
+//  In-memory stand-in for LittleFS of the ESP8266 core, so the counter
+//  journal can be tested on the host. Writes can be made to fail, like on a
+//  worn out block.
+//
+
+#ifndef LITTLEFS_SHIM_H
+#define LITTLEFS_SHIM_H
+
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef struct FSInfo
+{
+    size_t totalBytes;
+    size_t usedBytes;
+    size_t blockSize;
+    size_t pageSize;
+} FSInfo;
+
+class File
+{
+public:
+    File() {}
+    File(std::vector<uint8_t> *data, bool *failWrites, uint32_t *writeCalls)
+        : _data(data), _failWrites(failWrites), _writeCalls(writeCalls) {}
+
+    size_t write(const uint8_t *buffer, size_t length)
+    {
+        (*_writeCalls)++;
+        if (*_failWrites)
+        {
+            return 0;
+        }
+        _data->insert(_data->end(), buffer, buffer + length);
+        return length;
+    }
+
+    size_t read(uint8_t *buffer, size_t length)
+    {
+        size_t left = _data->size() - _position;
+        length = length < left ? length : left;
+        memcpy(buffer, _data->data() + _position, length);
+        _position += length;
+        return length;
+    }
+
+    size_t size() { return _data->size(); }
+    void flush() {}
+    void close() { _data = NULL; }
+    operator bool() { return _data != NULL; }
+
+private:
+    std::vector<uint8_t> *_data = NULL;
+    size_t _position = 0; // Of read(), write() always appends
+    bool *_failWrites = NULL;
+    uint32_t *_writeCalls = NULL;
+};
+
+class FSClass
+{
+public:
+    bool failWrites = false; // Every write() returns 0 and writes nothing
+    uint32_t writeCalls = 0;
+
+    bool begin() { return true; }
+
+    // "r" of a missing file returns a closed File, "w" truncates, "a" appends.
+    File open(const char *path, const char *mode)
+    {
+        if (mode[0] == 'r' && !exists(path))
+        {
+            return File();
+        }
+        std::vector<uint8_t> *data = &_files[path];
+        if (mode[0] == 'w')
+        {
+            data->clear();
+        }
+        return File(data, &failWrites, &writeCalls);
+    }
+
+    bool exists(const char *path) { return _files.count(path) != 0; }
+    bool remove(const char *path) { return _files.erase(path) != 0; }
+
+    bool rename(const char *from, const char *to)
+    {
+        if (!exists(from))
+        {
+            return false;
+        }
+        _files[to] = _files[from];
+        _files.erase(from);
+        return true;
+    }
+
+    bool info(FSInfo &info)
+    {
+        info.totalBytes = 1024 * 1024;
+        info.usedBytes = 0;
+        info.blockSize = 4096;
+        info.pageSize = 256;
+        return true;
+    }
+
+    // Forget all files, for the next test.
+    void reset()
+    {
+        _files.clear();
+        failWrites = false;
+        writeCalls = 0;
+    }
+
+private:
+    std::map<std::string, std::vector<uint8_t>> _files;
+};
+
+inline FSClass LittleFS;
+
+#endif
@@ -0,0 +1,117 @@
+//
+//  EspNowSim.h
+//  In-process stand-in for ESP-NOW between the lights of one test. A frame
+//  sent by a node is broadcast, like esp_now_send() to FF:FF:FF:FF:FF:FF,
+//  and reaches every other node after latency micros, unless the link
+//  between the two is cut.
+//
+
+#ifndef TEST_ESPNOW_SIM_H
+#define TEST_ESPNOW_SIM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define ESPNOW_SIM_NODES 4
+#define ESPNOW_SIM_MAX_FRAME 250  // ESP-NOW payload limit
+#define ESPNOW_SIM_FRAMES 16      // Frames on the way at the same time
+#define ESPNOW_SIM_LATENCY 2000   // Micros from send to receive, a few ms on a quiet channel
+
+class EspNowSim
+{
+public:
+    uint32_t latency = ESPNOW_SIM_LATENCY;
+
+    uint32_t sent = 0;
+    uint32_t delivered = 0;
+    uint32_t lost = 0; // Not delivered to a node because the link was cut
+
+    // Like esp_now_register_recv_cb(), now is the time of arrival.
+    void onReceive(uint8_t node, void (*callback)(uint8_t node, uint8_t *data, uint8_t length, uint32_t now))
+    {
+        _callbacks[node] = callback;
+    }
+
+    // Frames from one node no longer reach the other.
+    void cut(uint8_t from, uint8_t to) { _cut[from] |= 1 << to; }
+
+    // Broadcast data from node at time now. Returns false if too many frames are on the way.
+    bool send(uint8_t node, const uint8_t *data, uint8_t length, uint32_t now)
+    {
+        for (uint8_t i = 0; i < ESPNOW_SIM_FRAMES; i++)
+        {
+            Frame *frame = &_frames[i];
+            if (frame->used)
+            {
+                continue;
+            }
+            frame->used = true;
+            frame->from = node;
+            frame->arrival = now + latency;
+            frame->length = length;
+            memcpy(frame->data, data, length);
+            sent++;
+            return true;
+        }
+        return false;
+    }
+
+    // Deliver all frames that arrive up to until, in order of arrival.
+    void run(uint32_t until)
+    {
+        Frame *next;
+        while ((next = _next(until)) != NULL)
+        {
+            next->used = false;
+            for (uint8_t node = 0; node < ESPNOW_SIM_NODES; node++)
+            {
+                if (node == next->from || !_callbacks[node])
+                {
+                    continue;
+                }
+                if (_cut[next->from] & (1 << node))
+                {
+                    lost++;
+                    continue;
+                }
+
+                // Every receiver gets a copy of its own, like from the radio
+                uint8_t data[ESPNOW_SIM_MAX_FRAME];
+                memcpy(data, next->data, next->length);
+                _callbacks[node](node, data, next->length, next->arrival);
+                delivered++;
+            }
+        }
+    }
+
+private:
+    typedef struct Frame
+    {
+        bool used;
+        uint8_t from;
+        uint32_t arrival;
+        uint8_t length;
+        uint8_t data[ESPNOW_SIM_MAX_FRAME];
+    } Frame;
+
+    Frame _frames[ESPNOW_SIM_FRAMES] = {};
+    void (*_callbacks[ESPNOW_SIM_NODES])(uint8_t node, uint8_t *data, uint8_t length, uint32_t now) = {};
+    uint8_t _cut[ESPNOW_SIM_NODES] = {};
+
+    Frame *_next(uint32_t until)
+    {
+        Frame *next = NULL;
+        for (uint8_t i = 0; i < ESPNOW_SIM_FRAMES; i++)
+        {
+            Frame *frame = &_frames[i];
+            if (frame->used && (int32_t)(frame->arrival - until) <= 0 &&
+                (!next || (int32_t)(frame->arrival - next->arrival) < 0))
+            {
+                next = frame;
+            }
+        }
+        return next;
+    }
+};
+
+#endif
@@ -0,0 +1,66 @@
+//
+//  frames.h
+//  Helpers shared by the native tests to build LoRaWAN 1.0.2 uplinks.
+//
+
+#ifndef TEST_FRAMES_H
+#define TEST_FRAMES_H
+
+#include "LoRaWanP2P.h"
+#include <string.h>
+
+// Example frame of the lora-packet project: unconfirmed data up, DevAddr
+// 49BE7DF1, FCnt 2, FPort 1, payload "test".
+static uint8_t exampleDevAddr[4] = {0x49, 0xBE, 0x7D, 0xF1};
+static uint8_t exampleNwkSKey[16] = {0x44, 0x02, 0x42, 0x41, 0xed, 0x4c, 0xe9, 0xa6,
+                                     0x8c, 0x6a, 0x8b, 0xc0, 0x55, 0x23, 0x3f, 0xd3};
+static uint8_t exampleAppSKey[16] = {0xec, 0x92, 0x58, 0x02, 0xae, 0x43, 0x0c, 0xa7,
+                                     0x7f, 0xd3, 0xdd, 0x73, 0xcb, 0x2c, 0xc5, 0x88};
+static const uint8_t exampleFrame[17] = {0x40, 0xF1, 0x7D, 0xBE, 0x49, 0x00, 0x02, 0x00, 0x01,
+                                         0x95, 0x43, 0x78, 0x76, 0x2B, 0x11, 0xFF, 0x0D};
+
+// Build an uplink for the example device. fCtrl holds the flags of FCtrl,
+// e.g. 0x80 for ADR. Returns the frame length.
+static inline uint8_t buildUplink(uint8_t *frame, uint8_t mhdr, uint32_t fCnt, uint8_t fPort,
+                                  const uint8_t *payload, uint8_t payloadLength,
+                                  const uint8_t *fOpts = NULL, uint8_t fOptsLength = 0,
+                                  uint8_t *devAddr = exampleDevAddr, uint8_t fCtrl = 0)
+{
+    AES_Context appSKey;
+    AES_Context nwkSKey;
+    AES_Setup(&appSKey, exampleAppSKey);
+    AES_Setup(&nwkSKey, exampleNwkSKey);
+
+    uint8_t len = 0;
+    frame[len++] = mhdr;
+    frame[len++] = devAddr[3];
+    frame[len++] = devAddr[2];
+    frame[len++] = devAddr[1];
+    frame[len++] = devAddr[0];
+    frame[len++] = fCtrl | fOptsLength;
+    frame[len++] = fCnt & 0xff;
+    frame[len++] = (fCnt >> 8) & 0xff;
+
+    memcpy(&frame[len], fOpts, fOptsLength);
+    len += fOptsLength;
+
+    if (payloadLength > 0)
+    {
+        frame[len++] = fPort;
+        memcpy(&frame[len], payload, payloadLength);
+        encodePacket(&frame[len], payloadLength, fCnt, devAddr, fPort == 0 ? &nwkSKey : &appSKey, 0);
+        len += payloadLength;
+    }
+
+    uint8_t b0[16] = {0x49, 0, 0, 0, 0, 0,
+                      frame[1], frame[2], frame[3], frame[4],
+                      (uint8_t)fCnt, (uint8_t)(fCnt >> 8), (uint8_t)(fCnt >> 16), (uint8_t)(fCnt >> 24),
+                      0, len};
+    uint8_t cmac[16];
+    AES_CMAC_B0(b0, frame, len, cmac, &nwkSKey);
+    memcpy(&frame[len], cmac, 4);
+
+    return len + 4;
+}
+
+#endif
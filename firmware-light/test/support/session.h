@@ -0,0 +1,63 @@
+//
+//  session.h
+//  Fixture shared by the native tests that feed uplinks of the example
+//  device to a LoRaWanP2P, and what came out of onMessage and onResponse.
+//
+
+#ifndef TEST_SESSION_H
+#define TEST_SESSION_H
+
+#include "frames.h"
+
+static LoRaWanP2P *loRaWAN;
+static LoRaWanDevice *device; // The example device, id 3
+
+static int messages;
+static int responses;
+static uint8_t response[64]; // Last response
+static uint8_t responseLength;
+
+static void sessionMessage(LoRaWanDevice *device, uint8_t port, uint8_t *msg, uint8_t length)
+{
+    messages++;
+}
+
+static void sessionResponse(uint8_t *buffer, uint8_t length, uint32_t rxDelay)
+{
+    responses++;
+    responseLength = length;
+    memcpy(response, buffer, length);
+}
+
+// A stack for ABP only, with the example device, returned in example if
+// not NULL. Callbacks are up to the caller, for tests with several stacks.
+static inline LoRaWanP2P *exampleStack(LoRaWanDevice **example = NULL)
+{
+    LoRaWanP2P *stack = new LoRaWanP2P();
+    stack->OTAAEnabled = false;
+    LoRaWanDevice *added = stack->addDevice(exampleDevAddr, exampleNwkSKey, exampleAppSKey, 3);
+    if (example)
+    {
+        *example = added;
+    }
+    return stack;
+}
+
+// From setUp(), a fresh stack in loRaWAN with the captures reset.
+static inline void startSession()
+{
+    loRaWAN = exampleStack(&device);
+    loRaWAN->onMessage(sessionMessage);
+    loRaWAN->onResponse(sessionResponse);
+    messages = 0;
+    responses = 0;
+    responseLength = 0;
+}
+
+// From tearDown().
+static inline void endSession()
+{
+    delete loRaWAN;
+}
+
+#endif
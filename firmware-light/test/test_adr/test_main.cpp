@@ -0,0 +1,217 @@
+//
+//  Adaptive data rate: decisions on the SNR history, LinkADRReq in the
+//  downlink, LinkADRAns and the airtime saved.
+//
+
+#include <unity.h>
+#include "session.h"
+#include "Airtime.h"
+
+static AdrEngine *engine;
+static AdrState state;
+
+void setUp()
+{
+    engine = new AdrEngine();
+    state.reset();
+    startSession();
+}
+
+void tearDown()
+{
+    delete engine;
+    endSession();
+}
+
+// Feed count uplinks, returns how many asked for a LinkADRReq.
+static int feed(uint8_t spreadingFactor, int8_t snr, int count, bool adr = true)
+{
+    int requests = 0;
+    for (int i = 0; i < count; i++)
+    {
+        requests += engine->uplink(&state, spreadingFactor, snr, 20, adr);
+    }
+    return requests;
+}
+
+void test_required_snr()
+{
+    TEST_ASSERT_EQUAL_INT16(-30, AdrEngine::requiredSnr(7)); // -7.5 dB
+    TEST_ASSERT_EQUAL_INT16(-80, AdrEngine::requiredSnr(12)); // -20 dB
+}
+
+void test_waits_for_full_history()
+{
+    TEST_ASSERT_EQUAL_INT(0, feed(12, 40, ADR_HISTORY - 1));
+    TEST_ASSERT_FALSE(engine->pending(&state));
+    TEST_ASSERT_EQUAL_INT(1, feed(12, 40, 1));
+}
+
+void test_strong_link_lowers_sf_then_power()
+{
+    // 10 dB at SF12 is 30 dB above the floor, 20 dB after the margin: 6 steps
+    feed(12, 40, ADR_HISTORY);
+    TEST_ASSERT_TRUE(engine->pending(&state));
+    TEST_ASSERT_EQUAL_UINT8(7, state.requestSF);
+    TEST_ASSERT_EQUAL_UINT8(1, state.requestPower);
+}
+
+void test_best_snr_of_window_counts()
+{
+    feed(12, -60, ADR_HISTORY - 1);
+    feed(12, 40, 1);
+    TEST_ASSERT_EQUAL_UINT8(7, state.requestSF);
+}
+
+void test_sf_kept_within_range()
+{
+    engine->minSF = 9;
+    feed(12, 40, ADR_HISTORY);
+    TEST_ASSERT_EQUAL_UINT8(9, state.requestSF);
+    TEST_ASSERT_EQUAL_UINT8(3, state.requestPower);
+}
+
+void test_weak_link_raises_power()
+{
+    state.power = 3;
+    // -10 dB at SF7 is 2.5 dB below the floor
+    feed(7, -40, ADR_HISTORY);
+    TEST_ASSERT_EQUAL_UINT8(7, state.requestSF);
+    TEST_ASSERT_EQUAL_UINT8(0, state.requestPower);
+}
+
+void test_no_change_no_request()
+{
+    // Exactly the margin at SF7 and max power already
+    TEST_ASSERT_EQUAL_INT(0, feed(7, -30 + ADR_MARGIN, ADR_HISTORY * 2));
+}
+
+void test_without_adr_bit_no_request()
+{
+    TEST_ASSERT_EQUAL_INT(0, feed(12, 40, ADR_HISTORY, false));
+    TEST_ASSERT_FALSE(engine->pending(&state));
+}
+
+void test_request_bytes()
+{
+    engine->channelMask = 0x00FF;
+    feed(12, 40, ADR_HISTORY);
+
+    uint8_t fOpts[15];
+    TEST_ASSERT_EQUAL_UINT8(0, engine->request(&state, fOpts, ADR_REQUEST_LENGTH - 1));
+    TEST_ASSERT_EQUAL_UINT8(ADR_REQUEST_LENGTH, engine->request(&state, fOpts, sizeof(fOpts)));
+
+    const uint8_t expected[] = {MAC_LINK_ADR, 0x51, 0xFF, 0x00, 0x01}; // DR5, TXPower 1
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, fOpts, sizeof(expected));
+}
+
+void test_answer_applies_power()
+{
+    feed(12, 40, ADR_HISTORY);
+    engine->answer(&state, 0x07);
+    TEST_ASSERT_FALSE(engine->pending(&state));
+    TEST_ASSERT_EQUAL_UINT8(1, state.power);
+    TEST_ASSERT_EQUAL_UINT8(0, state.count);
+}
+
+void test_nack_keeps_power()
+{
+    feed(12, 40, ADR_HISTORY);
+    engine->answer(&state, 0x05); // Data rate not accepted
+    TEST_ASSERT_FALSE(engine->pending(&state));
+    TEST_ASSERT_EQUAL_UINT8(0, state.power);
+}
+
+void test_gives_up_without_answer()
+{
+    feed(12, 40, ADR_HISTORY);
+    uint8_t fOpts[15];
+    for (int i = 0; i < ADR_RETRIES; i++)
+    {
+        TEST_ASSERT_EQUAL_INT(1, feed(12, 40, 1));
+        TEST_ASSERT_EQUAL_UINT8(ADR_REQUEST_LENGTH, engine->request(&state, fOpts, sizeof(fOpts)));
+    }
+    TEST_ASSERT_EQUAL_INT(0, feed(12, 40, 1));
+    TEST_ASSERT_FALSE(engine->pending(&state));
+}
+
+void test_airtime_saved()
+{
+    feed(12, 40, 1);
+    TEST_ASSERT_EQUAL_INT32(0, state.airtimeSaved);
+
+    feed(7, 40, 2);
+    TEST_ASSERT_EQUAL_INT32(2 * ((int32_t)loraAirtime(12, 20) - (int32_t)loraAirtime(7, 20)), state.airtimeSaved);
+    TEST_ASSERT_EQUAL_UINT32(3, state.frames);
+    TEST_ASSERT_EQUAL_UINT8(12, state.baseline);
+}
+
+void test_downlink_carries_request()
+{
+    // Like the light without scanning: one spreading factor, only power is adjusted
+    loRaWAN->adr.minSF = 9;
+    loRaWAN->adr.maxSF = 9;
+
+    uint8_t frame[64];
+    uint8_t len;
+    for (int i = 1; i <= ADR_HISTORY; i++)
+    {
+        len = buildUplink(frame, 0x40, i, 1, (const uint8_t *)"x", 1, NULL, 0, exampleDevAddr, 0x80);
+        TEST_ASSERT_EQUAL(LORAWAN_ACCEPTED, loRaWAN->parseMessage(frame, len, -60, 40, 9));
+    }
+
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_HEX8(0x80 | ADR_REQUEST_LENGTH, response[5]); // ADR set, FOptsLen
+    const uint8_t expected[] = {MAC_LINK_ADR, 0x34, 0x01, 0x00, 0x01}; // DR3, TXPower 4
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, &response[8], sizeof(expected));
+
+    // The device accepts in its next uplink
+    const uint8_t answer[] = {MAC_LINK_ADR, 0x07};
+    len = buildUplink(frame, 0x40, ADR_HISTORY + 1, 1, (const uint8_t *)"x", 1, answer, sizeof(answer), exampleDevAddr, 0x80);
+    TEST_ASSERT_EQUAL(LORAWAN_ACCEPTED, loRaWAN->parseMessage(frame, len, -60, 40, 9));
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_UINT8(4, device->adr.power);
+}
+
+void test_unknown_spreading_factor_left_out()
+{
+    uint8_t frame[64];
+    for (int i = 1; i <= ADR_HISTORY; i++)
+    {
+        uint8_t len = buildUplink(frame, 0x40, i, 1, (const uint8_t *)"x", 1, NULL, 0, exampleDevAddr, 0x80);
+        loRaWAN->parseMessage(frame, len, -60, 40);
+    }
+    TEST_ASSERT_EQUAL_INT(0, responses);
+    TEST_ASSERT_EQUAL_UINT32(0, device->adr.frames);
+}
+
+void test_adr_ack_req_answered()
+{
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x40, 1, 1, (const uint8_t *)"x", 1, NULL, 0, exampleDevAddr, 0xC0);
+    loRaWAN->parseMessage(frame, len, -60, 40, 9);
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_HEX8(0x80, response[5]);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_required_snr);
+    RUN_TEST(test_waits_for_full_history);
+    RUN_TEST(test_strong_link_lowers_sf_then_power);
+    RUN_TEST(test_best_snr_of_window_counts);
+    RUN_TEST(test_sf_kept_within_range);
+    RUN_TEST(test_weak_link_raises_power);
+    RUN_TEST(test_no_change_no_request);
+    RUN_TEST(test_without_adr_bit_no_request);
+    RUN_TEST(test_request_bytes);
+    RUN_TEST(test_answer_applies_power);
+    RUN_TEST(test_nack_keeps_power);
+    RUN_TEST(test_gives_up_without_answer);
+    RUN_TEST(test_airtime_saved);
+    RUN_TEST(test_downlink_carries_request);
+    RUN_TEST(test_unknown_spreading_factor_left_out);
+    RUN_TEST(test_adr_ack_req_answered);
+    return UNITY_END();
+}
@@ -0,0 +1,334 @@
+//
+//  Arbitration between lights: claims over the in-process ESP-NOW stand-in,
+//  the best RSSI answering alone, ties, lost and late claims.
+//
+
+#include <unity.h>
+#include "session.h"
+#include "Arbiter.h"
+#include "DownlinkScheduler.h"
+#include "EspNowSim.h"
+
+#define LIGHTS 3
+#define RX_DONE 1000 // micros() at RxDone, the same on all lights
+
+static uint8_t linkKey[16] = {0x20, 0xe4, 0x33, 0xb6, 0x6f, 0xa1, 0xcd, 0x5f, 0xba, 0xa5, 0x38, 0x85, 0x0a, 0xe3, 0xc6, 0x4b};
+static AES_Context linkContext;
+
+// One light, as in main.cpp
+typedef struct Light
+{
+    LoRaWanP2P *loRaWAN;
+    LoRaWanDevice *device;
+    DoorLink link;
+    Arbiter arbiter;
+    DownlinkScheduler downlinks;
+    int messages;
+} Light;
+
+static Light *lights[LIGHTS];
+static EspNowSim *espNow;
+
+// The callbacks of LoRaWanP2P have no context, the frame being handled
+static uint8_t current;
+static const uint8_t *msgData;
+static uint8_t msgLength;
+static int16_t msgRssi;
+static uint32_t msgHandled; // micros() when handled
+
+static void onMessage(LoRaWanDevice *device, uint8_t port, uint8_t *msg, uint8_t length)
+{
+    lights[current]->messages++;
+}
+
+static void onResponse(uint8_t *buffer, uint8_t length, uint32_t rxDelay)
+{
+    Light *light = lights[current];
+    light->downlinks.schedule(buffer, length, RX_DONE, rxDelay * 1000);
+
+    DoorLinkClaim claim;
+    if (light->arbiter.claim(msgData, msgLength, msgRssi, RX_DONE, &claim))
+    {
+        uint8_t buffer[DOORLINK_MAX_FRAME];
+        espNow->send(current, buffer, light->link.claim(&claim, buffer), msgHandled);
+    }
+}
+
+static void onLinkReceive(uint8_t node, uint8_t *data, uint8_t length, uint32_t now)
+{
+    DoorLinkFrame frame;
+    if (lights[node]->link.parse(data, length, &frame) == DOORLINK_CLAIMED)
+    {
+        lights[node]->arbiter.receive(frame.header->sender, frame.claim, now);
+    }
+}
+
+void setUp()
+{
+    AES_Setup(&linkContext, linkKey);
+    espNow = new EspNowSim();
+    for (uint8_t i = 0; i < LIGHTS; i++)
+    {
+        Light *light = lights[i] = new Light();
+        light->loRaWAN = exampleStack(&light->device);
+        light->loRaWAN->onMessage(onMessage);
+        light->loRaWAN->onResponse(onResponse);
+        light->link.begin(&linkContext, i, true);
+        light->arbiter.begin(i);
+        espNow->onReceive(i, onLinkReceive);
+    }
+}
+
+void tearDown()
+{
+    for (uint8_t i = 0; i < LIGHTS; i++)
+    {
+        delete lights[i]->loRaWAN;
+        delete lights[i];
+    }
+    delete espNow;
+}
+
+// Light handles frame, heard with rssi, delay micros after RxDone.
+static void receive(uint8_t light, const uint8_t *frame, uint8_t length, int16_t rssi, uint32_t delay)
+{
+    msgHandled = RX_DONE + delay;
+    espNow->run(msgHandled);
+
+    uint8_t copy[64];
+    memcpy(copy, frame, length);
+    current = light;
+    msgData = copy;
+    msgLength = length;
+    msgRssi = rssi;
+    lights[light]->loRaWAN->parseMessage(copy, length, rssi);
+}
+
+// Run to the end of the window, drop the downlinks of the lights that
+// yield, as handleDownlink() does. Returns the number of lights answering.
+static int answering()
+{
+    uint32_t now = RX_DONE + ARBITER_WINDOW;
+    espNow->run(now);
+
+    int count = 0;
+    for (uint8_t i = 0; i < LIGHTS; i++)
+    {
+        Light *light = lights[i];
+        uint32_t wait;
+        if (light->arbiter.decide(now, &wait) == ARBITER_YIELD)
+        {
+            light->downlinks.cancel();
+            light->loRaWAN->responseDropped(light->downlinks.buffer());
+        }
+        if (light->downlinks.pending())
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+static uint8_t confirmedUplink(uint8_t *frame, uint32_t fCnt)
+{
+    return buildUplink(frame, 0x80, fCnt, 1, (const uint8_t *)"x", 1);
+}
+
+void test_claim_wire_format()
+{
+    DoorLinkClaim claim = {{0xF1, 0x7D, 0xBE, 0x49}, 0x1234, -137};
+    uint8_t buffer[DOORLINK_MAX_FRAME];
+    uint8_t length = lights[0]->link.claim(&claim, buffer);
+    TEST_ASSERT_EQUAL_UINT8(7 + 8 + 4, length);
+
+    DoorLinkFrame frame;
+    TEST_ASSERT_EQUAL(DOORLINK_CLAIMED, lights[1]->link.parse(buffer, length, &frame));
+    TEST_ASSERT_EQUAL_UINT8(0, frame.header->sender);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(claim.devAddr, frame.claim->devAddr, 4);
+    TEST_ASSERT_EQUAL_UINT16(0x1234, frame.claim->fCnt);
+    TEST_ASSERT_EQUAL_INT16(-137, frame.claim->rssi);
+
+    // Tampered or cut off
+    buffer[7] ^= 0x01;
+    TEST_ASSERT_EQUAL(DOORLINK_INVALID_MIC, lights[1]->link.parse(buffer, length, &frame));
+    TEST_ASSERT_EQUAL(DOORLINK_MALFORMED, lights[1]->link.parse(buffer, length - 1, &frame));
+}
+
+void test_best_rssi_answers_alone()
+{
+    uint8_t frame[64];
+    uint8_t length = confirmedUplink(frame, 1);
+    receive(0, frame, length, -90, 3000);
+    receive(1, frame, length, -70, 5000);
+    receive(2, frame, length, -110, 4000);
+
+    TEST_ASSERT_EQUAL_INT(1, answering());
+    TEST_ASSERT_TRUE(lights[1]->downlinks.pending());
+    TEST_ASSERT_EQUAL_UINT32(1, lights[1]->arbiter.won);
+    TEST_ASSERT_EQUAL_UINT32(1, lights[0]->arbiter.yielded);
+    TEST_ASSERT_EQUAL_UINT8(1, lights[2]->arbiter.winner());
+
+    // All lights show the door
+    for (uint8_t i = 0; i < LIGHTS; i++)
+    {
+        TEST_ASSERT_EQUAL_INT(1, lights[i]->messages);
+    }
+}
+
+void test_tie_goes_to_lowest_sender()
+{
+    uint8_t frame[64];
+    uint8_t length = confirmedUplink(frame, 1);
+    receive(2, frame, length, -80, 1000);
+    receive(1, frame, length, -80, 2000);
+
+    TEST_ASSERT_EQUAL_INT(1, answering());
+    TEST_ASSERT_TRUE(lights[1]->downlinks.pending());
+}
+
+void test_lost_claim_answers_twice()
+{
+    uint8_t frame[64];
+    uint8_t length = confirmedUplink(frame, 1);
+    espNow->cut(1, 0);
+    receive(0, frame, length, -90, 1000);
+    receive(1, frame, length, -70, 1000);
+
+    // Light 0 never heard of the better one, as without arbitration
+    TEST_ASSERT_EQUAL_INT(2, answering());
+    TEST_ASSERT_EQUAL_UINT32(1, espNow->lost);
+}
+
+void test_no_claim_without_downlink()
+{
+    uint8_t frame[64];
+    uint8_t length = buildUplink(frame, 0x40, 1, 1, (const uint8_t *)"x", 1);
+    for (uint8_t i = 0; i < LIGHTS; i++)
+    {
+        receive(i, frame, length, -80, 1000);
+    }
+
+    TEST_ASSERT_EQUAL_INT(0, answering());
+    TEST_ASSERT_EQUAL_UINT32(0, espNow->sent);
+    TEST_ASSERT_EQUAL_INT(1, lights[2]->messages);
+}
+
+void test_yield_keeps_device_state()
+{
+    for (uint8_t i = 0; i < LIGHTS; i++)
+    {
+        lights[i]->loRaWAN->enqueueDownlink(exampleDevAddr, 10, (const uint8_t *)"a", 1, false);
+    }
+
+    // Confirmed, with a LinkCheckReq
+    uint8_t linkCheck[1] = {MAC_LINK_CHECK};
+    uint8_t frame[64];
+    uint8_t length = buildUplink(frame, 0x80, 1, 1, (const uint8_t *)"x", 1, linkCheck, sizeof(linkCheck));
+    receive(0, frame, length, -90, 1000);
+    receive(1, frame, length, -70, 1000);
+
+    TEST_ASSERT_EQUAL_INT(1, answering());
+    TEST_ASSERT_TRUE(lights[1]->downlinks.pending());
+
+    // Light 0 did not answer, it still has all of it for the next uplink
+    LoRaWanDevice *device = lights[0]->device;
+    TEST_ASSERT_TRUE(device->mac.due & MAC_DUE_LINK_CHECK);
+    TEST_ASSERT_NOT_NULL(lights[0]->loRaWAN->queue.next(exampleDevAddr));
+    TEST_ASSERT_NULL(lights[0]->loRaWAN->queue.taken(exampleDevAddr));
+    TEST_ASSERT_EQUAL_UINT32(0, lights[0]->loRaWAN->queue.delivered);
+
+    // The answer to the next uplink carries them, but never the frame
+    // counter light 1 sent, the device took that one already
+    const uint8_t *sent = lights[1]->downlinks.buffer();
+    uint16_t sentFCnt = sent[6] | sent[7] << 8;
+    length = confirmedUplink(frame, 2);
+    receive(0, frame, length, -90, 1000);
+    const uint8_t *response = lights[0]->downlinks.buffer();
+    TEST_ASSERT_TRUE((uint16_t)(response[6] | response[7] << 8) > sentFCnt);
+    TEST_ASSERT_EQUAL_HEX8(0x60, response[0]);
+    TEST_ASSERT_EQUAL_HEX8(MAC_LINK_CHECK, response[8]);
+}
+
+void test_waits_for_the_window()
+{
+    uint8_t frame[64];
+    uint8_t length = confirmedUplink(frame, 1);
+    receive(0, frame, length, -80, 1000);
+
+    uint32_t wait = 0;
+    TEST_ASSERT_EQUAL(ARBITER_WAIT, lights[0]->arbiter.decide(RX_DONE + 1000, &wait));
+    TEST_ASSERT_EQUAL_UINT32(ARBITER_WINDOW - 1000, wait);
+    TEST_ASSERT_EQUAL(ARBITER_ANSWER, lights[0]->arbiter.decide(RX_DONE + ARBITER_WINDOW, &wait));
+    TEST_ASSERT_EQUAL(ARBITER_IDLE, lights[0]->arbiter.decide(RX_DONE + ARBITER_WINDOW, &wait));
+}
+
+void test_late_claim_ignored()
+{
+    Arbiter *arbiter = &lights[0]->arbiter;
+    uint8_t frame[64];
+    uint8_t length = confirmedUplink(frame, 1);
+
+    DoorLinkClaim own;
+    TEST_ASSERT_TRUE(arbiter->claim(frame, length, -90, RX_DONE, &own));
+    DoorLinkClaim better = own;
+    better.rssi = -60;
+    arbiter->receive(1, &better, RX_DONE + ARBITER_WINDOW + 1);
+
+    uint32_t wait;
+    TEST_ASSERT_EQUAL(ARBITER_ANSWER, arbiter->decide(RX_DONE + ARBITER_WINDOW + 1, &wait));
+    TEST_ASSERT_EQUAL_UINT32(1, arbiter->heard);
+    TEST_ASSERT_EQUAL_UINT32(1, arbiter->late);
+}
+
+void test_claim_before_own_counts()
+{
+    Arbiter *arbiter = &lights[0]->arbiter;
+    uint8_t frame[64];
+    uint8_t length = confirmedUplink(frame, 7);
+
+    // The other light handled the uplink sooner
+    DoorLinkClaim other = {{frame[1], frame[2], frame[3], frame[4]}, 7, -60};
+    arbiter->receive(1, &other, RX_DONE - 100);
+
+    DoorLinkClaim own;
+    arbiter->claim(frame, length, -90, RX_DONE, &own);
+    uint32_t wait;
+    TEST_ASSERT_EQUAL(ARBITER_YIELD, arbiter->decide(RX_DONE + ARBITER_WINDOW, &wait));
+
+    // A retransmission of the same uplink seconds later is arbitrated anew
+    arbiter->claim(frame, length, -90, RX_DONE + 3000000, &own);
+    TEST_ASSERT_EQUAL(ARBITER_ANSWER, arbiter->decide(RX_DONE + 3000000 + ARBITER_WINDOW, &wait));
+}
+
+void test_only_data_uplinks()
+{
+    Arbiter *arbiter = &lights[0]->arbiter;
+    DoorLinkClaim claim;
+    uint8_t joinRequest[23] = {0x00};
+    TEST_ASSERT_FALSE(arbiter->claim(joinRequest, sizeof(joinRequest), -80, RX_DONE, &claim));
+
+    uint8_t frame[64];
+    uint8_t length = confirmedUplink(frame, 1);
+    arbiter->window = 0;
+    TEST_ASSERT_FALSE(arbiter->claim(frame, length, -80, RX_DONE, &claim));
+
+    uint32_t wait;
+    TEST_ASSERT_EQUAL(ARBITER_IDLE, arbiter->decide(RX_DONE, &wait));
+    TEST_ASSERT_EQUAL_UINT32(0, arbiter->claims);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_claim_wire_format);
+    RUN_TEST(test_best_rssi_answers_alone);
+    RUN_TEST(test_tie_goes_to_lowest_sender);
+    RUN_TEST(test_lost_claim_answers_twice);
+    RUN_TEST(test_no_claim_without_downlink);
+    RUN_TEST(test_yield_keeps_device_state);
+    RUN_TEST(test_waits_for_the_window);
+    RUN_TEST(test_late_claim_ignored);
+    RUN_TEST(test_claim_before_own_counts);
+    RUN_TEST(test_only_data_uplinks);
+    return UNITY_END();
+}
@@ -0,0 +1,128 @@
+//
+//  Duplicate frames: the cache key, expiry, and copies dropped before any
+//  AES work without being forwarded or answered again.
+//
+
+#include <unity.h>
+#include "session.h"
+
+static DedupCache *cache;
+
+void setUp()
+{
+    cache = new DedupCache();
+    startSession();
+}
+
+void tearDown()
+{
+    delete cache;
+    endSession();
+}
+
+void test_key_covers_all_fields()
+{
+    uint8_t devAddr[4] = {0x26, 0x01, 0x02, 0x03};
+    uint8_t mic[4] = {1, 2, 3, 4};
+    uint32_t key = DedupCache::key(devAddr, 10, mic);
+
+    TEST_ASSERT_EQUAL_UINT32(key, DedupCache::key(devAddr, 10, mic));
+    TEST_ASSERT_NOT_EQUAL(key, DedupCache::key(devAddr, 11, mic));
+    mic[3] = 5;
+    TEST_ASSERT_NOT_EQUAL(key, DedupCache::key(devAddr, 10, mic));
+    mic[3] = 4;
+    devAddr[0] = 0x27;
+    TEST_ASSERT_NOT_EQUAL(key, DedupCache::key(devAddr, 10, mic));
+}
+
+void test_expiry()
+{
+    cache->add(1, 1000);
+    TEST_ASSERT_TRUE(cache->seen(1, 1000));
+    TEST_ASSERT_TRUE(cache->seen(1, 1000 + DEDUP_EXPIRY - 1));
+    TEST_ASSERT_FALSE(cache->seen(1, 1000 + DEDUP_EXPIRY));
+    TEST_ASSERT_FALSE(cache->seen(2, 1000));
+
+    TEST_ASSERT_EQUAL_UINT32(4, cache->lookups);
+    TEST_ASSERT_EQUAL_UINT32(2, cache->hits);
+
+    // Across the millis() wrap around
+    cache->add(3, 0xFFFFFF00);
+    TEST_ASSERT_TRUE(cache->seen(3, 0x00000010));
+}
+
+void test_oldest_replaced()
+{
+    for (uint32_t key = 1; key <= DEDUP_CACHE_SIZE + 1; key++)
+    {
+        cache->add(key, 0);
+    }
+    TEST_ASSERT_FALSE(cache->seen(1, 0));
+    TEST_ASSERT_TRUE(cache->seen(2, 0));
+    TEST_ASSERT_TRUE(cache->seen(DEDUP_CACHE_SIZE + 1, 0));
+}
+
+void test_disabled()
+{
+    cache->expiry = 0;
+    cache->add(1, 0);
+    TEST_ASSERT_FALSE(cache->seen(1, 0));
+    TEST_ASSERT_EQUAL_UINT32(0, cache->lookups);
+}
+
+void test_copy_not_forwarded()
+{
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x40, 1, 1, (const uint8_t *)"x", 1);
+
+    TEST_ASSERT_EQUAL(LORAWAN_ACCEPTED, loRaWAN->parseMessage(frame, len, -60));
+    uint32_t cmacs = loRaWAN->fCntResolver.cmacs;
+    TEST_ASSERT_EQUAL(LORAWAN_DUPLICATE, loRaWAN->parseMessage(frame, len, -60));
+
+    TEST_ASSERT_EQUAL_INT(1, messages);
+    TEST_ASSERT_EQUAL_UINT32(cmacs, loRaWAN->fCntResolver.cmacs);
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->dedup.hits);
+    TEST_ASSERT_EQUAL_UINT32(2, loRaWAN->dedup.lookups);
+}
+
+void test_confirmed_copy_not_acked_again()
+{
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x80, 1, 1, (const uint8_t *)"x", 1);
+
+    loRaWAN->parseMessage(frame, len, -60);
+    uint32_t fCntDown = device->fCntDown;
+    TEST_ASSERT_EQUAL_INT(1, responses);
+
+    TEST_ASSERT_EQUAL(LORAWAN_DUPLICATE, loRaWAN->parseMessage(frame, len, -60));
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_UINT32(fCntDown, device->fCntDown);
+}
+
+void test_invalid_mic_not_remembered()
+{
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x40, 1, 1, (const uint8_t *)"x", 1);
+    frame[len - 1] ^= 0x01;
+
+    TEST_ASSERT_EQUAL(LORAWAN_INVALID_MIC, loRaWAN->parseMessage(frame, len, -60));
+    TEST_ASSERT_EQUAL(LORAWAN_INVALID_MIC, loRaWAN->parseMessage(frame, len, -60));
+    TEST_ASSERT_EQUAL_UINT32(0, loRaWAN->dedup.hits);
+
+    // The valid frame with the same counter still gets through
+    frame[len - 1] ^= 0x01;
+    TEST_ASSERT_EQUAL(LORAWAN_ACCEPTED, loRaWAN->parseMessage(frame, len, -60));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_key_covers_all_fields);
+    RUN_TEST(test_expiry);
+    RUN_TEST(test_oldest_replaced);
+    RUN_TEST(test_disabled);
+    RUN_TEST(test_copy_not_forwarded);
+    RUN_TEST(test_confirmed_copy_not_acked_again);
+    RUN_TEST(test_invalid_mic_not_remembered);
+    return UNITY_END();
+}
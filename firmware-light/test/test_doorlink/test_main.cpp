@@ -0,0 +1,153 @@
+//
+//  ESP-NOW wire format: batching, MIC, duplicates, acks and retransmits.
+//
+
+#include <unity.h>
+#include "encryption.h"
+#include "DoorLink.h"
+
+static uint8_t linkKey[16] = {0x20, 0xe4, 0x33, 0xb6, 0x6f, 0xa1, 0xcd, 0x5f, 0xba, 0xa5, 0x38, 0x85, 0x0a, 0xe3, 0xc6, 0x4b};
+static AES_Context ctx;
+static DoorLink *light;
+static DoorLink *relay;
+static uint8_t buffer[DOORLINK_MAX_FRAME];
+
+void setUp()
+{
+    AES_Setup(&ctx, linkKey);
+    light = new DoorLink();
+    relay = new DoorLink();
+    light->begin(&ctx, 0, true);
+    relay->begin(&ctx, 0x80, false);
+}
+
+void tearDown()
+{
+    delete light;
+    delete relay;
+}
+
+void test_wire_format_size()
+{
+    TEST_ASSERT_EQUAL_INT(7, sizeof(DoorLinkHeader));
+    TEST_ASSERT_EQUAL_INT(5, sizeof(DoorLinkEvent));
+    TEST_ASSERT_TRUE(DOORLINK_MAX_FRAME <= 250); // ESP-NOW payload limit
+}
+
+void test_batches_events()
+{
+    DoorLinkFrame frame;
+
+    TEST_ASSERT_EQUAL_UINT8(0, light->poll(0, buffer));
+    light->add(0, DOORLINK_EVENT_OPENED, 3000, -90);
+    light->add(1, DOORLINK_EVENT_CLOSED, 2100, -200);
+
+    uint8_t length = light->poll(0, buffer);
+    TEST_ASSERT_EQUAL_UINT8(7 + 2 * 5 + 4, length);
+    TEST_ASSERT_EQUAL(DOORLINK_RECEIVED, relay->parse(buffer, length, &frame));
+    TEST_ASSERT_EQUAL_UINT8(2, frame.header->count);
+    TEST_ASSERT_EQUAL_UINT8(0, frame.header->sender);
+    TEST_ASSERT_TRUE(frame.header->flags & DOORLINK_FLAG_ACK);
+    TEST_ASSERT_EQUAL_UINT8(DOORLINK_EVENT_OPENED, frame.events[0].event);
+    TEST_ASSERT_EQUAL_UINT16(3000, frame.events[0].battery);
+    TEST_ASSERT_EQUAL_INT8(-90, frame.events[0].rssi);
+    TEST_ASSERT_EQUAL_UINT8(1, frame.events[1].device);
+    TEST_ASSERT_EQUAL_INT8(-128, frame.events[1].rssi);
+}
+
+void test_rejects_tampered_frames()
+{
+    DoorLinkFrame frame;
+    light->add(0, DOORLINK_EVENT_OPENED, 3000, -90);
+    uint8_t length = light->poll(0, buffer);
+
+    buffer[8] ^= 0x01;
+    TEST_ASSERT_EQUAL(DOORLINK_INVALID_MIC, relay->parse(buffer, length, &frame));
+    buffer[8] ^= 0x01;
+    TEST_ASSERT_EQUAL(DOORLINK_MALFORMED, relay->parse(buffer, length - 1, &frame));
+    buffer[0] = DOORLINK_VERSION + 1;
+    TEST_ASSERT_EQUAL(DOORLINK_MALFORMED, relay->parse(buffer, length, &frame));
+    TEST_ASSERT_EQUAL_UINT32(3, relay->invalid);
+}
+
+void test_ack_stops_retransmits()
+{
+    DoorLinkFrame frame;
+    uint8_t ack[DOORLINK_MAX_FRAME];
+
+    light->add(0, DOORLINK_EVENT_OPENED, 3000, -90);
+    uint8_t length = light->poll(0, buffer);
+    TEST_ASSERT_EQUAL(DOORLINK_RECEIVED, relay->parse(buffer, length, &frame));
+
+    // Ack lost, the light sends the frame again, which the relay only acks
+    TEST_ASSERT_EQUAL_UINT8(0, light->poll(DOORLINK_RETRY_INTERVAL - 1, buffer));
+    TEST_ASSERT_EQUAL_UINT8(length, light->poll(DOORLINK_RETRY_INTERVAL, buffer));
+    TEST_ASSERT_EQUAL(DOORLINK_DUPLICATE, relay->parse(buffer, length, &frame));
+
+    uint8_t ackLength = relay->ack(&frame, ack);
+    TEST_ASSERT_EQUAL(DOORLINK_ACKED, light->parse(ack, ackLength, &frame));
+    TEST_ASSERT_TRUE(light->idle());
+    TEST_ASSERT_EQUAL_UINT8(0, light->poll(1000, buffer));
+    TEST_ASSERT_EQUAL_UINT32(1, light->retransmits);
+}
+
+void test_gives_up_after_retries()
+{
+    light->add(0, DOORLINK_EVENT_OPENED, 3000, -90);
+    light->poll(0, buffer);
+    light->add(1, DOORLINK_EVENT_OPENED, 3000, -90);
+
+    uint32_t now = 0;
+    for (int i = 0; i < DOORLINK_MAX_RETRIES; i++)
+    {
+        now += DOORLINK_RETRY_INTERVAL;
+        TEST_ASSERT_NOT_EQUAL(0, light->poll(now, buffer));
+    }
+
+    // The waiting event goes out in the next frame
+    DoorLinkFrame frame;
+    now += DOORLINK_RETRY_INTERVAL;
+    uint8_t length = light->poll(now, buffer);
+    TEST_ASSERT_EQUAL(DOORLINK_RECEIVED, relay->parse(buffer, length, &frame));
+    TEST_ASSERT_EQUAL_UINT8(1, frame.events[0].device);
+    TEST_ASSERT_EQUAL_UINT16(1, frame.header->sequence);
+    TEST_ASSERT_EQUAL_UINT32(1, light->failed);
+}
+
+void test_stale_ack_ignored()
+{
+    DoorLinkFrame frame;
+    uint8_t ack[DOORLINK_MAX_FRAME];
+
+    light->add(0, DOORLINK_EVENT_OPENED, 3000, -90);
+    uint8_t length = light->poll(0, buffer);
+    relay->parse(buffer, length, &frame);
+    uint8_t ackLength = relay->ack(&frame, ack);
+    ((DoorLinkHeader *)ack)->sequence++; // Breaks the MIC too
+    TEST_ASSERT_EQUAL(DOORLINK_INVALID_MIC, light->parse(ack, ackLength, &frame));
+    TEST_ASSERT_FALSE(light->idle());
+}
+
+void test_batch_limit()
+{
+    for (int i = 0; i < DOORLINK_MAX_EVENTS; i++)
+    {
+        TEST_ASSERT_TRUE(light->add(i, DOORLINK_EVENT_OPENED, 3000, -90));
+    }
+    TEST_ASSERT_FALSE(light->add(0, DOORLINK_EVENT_OPENED, 3000, -90));
+    TEST_ASSERT_EQUAL_UINT32(1, light->dropped);
+    TEST_ASSERT_EQUAL_UINT8(DOORLINK_MAX_FRAME, light->poll(0, buffer));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_wire_format_size);
+    RUN_TEST(test_batches_events);
+    RUN_TEST(test_rejects_tampered_frames);
+    RUN_TEST(test_ack_stops_retransmits);
+    RUN_TEST(test_gives_up_after_retries);
+    RUN_TEST(test_stale_ack_ignored);
+    RUN_TEST(test_batch_limit);
+    return UNITY_END();
+}
@@ -0,0 +1,141 @@
+//
+//  Downlink window timing, RX2 fallback and latency calibration.
+//
+
+#include <unity.h>
+#include "DownlinkScheduler.h"
+
+static DownlinkScheduler *scheduler;
+static uint8_t payload[4] = {0x60, 0x01, 0x02, 0x03};
+
+void setUp()
+{
+    scheduler = new DownlinkScheduler();
+}
+
+void tearDown()
+{
+    delete scheduler;
+}
+
+void test_idle_without_downlink()
+{
+    uint32_t wait;
+    TEST_ASSERT_EQUAL(DOWNLINK_IDLE, scheduler->poll(0, &wait));
+}
+
+void test_waits_until_rx1()
+{
+    uint32_t wait = 0;
+    TEST_ASSERT_TRUE(scheduler->schedule(payload, 4, 5000, 1000000));
+
+    TEST_ASSERT_EQUAL(DOWNLINK_WAIT, scheduler->poll(5000, &wait));
+    TEST_ASSERT_EQUAL_UINT32(1000000, wait);
+    TEST_ASSERT_EQUAL(DOWNLINK_WAIT, scheduler->poll(1004999, &wait));
+    TEST_ASSERT_EQUAL_UINT32(1, wait);
+    TEST_ASSERT_EQUAL(DOWNLINK_SEND_RX1, scheduler->poll(1005000, &wait));
+
+    scheduler->sent(1005000);
+    TEST_ASSERT_FALSE(scheduler->pending());
+    TEST_ASSERT_EQUAL_UINT32(1, scheduler->sentRX1);
+}
+
+void test_falls_back_to_rx2()
+{
+    uint32_t wait = 0;
+    scheduler->schedule(payload, 4, 0, 1000000);
+
+    // The loop was busy, RX1 is long gone
+    TEST_ASSERT_EQUAL(DOWNLINK_WAIT, scheduler->poll(1100000, &wait));
+    TEST_ASSERT_EQUAL_UINT32(900000, wait);
+    TEST_ASSERT_EQUAL(DOWNLINK_SEND_RX2, scheduler->poll(2000000, &wait));
+
+    scheduler->sent(2000000);
+    TEST_ASSERT_EQUAL_UINT32(1, scheduler->sentRX2);
+}
+
+void test_misses_both_windows()
+{
+    uint32_t wait;
+    scheduler->schedule(payload, 4, 0, 1000000);
+
+    TEST_ASSERT_EQUAL(DOWNLINK_MISSED, scheduler->poll(2100000, &wait));
+    TEST_ASSERT_FALSE(scheduler->pending());
+    TEST_ASSERT_EQUAL_UINT32(1, scheduler->missed);
+}
+
+void test_one_downlink_at_a_time()
+{
+    TEST_ASSERT_TRUE(scheduler->schedule(payload, 4, 0, 1000000));
+    TEST_ASSERT_FALSE(scheduler->schedule(payload, 4, 0, 1000000));
+    TEST_ASSERT_EQUAL_UINT32(1, scheduler->dropped);
+}
+
+void test_micros_wrap_around()
+{
+    uint32_t wait = 0;
+    scheduler->schedule(payload, 4, 0xFFFF0000, 1000000);
+
+    TEST_ASSERT_EQUAL(DOWNLINK_WAIT, scheduler->poll(0xFFFF0000, &wait));
+    TEST_ASSERT_EQUAL_UINT32(1000000, wait);
+    TEST_ASSERT_EQUAL(DOWNLINK_SEND_RX1, scheduler->poll(0xFFFF0000 + 1000000, &wait));
+}
+
+void test_calibrates_latency()
+{
+    uint32_t wait;
+    uint32_t rxDone = 0;
+
+    // Every transmit starts 2 ms after the poll that released it
+    for (int i = 0; i < 40; i++)
+    {
+        scheduler->schedule(payload, 4, rxDone, 1000000);
+        uint32_t now = rxDone;
+        while (scheduler->poll(now, &wait) == DOWNLINK_WAIT)
+        {
+            now += wait;
+        }
+        scheduler->sent(now + 2000);
+        rxDone += 10000000;
+    }
+
+    TEST_ASSERT_UINT32_WITHIN(10, 2000, scheduler->lead);
+    TEST_ASSERT_EQUAL_UINT32(40, scheduler->sentRX1);
+}
+
+void test_skip_defers_then_suppresses()
+{
+    uint32_t wait;
+    scheduler->schedule(payload, 4, 0, 1000000);
+    TEST_ASSERT_EQUAL(DOWNLINK_SEND_RX1, scheduler->poll(1000000, &wait));
+
+    // No budget in the RX1 band
+    scheduler->skip();
+    TEST_ASSERT_TRUE(scheduler->pending());
+    TEST_ASSERT_TRUE(scheduler->rx2());
+    TEST_ASSERT_EQUAL(DOWNLINK_WAIT, scheduler->poll(1000000, &wait));
+    TEST_ASSERT_EQUAL_UINT32(1000000, wait);
+    TEST_ASSERT_EQUAL(DOWNLINK_SEND_RX2, scheduler->poll(2000000, &wait));
+
+    // None in the RX2 band either
+    scheduler->skip();
+    TEST_ASSERT_FALSE(scheduler->pending());
+    TEST_ASSERT_EQUAL(DOWNLINK_IDLE, scheduler->poll(2000000, &wait));
+    TEST_ASSERT_EQUAL_UINT32(1, scheduler->deferred);
+    TEST_ASSERT_EQUAL_UINT32(1, scheduler->suppressed);
+    TEST_ASSERT_EQUAL_UINT32(0, scheduler->sentRX1 + scheduler->sentRX2);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_idle_without_downlink);
+    RUN_TEST(test_waits_until_rx1);
+    RUN_TEST(test_falls_back_to_rx2);
+    RUN_TEST(test_misses_both_windows);
+    RUN_TEST(test_one_downlink_at_a_time);
+    RUN_TEST(test_micros_wrap_around);
+    RUN_TEST(test_calibrates_latency);
+    RUN_TEST(test_skip_defers_then_suppresses);
+    return UNITY_END();
+}
@@ -0,0 +1,228 @@
+//
+//  Application downlinks: queueing per device, encryption, FPending,
+//  retransmission of confirmed downlinks and the metrics.
+//
+
+#include <unity.h>
+#include "session.h"
+
+static DownlinkQueue *queue;
+
+void setUp()
+{
+    queue = new DownlinkQueue();
+    startSession();
+}
+
+void tearDown()
+{
+    delete queue;
+    endSession();
+}
+
+// Send an uplink with fCnt, and the response to it if transmit.
+static void send(uint32_t fCnt, bool ack = false, bool transmit = true)
+{
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x40, fCnt, 1, (const uint8_t *)"x", 1, NULL, 0, exampleDevAddr, ack ? 0x20 : 0);
+    int before = responses;
+    loRaWAN->parseMessage(frame, len, -60);
+    if (responses > before)
+    {
+        if (transmit)
+        {
+            loRaWAN->responseSent(response);
+        }
+        else
+        {
+            loRaWAN->responseDropped(response);
+        }
+    }
+}
+
+// Port and decrypted FRMPayload of the last response. Returns the payload length.
+static uint8_t responsePayload(uint8_t *port, uint8_t *payload)
+{
+    uint8_t fOptsLength = response[5] & 0x0f;
+    uint8_t start = 8 + fOptsLength;
+    uint8_t length = responseLength - 4 - start - 1;
+    *port = response[start];
+    memcpy(payload, &response[start + 1], length);
+
+    AES_Context appSKey;
+    AES_Setup(&appSKey, exampleAppSKey);
+    encodePacket(payload, length, response[6] | response[7] << 8, exampleDevAddr, &appSKey, 1);
+    return length;
+}
+
+void test_fifo_per_device()
+{
+    uint8_t other[4] = {0x26, 0x01, 0x02, 0x03};
+    TEST_ASSERT_TRUE(queue->add(exampleDevAddr, 1, (const uint8_t *)"a", 1, false, 0));
+    TEST_ASSERT_TRUE(queue->add(other, 1, (const uint8_t *)"b", 1, false, 0));
+    TEST_ASSERT_TRUE(queue->add(exampleDevAddr, 2, (const uint8_t *)"c", 1, false, 0));
+
+    TEST_ASSERT_EQUAL_UINT8(2, queue->depth(exampleDevAddr));
+    TEST_ASSERT_EQUAL_UINT8(3, queue->depth());
+
+    QueuedDownlink *downlink = queue->next(exampleDevAddr);
+    TEST_ASSERT_EQUAL_UINT8('a', downlink->payload[0]);
+    queue->sent(downlink, 10);
+    TEST_ASSERT_EQUAL_UINT8('c', queue->next(exampleDevAddr)->payload[0]);
+    TEST_ASSERT_EQUAL_UINT8('b', queue->next(other)->payload[0]);
+}
+
+void test_bounded()
+{
+    uint8_t payload[DOWNLINK_MAX_PAYLOAD + 1] = {};
+    TEST_ASSERT_FALSE(queue->add(exampleDevAddr, 1, payload, sizeof(payload), false, 0));
+
+    for (int i = 0; i < DOWNLINK_QUEUE_DEPTH; i++)
+    {
+        TEST_ASSERT_TRUE(queue->add(exampleDevAddr, 1, payload, 1, false, 0));
+    }
+    TEST_ASSERT_FALSE(queue->add(exampleDevAddr, 1, payload, 1, false, 0));
+    TEST_ASSERT_EQUAL_UINT32(2, queue->rejected);
+    TEST_ASSERT_EQUAL_UINT8(DOWNLINK_QUEUE_DEPTH, queue->maxDepth);
+}
+
+void test_confirmed_waits_for_ack()
+{
+    queue->add(exampleDevAddr, 1, (const uint8_t *)"a", 1, true, 100);
+    queue->sent(queue->next(exampleDevAddr), 200);
+    TEST_ASSERT_EQUAL_UINT32(0, queue->delivered);
+
+    // No ACK, goes out again
+    queue->uplink(exampleDevAddr, false, 300);
+    QueuedDownlink *downlink = queue->next(exampleDevAddr);
+    TEST_ASSERT_NOT_NULL(downlink);
+    TEST_ASSERT_FALSE(downlink->sent);
+    queue->sent(downlink, 400);
+    TEST_ASSERT_EQUAL_UINT32(1, queue->retransmits);
+
+    queue->uplink(exampleDevAddr, true, 500);
+    TEST_ASSERT_NULL(queue->next(exampleDevAddr));
+    TEST_ASSERT_EQUAL_UINT32(1, queue->delivered);
+    TEST_ASSERT_EQUAL_UINT32(400, queue->latencyMax);
+}
+
+void test_confirmed_fails_after_retries()
+{
+    queue->add(exampleDevAddr, 1, (const uint8_t *)"a", 1, true, 0);
+    for (int i = 0; i < DOWNLINK_RETRIES; i++)
+    {
+        queue->sent(queue->next(exampleDevAddr), 0);
+        queue->uplink(exampleDevAddr, false, 0);
+    }
+    TEST_ASSERT_NULL(queue->next(exampleDevAddr));
+    TEST_ASSERT_EQUAL_UINT32(1, queue->failed);
+    TEST_ASSERT_EQUAL_UINT32(0, queue->delivered);
+}
+
+void test_enqueue_checks()
+{
+    uint8_t other[4] = {0x26, 0x01, 0x02, 0x03};
+    TEST_ASSERT_FALSE(loRaWAN->enqueueDownlink(other, 1, (const uint8_t *)"a", 1, false));
+    TEST_ASSERT_FALSE(loRaWAN->enqueueDownlink(exampleDevAddr, 0, (const uint8_t *)"a", 1, false));
+    TEST_ASSERT_FALSE(loRaWAN->enqueueDownlink(exampleDevAddr, 224, (const uint8_t *)"a", 1, false));
+    TEST_ASSERT_TRUE(loRaWAN->enqueueDownlink(exampleDevAddr, 1, (const uint8_t *)"a", 1, false));
+}
+
+void test_next_uplink_carries_payload()
+{
+    const uint8_t config[] = {0x01, 0x00, 0x0e, 0x10};
+    loRaWAN->enqueueDownlink(exampleDevAddr, 10, config, sizeof(config), false);
+    loRaWAN->enqueueDownlink(exampleDevAddr, 11, config, 2, false);
+
+    send(1);
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_HEX8(0x60, response[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x10, response[5] & 0x10); // FPending, one more queued
+
+    uint8_t port;
+    uint8_t payload[DOWNLINK_MAX_PAYLOAD];
+    TEST_ASSERT_EQUAL_UINT8(sizeof(config), responsePayload(&port, payload));
+    TEST_ASSERT_EQUAL_UINT8(10, port);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(config, payload, sizeof(config));
+
+    send(2);
+    TEST_ASSERT_EQUAL_INT(2, responses);
+    TEST_ASSERT_EQUAL_HEX8(0x00, response[5] & 0x10);
+    TEST_ASSERT_EQUAL_UINT8(2, responsePayload(&port, payload));
+    TEST_ASSERT_EQUAL_UINT8(11, port);
+
+    send(3);
+    TEST_ASSERT_EQUAL_INT(2, responses);
+    TEST_ASSERT_EQUAL_UINT32(2, loRaWAN->queue.delivered);
+}
+
+void test_confirmed_downlink_resent_until_ack()
+{
+    loRaWAN->enqueueDownlink(exampleDevAddr, 10, (const uint8_t *)"a", 1, true);
+
+    send(1);
+    TEST_ASSERT_EQUAL_HEX8(0xa0, response[0]);
+    uint16_t firstFCnt = response[6] | response[7] << 8;
+
+    // Lost, the next uplink has no ACK
+    send(2);
+    TEST_ASSERT_EQUAL_INT(2, responses);
+    TEST_ASSERT_EQUAL_HEX8(0xa0, response[0]);
+    TEST_ASSERT_EQUAL_UINT16(firstFCnt + 1, response[6] | response[7] << 8);
+
+    send(3, true);
+    TEST_ASSERT_EQUAL_INT(2, responses);
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->queue.delivered);
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->queue.retransmits);
+}
+
+void test_taken_until_transmitted()
+{
+    queue->add(exampleDevAddr, 1, (const uint8_t *)"a", 1, false, 100);
+    QueuedDownlink *downlink = queue->next(exampleDevAddr);
+    TEST_ASSERT_NULL(queue->taken(exampleDevAddr));
+
+    queue->take(downlink);
+    TEST_ASSERT_EQUAL_PTR(downlink, queue->taken(exampleDevAddr));
+    TEST_ASSERT_EQUAL_UINT32(0, queue->delivered);
+
+    queue->returned(downlink);
+    TEST_ASSERT_NULL(queue->taken(exampleDevAddr));
+    TEST_ASSERT_EQUAL_PTR(downlink, queue->next(exampleDevAddr));
+    TEST_ASSERT_EQUAL_UINT8(0, downlink->attempts);
+}
+
+void test_dropped_response_keeps_payload()
+{
+    loRaWAN->enqueueDownlink(exampleDevAddr, 10, (const uint8_t *)"a", 1, false);
+
+    // Built but never transmitted, e.g. both windows missed
+    send(1, false, false);
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_UINT32(0, loRaWAN->queue.delivered);
+    TEST_ASSERT_EQUAL_UINT8(1, loRaWAN->queue.depth(exampleDevAddr));
+
+    send(2);
+    TEST_ASSERT_EQUAL_INT(2, responses);
+    uint8_t port;
+    uint8_t payload[DOWNLINK_MAX_PAYLOAD];
+    TEST_ASSERT_EQUAL_UINT8(1, responsePayload(&port, payload));
+    TEST_ASSERT_EQUAL_UINT8('a', payload[0]);
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->queue.delivered);
+    TEST_ASSERT_EQUAL_UINT32(0, loRaWAN->queue.retransmits);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_fifo_per_device);
+    RUN_TEST(test_bounded);
+    RUN_TEST(test_confirmed_waits_for_ack);
+    RUN_TEST(test_confirmed_fails_after_retries);
+    RUN_TEST(test_enqueue_checks);
+    RUN_TEST(test_next_uplink_carries_payload);
+    RUN_TEST(test_confirmed_downlink_resent_until_ack);
+    RUN_TEST(test_taken_until_transmitted);
+    RUN_TEST(test_dropped_response_keeps_payload);
+    return UNITY_END();
+}
@@ -0,0 +1,99 @@
+//
+//  Duty cycle budget per EU868 sub-band over a sliding hour.
+//
+
+#include <unity.h>
+#include "DutyCycle.h"
+
+#define RX1 868100000
+#define RX2 869525000
+
+static DutyCycle *duty;
+
+void setUp()
+{
+    duty = new DutyCycle();
+}
+
+void tearDown()
+{
+    delete duty;
+}
+
+void test_bands()
+{
+    TEST_ASSERT_EQUAL_UINT8(DUTY_BAND_G, DutyCycle::band(867100000));
+    TEST_ASSERT_EQUAL_UINT8(DUTY_BAND_G1, DutyCycle::band(RX1));
+    TEST_ASSERT_EQUAL_UINT8(DUTY_BAND_G2, DutyCycle::band(868800000));
+    TEST_ASSERT_EQUAL_UINT8(DUTY_BAND_G3, DutyCycle::band(RX2));
+    TEST_ASSERT_EQUAL_UINT8(DUTY_BAND_G4, DutyCycle::band(869850000));
+    TEST_ASSERT_EQUAL_UINT8(DUTY_BANDS, DutyCycle::band(868650000)); // Between g1 and g2
+    TEST_ASSERT_EQUAL_UINT8(DUTY_BANDS, DutyCycle::band(915000000));
+}
+
+void test_budgets()
+{
+    // 1% and 10% of an hour
+    TEST_ASSERT_EQUAL_UINT32(36000000, DutyCycle::budget(DUTY_BAND_G1));
+    TEST_ASSERT_EQUAL_UINT32(360000000, DutyCycle::budget(DUTY_BAND_G3));
+    TEST_ASSERT_EQUAL_UINT32(3600000, DutyCycle::budget(DUTY_BAND_G2));
+    TEST_ASSERT_EQUAL_UINT32(36000000, duty->remaining(DUTY_BAND_G1, 0));
+}
+
+void test_outside_bands_not_allowed()
+{
+    TEST_ASSERT_FALSE(duty->allowed(915000000, 1, 0));
+    TEST_ASSERT_EQUAL_UINT32(0, duty->remaining(DUTY_BANDS, 0));
+}
+
+void test_budget_used_up()
+{
+    // 36 s of airtime in g1, one more frame does not fit
+    for (int i = 0; i < 36; i++)
+    {
+        TEST_ASSERT_TRUE(duty->allowed(RX1, 1000000, i * 1000));
+        duty->add(RX1, 1000000, i * 1000);
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, duty->remaining(DUTY_BAND_G1, 40000));
+    TEST_ASSERT_FALSE(duty->allowed(RX1, 1, 40000));
+
+    // Other bands keep their own budget
+    TEST_ASSERT_TRUE(duty->allowed(RX2, 1000000, 40000));
+    TEST_ASSERT_TRUE(duty->allowed(867100000, 1000000, 40000));
+}
+
+void test_airtime_leaves_window()
+{
+    duty->add(RX1, 30000000, 1000);
+    duty->add(RX1, 5000000, 20 * 60000);
+
+    // Still within the hour
+    TEST_ASSERT_EQUAL_UINT32(1000000, duty->remaining(DUTY_BAND_G1, 60 * 60000));
+
+    // The first one leaves after an hour and at most a slot
+    TEST_ASSERT_EQUAL_UINT32(31000000, duty->remaining(DUTY_BAND_G1, 60 * 60000 + DUTY_SLOT_TIME));
+    TEST_ASSERT_EQUAL_UINT32(36000000, duty->remaining(DUTY_BAND_G1, 2 * 60 * 60000));
+}
+
+void test_millis_wrap_around()
+{
+    uint32_t now = UINT32_MAX - 1000;
+    duty->add(RX1, 10000000, now);
+    TEST_ASSERT_EQUAL_UINT32(26000000, duty->remaining(DUTY_BAND_G1, now));
+
+    // Still counted after the wrap, until the hour has passed
+    TEST_ASSERT_EQUAL_UINT32(26000000, duty->remaining(DUTY_BAND_G1, 1000));
+    TEST_ASSERT_EQUAL_UINT32(36000000, duty->remaining(DUTY_BAND_G1, now + DUTY_WINDOW + DUTY_SLOT_TIME));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_bands);
+    RUN_TEST(test_budgets);
+    RUN_TEST(test_outside_bands_not_allowed);
+    RUN_TEST(test_budget_used_up);
+    RUN_TEST(test_airtime_leaves_window);
+    RUN_TEST(test_millis_wrap_around);
+    return UNITY_END();
+}
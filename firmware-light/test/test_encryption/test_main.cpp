@@ -0,0 +1,123 @@
+//
+//  AES, CMAC and payload encryption against published test vectors.
+//
+
+#include <unity.h>
+#include "encryption.h"
+
+// RFC 4493, section 4
+static uint8_t cmacKey[16] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                              0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static uint8_t cmacMessage[64] = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                                  0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+                                  0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+                                  0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+
+static void checkCMAC(uint8_t len, const uint8_t *expected)
+{
+    AES_Context ctx;
+    uint8_t result[16];
+
+    AES_Setup(&ctx, cmacKey);
+    AES_CMAC(cmacMessage, len, result, &ctx);
+
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, result, 16);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_aes_fips197()
+{
+    uint8_t key[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+    uint8_t plain[16] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+    uint8_t cipher[16] = {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+    uint8_t block[16];
+    AES_Context ctx;
+
+    AES_Setup(&ctx, key);
+
+    memcpy(block, plain, 16);
+    AES_Encrypt(block, &ctx);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(cipher, block, 16);
+
+    AES_Decrypt(block, &ctx);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(plain, block, 16);
+}
+
+void test_cmac_subkeys()
+{
+    uint8_t k1[16] = {0xfb, 0xee, 0xd6, 0x18, 0x35, 0x71, 0x33, 0x66, 0x7c, 0x85, 0xe0, 0x8f, 0x72, 0x36, 0xa8, 0xde};
+    uint8_t k2[16] = {0xf7, 0xdd, 0xac, 0x30, 0x6a, 0xe2, 0x66, 0xcc, 0xf9, 0x0b, 0xc1, 0x1e, 0xe4, 0x6d, 0x51, 0x3b};
+    AES_Context ctx;
+
+    AES_Setup(&ctx, cmacKey);
+
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(k1, ctx.k1, 16);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(k2, ctx.k2, 16);
+}
+
+void test_cmac_empty()
+{
+    uint8_t expected[16] = {0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46};
+    checkCMAC(0, expected);
+}
+
+void test_cmac_16()
+{
+    uint8_t expected[16] = {0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c};
+    checkCMAC(16, expected);
+}
+
+void test_cmac_40()
+{
+    uint8_t expected[16] = {0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27};
+    checkCMAC(40, expected);
+}
+
+void test_cmac_64()
+{
+    uint8_t expected[16] = {0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe};
+    checkCMAC(64, expected);
+}
+
+void test_cmac_b0_equals_concatenation()
+{
+    AES_Context ctx;
+    uint8_t split[16];
+    uint8_t whole[16];
+
+    AES_Setup(&ctx, cmacKey);
+    AES_CMAC(cmacMessage, 40, whole, &ctx);
+    AES_CMAC_B0(&cmacMessage[0], &cmacMessage[16], 24, split, &ctx);
+
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(whole, split, 16);
+}
+
+void test_encode_packet_lorawan()
+{
+    // FRMPayload of the lora-packet example frame, FCnt 2, DevAddr 49BE7DF1
+    uint8_t appSKey[16] = {0xec, 0x92, 0x58, 0x02, 0xae, 0x43, 0x0c, 0xa7, 0x7f, 0xd3, 0xdd, 0x73, 0xcb, 0x2c, 0xc5, 0x88};
+    uint8_t devAddr[4] = {0x49, 0xBE, 0x7D, 0xF1};
+    uint8_t payload[4] = {0x95, 0x43, 0x78, 0x76};
+    AES_Context ctx;
+
+    AES_Setup(&ctx, appSKey);
+    encodePacket(payload, 4, 2, devAddr, &ctx, 0);
+
+    TEST_ASSERT_EQUAL_HEX8_ARRAY("test", payload, 4);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_aes_fips197);
+    RUN_TEST(test_cmac_subkeys);
+    RUN_TEST(test_cmac_empty);
+    RUN_TEST(test_cmac_16);
+    RUN_TEST(test_cmac_40);
+    RUN_TEST(test_cmac_64);
+    RUN_TEST(test_cmac_b0_equals_concatenation);
+    RUN_TEST(test_encode_packet_lorawan);
+    return UNITY_END();
+}
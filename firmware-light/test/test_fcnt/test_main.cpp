@@ -0,0 +1,132 @@
+//
+//  Frame counter resolution: candidate order, the window, and the MICs
+//  spent per frame.
+//
+
+#include <unity.h>
+#include "session.h"
+
+static FCntResolver *resolver;
+
+void setUp()
+{
+    resolver = new FCntResolver();
+    startSession();
+}
+
+void tearDown()
+{
+    delete resolver;
+    endSession();
+}
+
+static LoRaWanResult send(uint32_t fCnt)
+{
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x40, fCnt, 1, (const uint8_t *)"x", 1);
+    return loRaWAN->parseMessage(frame, len, -60);
+}
+
+void test_next_counter_first()
+{
+    uint32_t candidates[FCNT_MAX_CANDIDATES];
+    bool old;
+    TEST_ASSERT_EQUAL_UINT8(1, resolver->resolve(0x00012345, false, 0x2346, candidates, &old));
+    TEST_ASSERT_EQUAL_UINT32(0x00012346, candidates[0]);
+
+    // Past the lower 16 bits
+    TEST_ASSERT_EQUAL_UINT8(1, resolver->resolve(0x0001FFF0, false, 0x0005, candidates, &old));
+    TEST_ASSERT_EQUAL_UINT32(0x00020005, candidates[0]);
+}
+
+void test_reset_tried_last()
+{
+    uint32_t candidates[FCNT_MAX_CANDIDATES];
+    bool old;
+    TEST_ASSERT_EQUAL_UINT8(2, resolver->resolve(0x0000FFF0, true, 0, candidates, &old));
+    TEST_ASSERT_EQUAL_UINT32(0x00010000, candidates[0]);
+    TEST_ASSERT_EQUAL_UINT32(0, candidates[1]);
+
+    // Far from the last counter only a reset is possible
+    TEST_ASSERT_EQUAL_UINT8(1, resolver->resolve(5000, true, 0, candidates, &old));
+    TEST_ASSERT_EQUAL_UINT32(0, candidates[0]);
+}
+
+void test_outside_window()
+{
+    uint32_t candidates[FCNT_MAX_CANDIDATES];
+    bool old;
+    TEST_ASSERT_EQUAL_UINT8(0, resolver->resolve(100, false, 50, candidates, &old));
+    TEST_ASSERT_TRUE(old);
+    TEST_ASSERT_EQUAL_UINT8(0, resolver->resolve(100, false, 100 + FCNT_MAX_GAP + 1, candidates, &old));
+    TEST_ASSERT_FALSE(old);
+    TEST_ASSERT_EQUAL_UINT32(1, resolver->behind);
+    TEST_ASSERT_EQUAL_UINT32(1, resolver->ahead);
+
+    resolver->maxGap = 10;
+    TEST_ASSERT_EQUAL_UINT8(1, resolver->resolve(100, false, 110, candidates, &old));
+    TEST_ASSERT_EQUAL_UINT8(0, resolver->resolve(100, false, 111, candidates, &old));
+}
+
+void test_first_frame_any_counter()
+{
+    uint32_t candidates[FCNT_MAX_CANDIDATES];
+    bool old;
+    TEST_ASSERT_EQUAL_UINT8(1, resolver->resolve(0, true, 50000, candidates, &old));
+    TEST_ASSERT_EQUAL_UINT32(50000, candidates[0]);
+}
+
+void test_one_mic_per_frame()
+{
+    device->allowFCntReset = false;
+    for (uint32_t fCnt = 1; fCnt <= 10; fCnt++)
+    {
+        TEST_ASSERT_EQUAL(LORAWAN_ACCEPTED, send(fCnt));
+    }
+    TEST_ASSERT_EQUAL_UINT32(10, loRaWAN->fCntResolver.accepted);
+    TEST_ASSERT_EQUAL_UINT32(10, loRaWAN->fCntResolver.cmacs);
+}
+
+void test_junk_rejected_without_mic()
+{
+    device->fCntUp = 1000;
+    device->allowFCntReset = false;
+
+    TEST_ASSERT_EQUAL(LORAWAN_OLD_FCNT, send(10));
+    TEST_ASSERT_EQUAL(LORAWAN_FCNT_GAP, send(1000 + FCNT_MAX_GAP + 1));
+    TEST_ASSERT_EQUAL_UINT32(0, loRaWAN->fCntResolver.cmacs);
+
+    // In the window it costs one MIC
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x40, 1001, 1, (const uint8_t *)"x", 1);
+    frame[len - 1] ^= 0x01;
+    TEST_ASSERT_EQUAL(LORAWAN_INVALID_MIC, loRaWAN->parseMessage(frame, len, -60));
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->fCntResolver.cmacs);
+    TEST_ASSERT_EQUAL_UINT32(1000, device->fCntUp);
+}
+
+void test_reset_accepted_once()
+{
+    device->fCntUp = 5000;
+    TEST_ASSERT_EQUAL(LORAWAN_ACCEPTED, send(0));
+    TEST_ASSERT_EQUAL_UINT32(0, device->fCntUp);
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->fCntResolver.cmacs);
+
+    // The same frame again, past the duplicate check
+    loRaWAN->dedup.expiry = 0;
+    device->fCntUp = 5000;
+    TEST_ASSERT_EQUAL(LORAWAN_OLD_FCNT, send(0));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_next_counter_first);
+    RUN_TEST(test_reset_tried_last);
+    RUN_TEST(test_outside_window);
+    RUN_TEST(test_first_frame_any_counter);
+    RUN_TEST(test_one_mic_per_frame);
+    RUN_TEST(test_junk_rejected_without_mic);
+    RUN_TEST(test_reset_accepted_once);
+    return UNITY_END();
+}
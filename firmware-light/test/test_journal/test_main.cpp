@@ -0,0 +1,104 @@
+//
+//  Counter journal: counters kept over a restart, compaction, and the
+//  backoff after a failing write, on the in-memory LittleFS stand-in.
+//
+
+#include <unity.h>
+#include "CounterJournal.h"
+
+#define PATH "/fcnt.jnl"
+#define SIZE 4096
+
+static CounterJournal *journal;
+static uint8_t devAddr[4] = {0x49, 0xBE, 0x7D, 0xF1};
+
+void setUp()
+{
+    LittleFS.reset();
+    journal = new CounterJournal();
+    TEST_ASSERT_TRUE(journal->begin(PATH, SIZE));
+}
+
+void tearDown()
+{
+    delete journal;
+}
+
+// The counters a journal started on the same file finds for devAddr.
+static void assertSaved(uint32_t fCntUp, uint32_t fCntDown)
+{
+    CounterJournal restarted;
+    TEST_ASSERT_TRUE(restarted.begin(PATH, SIZE));
+    uint32_t up = 0;
+    uint32_t down = 0;
+    TEST_ASSERT_TRUE(restarted.load(devAddr, &up, &down));
+    TEST_ASSERT_EQUAL_UINT32(fCntUp, up);
+    TEST_ASSERT_EQUAL_UINT32(fCntDown, down);
+}
+
+void test_counters_survive_restart()
+{
+    journal->append(devAddr, 10, 20);
+    TEST_ASSERT_TRUE(journal->dirty());
+    TEST_ASSERT_TRUE(journal->sync());
+    TEST_ASSERT_FALSE(journal->dirty());
+    journal->append(devAddr, 11, 20);
+    journal->sync();
+
+    assertSaved(11, 20);
+    TEST_ASSERT_EQUAL_UINT32(2, journal->writes);
+}
+
+void test_compacted_when_full()
+{
+    for (uint32_t fCnt = 1; fCnt <= SIZE / sizeof(struct_journal_record) + 1; fCnt++)
+    {
+        journal->append(devAddr, fCnt, 0);
+        TEST_ASSERT_TRUE(journal->sync());
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(1, journal->compactions);
+    assertSaved(SIZE / sizeof(struct_journal_record) + 1, 0);
+}
+
+void test_failed_sync_backs_off()
+{
+    journal->append(devAddr, 10, 20);
+    LittleFS.failWrites = true;
+
+    TEST_ASSERT_FALSE(journal->sync());
+    uint32_t writeCalls = LittleFS.writeCalls;
+    TEST_ASSERT_EQUAL_UINT32(1, writeCalls);
+
+    // From the idle loop, nothing is written until the counters change
+    for (int i = 0; i < 100; i++)
+    {
+        journal->sync();
+    }
+    TEST_ASSERT_EQUAL_UINT32(writeCalls, LittleFS.writeCalls);
+    TEST_ASSERT_EQUAL_UINT32(1, journal->failures);
+    TEST_ASSERT_EQUAL_UINT32(1, journal->syncs);
+    TEST_ASSERT_TRUE(journal->dirty());
+
+    // A change is tried once, as a fresh file behind the failed write
+    journal->append(devAddr, 11, 20);
+    TEST_ASSERT_FALSE(journal->sync());
+    journal->sync();
+    TEST_ASSERT_EQUAL_UINT32(2, journal->failures);
+    TEST_ASSERT_EQUAL_UINT32(2, journal->syncs);
+
+    LittleFS.failWrites = false;
+    journal->append(devAddr, 12, 20);
+    TEST_ASSERT_TRUE(journal->sync());
+    TEST_ASSERT_FALSE(journal->dirty());
+    assertSaved(12, 20);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_counters_survive_restart);
+    RUN_TEST(test_compacted_when_full);
+    RUN_TEST(test_failed_sync_backs_off);
+    return UNITY_END();
+}
@@ -0,0 +1,76 @@
+//
+//  Host benchmark of the light engine. Reports the cost of a frame where
+//  nothing changes and of a frame that redraws the strip.
+//
+
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+#include "LightEngine.h"
+
+#define BENCH_LEDS 44
+#define BENCH_FRAMES 1000000
+
+static const LightKeyframe blinkKeyframes[] = {{0, 255}, {1000, 0}, {2000, 255}, {3000, 0}, {4000, 255}};
+static const LightPattern blink = {blinkKeyframes, 5, 5000, true};
+static const LightKeyframe fastKeyframes[] = {{0, 255}, {LIGHT_FRAME_INTERVAL, 0}};
+static const LightPattern fast = {fastKeyframes, 2, 2 * LIGHT_FRAME_INTERVAL, true};
+
+static CRGB leds[BENCH_LEDS];
+
+static void report(const char *name, uint32_t count, std::chrono::steady_clock::time_point start)
+{
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-14s %10.0f frames/s %8.0f ns/frame\n", name, count * 1e9 / ns, ns / count);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_bench_idle_frame()
+{
+    static LightEngine lights;
+    lights.begin(leds, BENCH_LEDS);
+    lights.play(0, &blink, 0x50FF00, 0, BENCH_LEDS, 0);
+    lights.play(1, &blink, 0xFF0000, BENCH_LEDS - 3, 3, 0);
+
+    // Stays within the first keyframe, so no frame redraws
+    lights.render(0);
+    uint32_t now = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+    {
+        now = (now + LIGHT_FRAME_INTERVAL) % 1000;
+        lights.render(now);
+    }
+    report("idle frame", BENCH_FRAMES, start);
+
+    TEST_ASSERT_EQUAL_UINT32(1, lights.pushes);
+}
+
+void test_bench_redraw_frame()
+{
+    static LightEngine lights;
+    lights.begin(leds, BENCH_LEDS);
+    lights.play(0, &fast, 0x50FF00, 0, BENCH_LEDS, 0);
+    lights.play(1, &fast, 0xFF0000, BENCH_LEDS - 3, 3, 0);
+
+    uint32_t now = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+    {
+        lights.render(now);
+        now += LIGHT_FRAME_INTERVAL;
+    }
+    report("redraw frame", BENCH_FRAMES, start);
+
+    TEST_ASSERT_EQUAL_UINT32(BENCH_FRAMES, lights.pushes);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_bench_idle_frame);
+    RUN_TEST(test_bench_redraw_frame);
+    return UNITY_END();
+}
@@ -0,0 +1,136 @@
+//
+//  Light engine keyframes, layering and dirty tracking.
+//
+
+#include <unity.h>
+#include "LightEngine.h"
+
+#define LEDS 10
+
+static const LightKeyframe blinkKeyframes[] = {{0, 255}, {1000, 0}, {2000, 255}};
+static const LightPattern blink = {blinkKeyframes, 3, 3000, false};
+static const LightPattern blinkForever = {blinkKeyframes, 3, 3000, true};
+static const LightKeyframe halfKeyframes[] = {{0, 127}};
+static const LightPattern half = {halfKeyframes, 1, 1000, true};
+
+static CRGB leds[LEDS];
+static LightEngine *lights;
+
+void setUp()
+{
+    lights = new LightEngine();
+    lights->begin(leds, LEDS);
+    for (int i = 0; i < LEDS; i++)
+    {
+        leds[i] = CRGB(1, 2, 3);
+    }
+}
+
+void tearDown()
+{
+    delete lights;
+}
+
+void test_blink_keyframes()
+{
+    lights->play(0, &blink, 0x00FF00, 0, LEDS, 100);
+
+    TEST_ASSERT_TRUE(lights->render(100));
+    TEST_ASSERT_TRUE(leds[0] == CRGB(0, 255, 0));
+    TEST_ASSERT_TRUE(leds[9] == CRGB(0, 255, 0));
+
+    TEST_ASSERT_TRUE(lights->render(1100));
+    TEST_ASSERT_TRUE(leds[0] == CRGB(0, 0, 0));
+
+    TEST_ASSERT_TRUE(lights->render(2100));
+    TEST_ASSERT_TRUE(leds[0] == CRGB(0, 255, 0));
+
+    // Ends after 3 s
+    TEST_ASSERT_TRUE(lights->render(3100));
+    TEST_ASSERT_FALSE(lights->playing(0));
+    TEST_ASSERT_TRUE(leds[0] == CRGB(0, 0, 0));
+}
+
+void test_repeat()
+{
+    lights->play(0, &blinkForever, 0xFF0000, 0, LEDS, 0);
+
+    lights->render(3000);
+    TEST_ASSERT_TRUE(lights->playing(0));
+    TEST_ASSERT_TRUE(leds[0] == CRGB(255, 0, 0));
+    lights->render(4000);
+    TEST_ASSERT_TRUE(leds[0] == CRGB(0, 0, 0));
+}
+
+void test_only_pushes_on_change()
+{
+    lights->play(0, &blink, 0x00FF00, 0, LEDS, 0);
+    TEST_ASSERT_TRUE(lights->render(0));
+
+    for (uint32_t now = 20; now < 1000; now += 20)
+    {
+        TEST_ASSERT_FALSE(lights->render(now));
+    }
+    TEST_ASSERT_TRUE(lights->render(1000));
+    TEST_ASSERT_EQUAL_UINT32(2, lights->pushes);
+}
+
+void test_frame_interval()
+{
+    lights->play(0, &blink, 0x00FF00, 0, LEDS, 0);
+    TEST_ASSERT_TRUE(lights->render(0));
+
+    // The off keyframe is only seen at the next frame
+    TEST_ASSERT_TRUE(lights->render(1000));
+    lights->play(0, &blink, 0x00FF00, 0, LEDS, 1005);
+    TEST_ASSERT_TRUE(lights->render(1005));
+    TEST_ASSERT_FALSE(lights->render(1010));
+    TEST_ASSERT_EQUAL_UINT32(3, lights->frames);
+}
+
+void test_overlay_and_transparency()
+{
+    lights->play(0, &blink, 0x00FF00, 0, LEDS, 0);
+    lights->play(1, &blink, 0xFF0000, 7, 3, 0);
+    lights->play(2, &half, 0x0000FE, 0, 2, 0);
+
+    lights->render(0);
+    TEST_ASSERT_TRUE(leds[0] == CRGB(0, 0, 127));
+    TEST_ASSERT_TRUE(leds[2] == CRGB(0, 255, 0));
+    TEST_ASSERT_TRUE(leds[6] == CRGB(0, 255, 0));
+    TEST_ASSERT_TRUE(leds[7] == CRGB(255, 0, 0));
+    TEST_ASSERT_TRUE(leds[9] == CRGB(255, 0, 0));
+
+    // Level 0 shows the layers below
+    lights->render(1000);
+    TEST_ASSERT_TRUE(leds[0] == CRGB(0, 0, 127));
+    TEST_ASSERT_TRUE(leds[9] == CRGB(0, 0, 0));
+}
+
+void test_stop_and_clipping()
+{
+    lights->play(0, &blinkForever, 0xFFFFFF, 8, 5, 0);
+    lights->render(0);
+    TEST_ASSERT_TRUE(leds[7] == CRGB(0, 0, 0));
+    TEST_ASSERT_TRUE(leds[9] == CRGB(255, 255, 255));
+
+    lights->stop(0);
+    TEST_ASSERT_TRUE(lights->render(20));
+    TEST_ASSERT_TRUE(leds[9] == CRGB(0, 0, 0));
+
+    // Out of range layers are ignored
+    lights->play(LIGHT_LAYERS, &blink, 0xFFFFFF, 0, LEDS, 0);
+    TEST_ASSERT_FALSE(lights->playing(LIGHT_LAYERS));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_blink_keyframes);
+    RUN_TEST(test_repeat);
+    RUN_TEST(test_only_pushes_on_change);
+    RUN_TEST(test_frame_interval);
+    RUN_TEST(test_overlay_and_transparency);
+    RUN_TEST(test_stop_and_clipping);
+    return UNITY_END();
+}
@@ -0,0 +1,137 @@
+//
+//  Buffered log: formatting on read, hex dumps, overflow and level elision.
+//
+
+#include <unity.h>
+#include <string.h>
+#include "Logger.h"
+
+static Logger *l;
+
+void setUp()
+{
+    l = new Logger();
+}
+
+void tearDown()
+{
+    delete l;
+}
+
+// Read everything that is pending, with a small buffer to split lines.
+static size_t readAll(Logger *from, char *out, size_t size)
+{
+    size_t total = 0;
+    size_t n;
+    while (total < size - 1 && (n = from->read(out + total, (size - 1 - total) < 7 ? (size - 1 - total) : 7)) > 0)
+    {
+        total += n;
+    }
+    out[total] = 0;
+    return total;
+}
+
+void test_empty()
+{
+    char out[16];
+    TEST_ASSERT_FALSE(l->pending());
+    TEST_ASSERT_EQUAL_UINT32(0, l->read(out, sizeof(out)));
+}
+
+void test_text_line()
+{
+    char out[128];
+    l->write(LOG_LEVEL_INFO, LOG_DOOR, "Door %d opened", 2);
+    TEST_ASSERT_TRUE(l->pending());
+    readAll(l, out, sizeof(out));
+
+    TEST_ASSERT_NOT_NULL(strstr(out, " I door: Door 2 opened\r\n"));
+    TEST_ASSERT_FALSE(l->pending());
+}
+
+void test_dump_is_hex()
+{
+    char out[128];
+    const uint8_t data[] = {0x40, 0x01, 0xAB, 0x0F};
+    l->dump(LOG_LEVEL_DEBUG, LOG_RADIO, "Receive msg", data, sizeof(data));
+    readAll(l, out, sizeof(out));
+
+    TEST_ASSERT_NOT_NULL(strstr(out, " D radio: Receive msg: 4001AB0F\r\n"));
+}
+
+void test_order_kept()
+{
+    char out[256];
+    l->write(LOG_LEVEL_WARN, LOG_LINK, "first");
+    l->write(LOG_LEVEL_ERROR, LOG_STORAGE, "second");
+    readAll(l, out, sizeof(out));
+
+    char *first = strstr(out, "W link: first");
+    char *second = strstr(out, "E storage: second");
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_NOT_NULL(second);
+    TEST_ASSERT_TRUE(first < second);
+}
+
+void test_overflow_reported()
+{
+    static char out[LOG_BUFFER_SIZE * 3];
+    uint8_t data[LOG_MAX_DUMP] = {};
+    for (int i = 0; i < 100; i++)
+    {
+        l->dump(LOG_LEVEL_DEBUG, LOG_RADIO, "Frame", data, sizeof(data));
+    }
+    TEST_ASSERT_TRUE(l->dropped > 0);
+
+    // The last line tells how many were lost
+    size_t n = readAll(l, out, sizeof(out));
+    char expected[32];
+    snprintf(expected, sizeof(expected), "%lu messages dropped\r\n", (unsigned long)l->dropped);
+    TEST_ASSERT_EQUAL_STRING(expected, out + n - strlen(expected));
+    TEST_ASSERT_FALSE(l->pending());
+
+    // Room again after draining
+    l->write(LOG_LEVEL_INFO, LOG_SYSTEM, "again");
+    readAll(l, out, sizeof(out));
+    TEST_ASSERT_NOT_NULL(strstr(out, "I system: again"));
+}
+
+void test_long_message_cut()
+{
+    char out[256];
+    char text[200];
+    memset(text, 'x', sizeof(text) - 1);
+    text[sizeof(text) - 1] = 0;
+    l->write(LOG_LEVEL_INFO, LOG_SYSTEM, "%s", text);
+    size_t n = readAll(l, out, sizeof(out));
+
+    TEST_ASSERT_TRUE(n < LOG_MAX_LINE);
+    TEST_ASSERT_EQUAL_STRING("\r\n", out + n - 2);
+}
+
+void test_debug_compiled_out()
+{
+    // The tests build with the default LOG_LEVEL, INFO
+    LOG_DEBUG(LOG_RADIO, "not logged %d", 1);
+    LOG_DUMP(LOG_RADIO, "not logged", (const uint8_t *)"ab", 2);
+    TEST_ASSERT_FALSE(logger.pending());
+
+    LOG_INFO(LOG_RADIO, "logged");
+    TEST_ASSERT_TRUE(logger.pending());
+    char out[64];
+    readAll(&logger, out, sizeof(out));
+    TEST_ASSERT_FALSE(logger.pending());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_empty);
+    RUN_TEST(test_text_line);
+    RUN_TEST(test_dump_is_hex);
+    RUN_TEST(test_order_kept);
+    RUN_TEST(test_overflow_reported);
+    RUN_TEST(test_long_message_cut);
+    RUN_TEST(test_debug_compiled_out);
+    return UNITY_END();
+}
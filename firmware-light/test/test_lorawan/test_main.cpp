@@ -0,0 +1,272 @@
+//
+//  LoRaWanP2P frame parsing, MIC checks and responses.
+//
+
+#include <unity.h>
+#include "frames.h"
+
+static LoRaWanP2P *loRaWAN;
+static LoRaWanDevice *device;
+
+static int messages;
+static uint8_t lastPort;
+static uint8_t lastMessage[64];
+static uint8_t lastLength;
+
+static int saves;
+static int messagesBeforeSave;
+
+static int responses;
+static uint8_t response[64];
+static uint8_t responseLength;
+static int messagesBeforeResponse;
+
+static void onMessage(LoRaWanDevice *device, uint8_t port, uint8_t *msg, uint8_t length)
+{
+    messages++;
+    lastPort = port;
+    lastLength = length;
+    memcpy(lastMessage, msg, length);
+}
+
+static void onSave(LoRaWanDevice *device)
+{
+    saves++;
+    messagesBeforeSave = messages;
+}
+
+static void onResponse(uint8_t *buffer, uint8_t length, uint32_t rxDelay)
+{
+    responses++;
+    messagesBeforeResponse = messages;
+    responseLength = length;
+    memcpy(response, buffer, length);
+}
+
+void setUp()
+{
+    loRaWAN = new LoRaWanP2P();
+    loRaWAN->OTAAEnabled = false;
+    loRaWAN->onMessage(onMessage);
+    loRaWAN->onResponse(onResponse);
+    loRaWAN->onSave(onSave);
+    device = loRaWAN->addDevice(exampleDevAddr, exampleNwkSKey, exampleAppSKey, 3);
+
+    messages = 0;
+    saves = 0;
+    responses = 0;
+}
+
+void tearDown()
+{
+    delete loRaWAN;
+}
+
+void test_example_frame()
+{
+    uint8_t frame[sizeof(exampleFrame)];
+    memcpy(frame, exampleFrame, sizeof(frame));
+
+    loRaWAN->parseMessage(frame, sizeof(frame), -60);
+
+    TEST_ASSERT_EQUAL_INT(1, messages);
+    TEST_ASSERT_EQUAL_UINT8(1, lastPort);
+    TEST_ASSERT_EQUAL_UINT8(4, lastLength);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY("test", lastMessage, 4);
+    TEST_ASSERT_EQUAL_UINT32(2, device->fCntUp);
+    TEST_ASSERT_EQUAL_INT(0, responses);
+}
+
+void test_invalid_mic_rejected()
+{
+    uint8_t frame[sizeof(exampleFrame)];
+    memcpy(frame, exampleFrame, sizeof(frame));
+    frame[sizeof(frame) - 1] ^= 0x01;
+
+    loRaWAN->parseMessage(frame, sizeof(frame), -60);
+
+    TEST_ASSERT_EQUAL_INT(0, messages);
+    TEST_ASSERT_EQUAL_UINT32(0, device->fCntUp);
+}
+
+void test_unknown_device_rejected()
+{
+    uint8_t other[4] = {0x26, 0x01, 0x02, 0x03};
+    uint8_t payload[10] = {0};
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x40, 1, 10, payload, 10, NULL, 0, other);
+
+    loRaWAN->parseMessage(frame, len, -60);
+
+    TEST_ASSERT_EQUAL_INT(0, messages);
+}
+
+void test_replay_not_forwarded()
+{
+    uint8_t payload[10] = {0x0b, 0xb8};
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x40, 7, 10, payload, 10);
+    uint8_t copy[64];
+    memcpy(copy, frame, len);
+
+    // Past the duplicate cache, as a copy that arrives later
+    loRaWAN->dedup.expiry = 0;
+    loRaWAN->parseMessage(frame, len, -60);
+    TEST_ASSERT_EQUAL(LORAWAN_REPLAY, loRaWAN->parseMessage(copy, len, -60));
+
+    TEST_ASSERT_EQUAL_INT(1, messages);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(payload, lastMessage, 10);
+}
+
+void test_old_frame_rejected()
+{
+    uint8_t payload[10] = {0};
+    uint8_t frame[64];
+    device->fCntUp = 100;
+    device->allowFCntReset = false;
+
+    uint8_t len = buildUplink(frame, 0x40, 50, 10, payload, 10);
+    loRaWAN->parseMessage(frame, len, -60);
+
+    TEST_ASSERT_EQUAL_INT(0, messages);
+    TEST_ASSERT_EQUAL_UINT32(100, device->fCntUp);
+}
+
+void test_fcnt_rollover_upper_bits()
+{
+    uint8_t payload[10] = {0};
+    uint8_t frame[64];
+    device->fCntUp = 0x0001FFF0;
+    device->allowFCntReset = false;
+
+    uint8_t len = buildUplink(frame, 0x40, 0x00020005, 10, payload, 10);
+    loRaWAN->parseMessage(frame, len, -60);
+
+    TEST_ASSERT_EQUAL_INT(1, messages);
+    TEST_ASSERT_EQUAL_UINT32(0x00020005, device->fCntUp);
+}
+
+void test_confirmed_uplink_is_acked()
+{
+    uint8_t payload[10] = {0};
+    uint8_t frame[64];
+    device->fCntDown = 10;
+
+    uint8_t len = buildUplink(frame, 0x80, 3, 10, payload, 10);
+    loRaWAN->parseMessage(frame, len, -60);
+
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_HEX8(0x60, response[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x20, response[5] & 0x20); // ACK bit
+    TEST_ASSERT_EQUAL_UINT32(11, device->fCntDown);
+
+    // The message is shown before the response, which may wait for flash
+    TEST_ASSERT_EQUAL_INT(1, messagesBeforeResponse);
+
+    LoRaWanPHYPayloadView view;
+    AES_Context nwkSKey;
+    AES_Setup(&nwkSKey, exampleNwkSKey);
+    TEST_ASSERT_TRUE(view.populate(response, responseLength));
+    TEST_ASSERT_TRUE(view.validateMIC(&nwkSKey, 11));
+}
+
+void test_save_deferred_until_flush()
+{
+    uint8_t frame[sizeof(exampleFrame)];
+    memcpy(frame, exampleFrame, sizeof(frame));
+
+    loRaWAN->parseMessage(frame, sizeof(frame), -60);
+    TEST_ASSERT_EQUAL_INT(0, saves);
+    TEST_ASSERT_TRUE(device->dirty);
+
+    // The message was handled before anything was saved
+    TEST_ASSERT_TRUE(loRaWAN->flush());
+    TEST_ASSERT_EQUAL_INT(1, saves);
+    TEST_ASSERT_EQUAL_INT(1, messagesBeforeSave);
+    TEST_ASSERT_FALSE(loRaWAN->flush());
+    TEST_ASSERT_EQUAL_INT(1, saves);
+
+    // A replay changes nothing to save
+    memcpy(frame, exampleFrame, sizeof(frame));
+    loRaWAN->parseMessage(frame, sizeof(frame), -60);
+    TEST_ASSERT_FALSE(loRaWAN->flush());
+}
+
+void test_link_check_answer()
+{
+    uint8_t fOpts[1] = {0x02};
+    uint8_t frame[64];
+
+    uint8_t len = buildUplink(frame, 0x40, 4, 0, NULL, 0, fOpts, 1);
+    loRaWAN->parseMessage(frame, len, -100);
+
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_UINT8(3, response[5] & 0x0f);
+    TEST_ASSERT_EQUAL_HEX8(0x02, response[8]);
+    TEST_ASSERT_EQUAL_UINT8(20, response[9]); // margin, rssi + 120
+    TEST_ASSERT_EQUAL_UINT8(1, response[10]);
+}
+
+void test_keystream_cache_hit()
+{
+    uint8_t payload[10] = {0x0b, 0xb8, 0x01};
+    uint8_t frame[64];
+
+    // First frame expands the session, idle time then computes ahead
+    uint8_t len = buildUplink(frame, 0x40, 1, 10, payload, 10);
+    loRaWAN->parseMessage(frame, len, -60);
+    for (int i = 0; i < KEYSTREAM_LOOKAHEAD; i++)
+    {
+        loRaWAN->precompute();
+    }
+
+    len = buildUplink(frame, 0x40, 2, 10, payload, 10);
+    loRaWAN->parseMessage(frame, len, -60);
+
+    TEST_ASSERT_EQUAL_INT(2, messages);
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->keystreamCache.hits);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(payload, lastMessage, 10);
+}
+
+void test_device_table_lookup()
+{
+    DeviceTable table;
+    uint8_t key[16] = {0};
+
+    for (int i = DEVICE_TABLE_SIZE - 1; i >= 0; i--)
+    {
+        uint8_t devAddr[4] = {0x26, 0x0b, (uint8_t)(i * 7), (uint8_t)i};
+        TEST_ASSERT_NOT_NULL(table.add(devAddr, key, key, i));
+    }
+
+    uint8_t extra[4] = {0x01, 0x02, 0x03, 0x04};
+    TEST_ASSERT_NULL(table.add(extra, key, key, 0));
+    TEST_ASSERT_EQUAL_UINT(DEVICE_TABLE_SIZE, table.count());
+
+    for (int i = 0; i < DEVICE_TABLE_SIZE; i++)
+    {
+        uint8_t devAddr[4] = {0x26, 0x0b, (uint8_t)(i * 7), (uint8_t)i};
+        LoRaWanDevice *found = table.find(devAddr);
+        TEST_ASSERT_NOT_NULL(found);
+        TEST_ASSERT_EQUAL_UINT8(i, found->id);
+    }
+
+    TEST_ASSERT_NULL(table.find(extra));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_example_frame);
+    RUN_TEST(test_invalid_mic_rejected);
+    RUN_TEST(test_unknown_device_rejected);
+    RUN_TEST(test_replay_not_forwarded);
+    RUN_TEST(test_old_frame_rejected);
+    RUN_TEST(test_fcnt_rollover_upper_bits);
+    RUN_TEST(test_confirmed_uplink_is_acked);
+    RUN_TEST(test_save_deferred_until_flush);
+    RUN_TEST(test_link_check_answer);
+    RUN_TEST(test_keystream_cache_hit);
+    RUN_TEST(test_device_table_lookup);
+    return UNITY_END();
+}
@@ -0,0 +1,177 @@
+//
+//  MAC commands: decoding every command of FOpts and port 0, pending answers
+//  per device and combined answers in one downlink.
+//
+
+#include <unity.h>
+#include "session.h"
+
+void setUp()
+{
+    startSession();
+}
+
+void tearDown()
+{
+    endSession();
+}
+
+// Send fOpts in an uplink with fCnt, at rssi -100, a link margin of 20.
+static LoRaWanResult send(uint32_t fCnt, const uint8_t *fOpts, uint8_t fOptsLength, uint8_t mhdr = 0x40)
+{
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, mhdr, fCnt, 1, (const uint8_t *)"x", 1, fOpts, fOptsLength);
+    return loRaWAN->parseMessage(frame, len, -100);
+}
+
+void test_table_lengths()
+{
+    TEST_ASSERT_NULL(MacCommands::type(0x01));
+    TEST_ASSERT_NULL(MacCommands::type(0x0B));
+    TEST_ASSERT_NULL(MacCommands::type(0x80)); // Proprietary
+    TEST_ASSERT_EQUAL_UINT8(1, MacCommands::type(MAC_LINK_ADR)->upLength);
+    TEST_ASSERT_EQUAL_UINT8(4, MacCommands::type(MAC_LINK_ADR)->downLength);
+    TEST_ASSERT_EQUAL_UINT8(2, MacCommands::type(MAC_DEV_STATUS)->upLength);
+    TEST_ASSERT_EQUAL_UINT8(5, MacCommands::type(MAC_NEW_CHANNEL)->downLength);
+}
+
+void test_commands_after_link_check()
+{
+    // Pending LinkADRReq, answered behind a LinkCheckReq
+    device->adr.requestSF = 7;
+    device->adr.requestPower = 2;
+    device->adr.retries = 1;
+
+    const uint8_t fOpts[] = {MAC_LINK_CHECK, MAC_LINK_ADR, 0x07, MAC_DEV_STATUS, 200, 0x3e};
+    TEST_ASSERT_EQUAL(LORAWAN_ACCEPTED, send(1, fOpts, sizeof(fOpts)));
+
+    TEST_ASSERT_EQUAL_UINT32(3, loRaWAN->mac.commands);
+    TEST_ASSERT_EQUAL_UINT32(0, loRaWAN->mac.unknown);
+    TEST_ASSERT_FALSE(AdrEngine::pending(&device->adr));
+    TEST_ASSERT_EQUAL_UINT8(2, device->adr.power);
+    TEST_ASSERT_EQUAL_UINT8(200, device->mac.battery);
+    TEST_ASSERT_EQUAL_INT8(-2, device->mac.statusMargin);
+
+    // Only the LinkCheckAns is owed
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_UINT8(3, response[5] & 0x0f);
+    const uint8_t expected[] = {MAC_LINK_CHECK, 20, 1};
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, &response[8], sizeof(expected));
+}
+
+void test_unknown_command_stops()
+{
+    const uint8_t fOpts[] = {MAC_DUTY_CYCLE, 0x80, MAC_LINK_CHECK};
+    send(1, fOpts, sizeof(fOpts));
+
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->mac.commands);
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->mac.unknown);
+    TEST_ASSERT_EQUAL_INT(0, responses);
+}
+
+void test_cut_off_command_stops()
+{
+    const uint8_t fOpts[] = {MAC_LINK_CHECK, MAC_DEV_STATUS, 100};
+    send(1, fOpts, sizeof(fOpts));
+
+    TEST_ASSERT_EQUAL_UINT32(1, loRaWAN->mac.unknown);
+    TEST_ASSERT_EQUAL_UINT8(MAC_BATTERY_UNKNOWN, device->mac.battery);
+    TEST_ASSERT_EQUAL_INT(1, responses); // The LinkCheckReq before it is answered
+}
+
+void test_sticky_answer_gets_downlink()
+{
+    const uint8_t fOpts[] = {MAC_RX_TIMING_SETUP};
+    send(1, fOpts, sizeof(fOpts));
+
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_UINT8(0, response[5] & 0x0f);
+    TEST_ASSERT_FALSE(loRaWAN->mac.due(device));
+
+    // Not again without a new answer
+    send(2, NULL, 0);
+    TEST_ASSERT_EQUAL_INT(1, responses);
+}
+
+void test_port_zero_commands()
+{
+    const uint8_t commands[] = {MAC_DEV_STATUS, 0, 10, MAC_LINK_CHECK};
+    uint8_t frame[64];
+    uint8_t len = buildUplink(frame, 0x40, 1, 0, commands, sizeof(commands));
+    TEST_ASSERT_EQUAL(LORAWAN_ACCEPTED, loRaWAN->parseMessage(frame, len, -100));
+
+    TEST_ASSERT_EQUAL_UINT8(0, device->mac.battery); // External power
+    TEST_ASSERT_EQUAL_INT8(10, device->mac.statusMargin);
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_HEX8(MAC_LINK_CHECK, response[8]);
+}
+
+void test_combined_answer()
+{
+    loRaWAN->mac.statusInterval = 2;
+    loRaWAN->adr.minSF = 9;
+    loRaWAN->adr.maxSF = 9;
+
+    // Fill the ADR history with a strong link
+    uint8_t frame[64];
+    uint8_t len;
+    for (int i = 1; i < ADR_HISTORY; i++)
+    {
+        len = buildUplink(frame, 0x40, i, 1, (const uint8_t *)"x", 1, NULL, 0, exampleDevAddr, 0x80);
+        loRaWAN->parseMessage(frame, len, -100, 40, 9);
+    }
+    TEST_ASSERT_EQUAL_INT(0, responses);
+
+    const uint8_t fOpts[] = {MAC_LINK_CHECK};
+    len = buildUplink(frame, 0x80, ADR_HISTORY, 1, (const uint8_t *)"x", 1, fOpts, sizeof(fOpts), exampleDevAddr, 0x80);
+    loRaWAN->parseMessage(frame, len, -100, 40, 9);
+
+    // ACK, LinkCheckAns, DevStatusReq and LinkADRReq in one downlink
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_HEX8(0x80 | 0x20 | 9, response[5]);
+    const uint8_t expected[] = {MAC_LINK_CHECK, 20, 1, MAC_DEV_STATUS, MAC_LINK_ADR, 0x34, 0x01, 0x00, 0x01};
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, &response[8], sizeof(expected));
+    TEST_ASSERT_TRUE(device->mac.statusSent);
+}
+
+void test_status_request_only_along()
+{
+    loRaWAN->mac.statusInterval = 1;
+
+    // No downlink of its own
+    send(1, NULL, 0);
+    TEST_ASSERT_EQUAL_INT(0, responses);
+
+    send(2, NULL, 0, 0x80);
+    TEST_ASSERT_EQUAL_INT(1, responses);
+    TEST_ASSERT_EQUAL_UINT8(1, response[5] & 0x0f);
+    TEST_ASSERT_EQUAL_HEX8(MAC_DEV_STATUS, response[8]);
+
+    const uint8_t fOpts[] = {MAC_DEV_STATUS, 254, 5};
+    send(3, fOpts, sizeof(fOpts));
+    TEST_ASSERT_FALSE(device->mac.statusSent);
+    TEST_ASSERT_EQUAL_UINT8(254, device->mac.battery);
+}
+
+void test_room_limits_answers()
+{
+    device->mac.due = MAC_DUE_LINK_CHECK;
+    uint8_t fOpts[MAC_MAX_FOPTS];
+    TEST_ASSERT_EQUAL_UINT8(0, loRaWAN->mac.build(device, fOpts, 2));
+    TEST_ASSERT_FALSE(loRaWAN->mac.due(device));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_table_lengths);
+    RUN_TEST(test_commands_after_link_check);
+    RUN_TEST(test_unknown_command_stops);
+    RUN_TEST(test_cut_off_command_stops);
+    RUN_TEST(test_sticky_answer_gets_downlink);
+    RUN_TEST(test_port_zero_commands);
+    RUN_TEST(test_combined_answer);
+    RUN_TEST(test_status_request_only_along);
+    RUN_TEST(test_room_limits_answers);
+    return UNITY_END();
+}
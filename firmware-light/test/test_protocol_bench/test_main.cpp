@@ -0,0 +1,179 @@
+//
+//  Host benchmark of the receive path. Reports frames per second and
+//  nanoseconds per frame for parseMessage, AES_CMAC, encodePacket and the
+//  MAC command decoder, and the MICs spent on a burst of junk frames.
+//
+
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+#include "frames.h"
+
+#define BENCH_FRAMES 256
+#define BENCH_ROUNDS 200
+
+static uint8_t frames[BENCH_FRAMES][64];
+static uint8_t frameLengths[BENCH_FRAMES];
+static int messages;
+
+static void onMessage(LoRaWanDevice *device, uint8_t port, uint8_t *msg, uint8_t length)
+{
+    messages++;
+}
+
+static void report(const char *name, uint32_t count, std::chrono::steady_clock::time_point start)
+{
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-14s %10.0f frames/s %8.0f ns/frame\n", name, count * 1e9 / ns, ns / count);
+}
+
+void setUp()
+{
+    // LDS02 sized uplinks, 10 byte payload on port 10
+    uint8_t payload[10] = {0x8b, 0x9e, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
+    for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+    {
+        frameLengths[i] = buildUplink(frames[i], 0x40, i + 1, 10, payload, 10);
+    }
+}
+
+void tearDown() {}
+
+void test_bench_parse_message()
+{
+    static LoRaWanP2P loRaWAN;
+    LoRaWanDevice *device = loRaWAN.addDevice(exampleDevAddr, exampleNwkSKey, exampleAppSKey, 0);
+    uint8_t buf[64];
+
+    loRaWAN.OTAAEnabled = false;
+    loRaWAN.dedup.expiry = 0; // Every round sends the same frames again
+    loRaWAN.onMessage(onMessage);
+    messages = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+    {
+        device->fCntUp = 0;
+        for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+        {
+            memcpy(buf, frames[i], frameLengths[i]);
+            loRaWAN.parseMessage(buf, frameLengths[i], -80);
+        }
+    }
+    report("parseMessage", BENCH_ROUNDS * BENCH_FRAMES, start);
+    printf("%-14s %10.2f MICs/frame\n", "parseMessage", (double)loRaWAN.fCntResolver.cmacs / loRaWAN.fCntResolver.accepted);
+
+    TEST_ASSERT_EQUAL_INT(BENCH_ROUNDS * BENCH_FRAMES, messages);
+}
+
+void test_bench_aes_cmac()
+{
+    AES_Context ctx;
+    uint8_t b0[16] = {0x49};
+    uint8_t cmac[16];
+
+    AES_Setup(&ctx, exampleNwkSKey);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+        {
+            AES_CMAC_B0(b0, frames[i], frameLengths[i] - 4, cmac, &ctx);
+        }
+    }
+    report("AES_CMAC", BENCH_ROUNDS * BENCH_FRAMES, start);
+}
+
+void test_bench_encode_packet()
+{
+    AES_Context ctx;
+    uint8_t payload[10] = {0};
+
+    AES_Setup(&ctx, exampleAppSKey);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+        {
+            encodePacket(payload, sizeof(payload), i, exampleDevAddr, &ctx, 0);
+        }
+    }
+    report("encodePacket", BENCH_ROUNDS * BENCH_FRAMES, start);
+}
+
+void test_bench_junk_frames()
+{
+    static LoRaWanP2P loRaWAN;
+    LoRaWanDevice *device = loRaWAN.addDevice(exampleDevAddr, exampleNwkSKey, exampleAppSKey, 0);
+    uint8_t buf[64];
+
+    // Our DevAddr with random counters and MICs, as a forger or a broken device would send
+    srand(1);
+    static uint8_t junk[BENCH_FRAMES][64];
+    for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+    {
+        memcpy(junk[i], frames[i], frameLengths[i]);
+        junk[i][6] = rand();
+        junk[i][7] = rand();
+        junk[i][frameLengths[i] - 1] ^= 0x01;
+    }
+
+    loRaWAN.OTAAEnabled = false;
+    device->fCntUp = 1000;
+    device->allowFCntReset = false;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+        {
+            memcpy(buf, junk[i], frameLengths[i]);
+            loRaWAN.parseMessage(buf, frameLengths[i], -80);
+        }
+    }
+    report("junk frames", BENCH_ROUNDS * BENCH_FRAMES, start);
+
+    // About a quarter of random counters fall in the window of 16384
+    printf("%-14s %10.2f MICs/frame\n", "junk frames", (double)loRaWAN.fCntResolver.cmacs / (BENCH_ROUNDS * BENCH_FRAMES));
+    TEST_ASSERT_EQUAL_UINT32(0, loRaWAN.fCntResolver.accepted);
+    TEST_ASSERT_TRUE(loRaWAN.fCntResolver.cmacs < BENCH_ROUNDS * BENCH_FRAMES / 2);
+}
+
+void test_bench_mac_commands()
+{
+    static LoRaWanP2P loRaWAN;
+    LoRaWanDevice *device = loRaWAN.addDevice(exampleDevAddr, exampleNwkSKey, exampleAppSKey, 0);
+
+    // A full FOpts: LinkCheckReq, LinkADRAns, DevStatusAns and the sticky answers
+    const uint8_t fOpts[15] = {MAC_LINK_CHECK, MAC_LINK_ADR, 0x07, MAC_DEV_STATUS, 200, 0x0a,
+                               MAC_RX_PARAM_SETUP, 0x07, MAC_RX_TIMING_SETUP, MAC_DL_CHANNEL, 0x03,
+                               MAC_DUTY_CYCLE, MAC_NEW_CHANNEL, 0x03, MAC_TX_PARAM_SETUP};
+    uint8_t answers[MAC_MAX_FOPTS];
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (uint32_t i = 0; i < BENCH_FRAMES; i++)
+        {
+            loRaWAN.mac.parse(device, fOpts, sizeof(fOpts), 20);
+            loRaWAN.mac.build(device, answers, sizeof(answers));
+        }
+    }
+    report("MAC commands", BENCH_ROUNDS * BENCH_FRAMES, start);
+
+    TEST_ASSERT_EQUAL_UINT32(BENCH_ROUNDS * BENCH_FRAMES * 9, loRaWAN.mac.commands);
+    TEST_ASSERT_EQUAL_UINT32(0, loRaWAN.mac.unknown);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_bench_parse_message);
+    RUN_TEST(test_bench_aes_cmac);
+    RUN_TEST(test_bench_encode_packet);
+    RUN_TEST(test_bench_junk_frames);
+    RUN_TEST(test_bench_mac_commands);
+    return UNITY_END();
+}
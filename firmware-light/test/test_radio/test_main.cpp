@@ -0,0 +1,213 @@
+//
+//  Simulated radio: time on air, turnaround, IQ inversion, collisions,
+//  packet errors and CAD.
+//
+
+#include <unity.h>
+#include "Radio.h"
+
+#define CHANNEL 868100000
+
+static RadioSim *radio;
+static uint8_t received;
+static uint8_t lastLength;
+static uint8_t txDone;
+static uint8_t cads;
+static bool lastDetected;
+
+static const uint8_t payload[13] = {0x40, 0xF1, 0x7D, 0xBE, 0x49, 0x00, 0x02, 0x00, 0x01, 0x95, 0x43, 0x78, 0x76};
+
+static void onReceive(int length)
+{
+    uint8_t buffer[RADIO_SIM_MAX_FRAME];
+    lastLength = radio->read(buffer, sizeof(buffer));
+    received++;
+}
+
+static void onTxDone()
+{
+    txDone++;
+}
+
+static void onCadDone(bool detected)
+{
+    lastDetected = detected;
+    cads++;
+}
+
+void setUp()
+{
+    radio = new RadioSim();
+    radio->begin(CHANNEL);
+    radio->setSpreadingFactor(7);
+    radio->onReceive(onReceive);
+    radio->onTxDone(onTxDone);
+    radio->onCadDone(onCadDone);
+    received = 0;
+    lastLength = 0;
+    txDone = 0;
+    cads = 0;
+    lastDetected = false;
+}
+
+void tearDown()
+{
+    delete radio;
+}
+
+void test_time_on_air()
+{
+    TEST_ASSERT_TRUE(radio->transmit(payload, sizeof(payload)));
+    TEST_ASSERT_FALSE(radio->transmit(payload, sizeof(payload))); // Busy
+    radio->run(1000000);
+    TEST_ASSERT_EQUAL_UINT8(1, txDone);
+
+    const RadioSimTransmission *t = radio->transmission(0);
+    TEST_ASSERT_EQUAL_UINT32(RADIO_SIM_TURNAROUND, t->start);
+    TEST_ASSERT_EQUAL_UINT32(46336, t->end - t->start);
+
+    // Coding rate 4/8 and 250 kHz
+    radio->setCodingRate(8);
+    radio->setBandwidth(250000);
+    radio->transmit(payload, sizeof(payload));
+    radio->run(2000000);
+    t = radio->transmission(1);
+    TEST_ASSERT_EQUAL_UINT32(loraAirtime(7, sizeof(payload), 250000, 8), t->end - t->start);
+    TEST_ASSERT_TRUE(t->end - t->start < 46336);
+    TEST_ASSERT_EQUAL_UINT8(2, radio->transmissions());
+}
+
+void test_receive()
+{
+    radio->receive();
+    radio->inject(CHANNEL, 7, false, 1000, payload, sizeof(payload), -60, 20);
+    radio->run(1000 + 46335);
+    TEST_ASSERT_EQUAL_UINT8(0, received);
+    radio->run(1000 + 46336);
+    TEST_ASSERT_EQUAL_UINT8(1, received);
+    TEST_ASSERT_EQUAL_UINT8(sizeof(payload), lastLength);
+    TEST_ASSERT_EQUAL_INT(-60, radio->packetRssi());
+    TEST_ASSERT_EQUAL_INT8(20, radio->packetSnr());
+}
+
+void test_wrong_channel_or_sf()
+{
+    radio->receive();
+    radio->inject(CHANNEL + 200000, 7, false, 1000, payload, sizeof(payload));
+    radio->inject(CHANNEL, 8, false, 100000, payload, sizeof(payload));
+    radio->run(1000000);
+    TEST_ASSERT_EQUAL_UINT8(0, received);
+    TEST_ASSERT_EQUAL_UINT32(2, radio->missed);
+}
+
+void test_invert_iq()
+{
+    // A downlink of another gateway is not received as uplink
+    radio->receive();
+    radio->inject(CHANNEL, 7, true, 1000, payload, sizeof(payload));
+    radio->run(100000);
+    TEST_ASSERT_EQUAL_UINT8(0, received);
+
+    radio->setInvertIQ(true);
+    radio->receive();
+    radio->inject(CHANNEL, 7, true, 200000, payload, sizeof(payload));
+    radio->run(300000);
+    TEST_ASSERT_EQUAL_UINT8(1, received);
+}
+
+void test_turnaround()
+{
+    // Receive right after transmitting, the frame starts before the receiver is back
+    radio->transmit(payload, sizeof(payload));
+    const RadioSimTransmission *t = radio->transmission(0);
+    radio->inject(CHANNEL, 7, false, t->end + RADIO_SIM_TURNAROUND - loraPreambleTime(7) + 2 * loraSymbolTime(7), payload, sizeof(payload));
+    radio->run(t->end);
+    radio->receive();
+    radio->run(1000000);
+    TEST_ASSERT_EQUAL_UINT8(0, received);
+    TEST_ASSERT_EQUAL_UINT32(1, radio->missed);
+
+    // Enough preamble left
+    radio->transmit(payload, sizeof(payload));
+    t = radio->transmission(1);
+    radio->inject(CHANNEL, 7, false, t->end, payload, sizeof(payload));
+    radio->run(t->end);
+    radio->receive();
+    radio->run(2000000);
+    TEST_ASSERT_EQUAL_UINT8(1, received);
+}
+
+void test_collision()
+{
+    radio->receive();
+    radio->inject(CHANNEL, 7, false, 1000, payload, sizeof(payload), -80);
+    radio->inject(CHANNEL, 7, false, 20000, payload, sizeof(payload), -82);
+    radio->run(200000);
+    TEST_ASSERT_EQUAL_UINT8(0, received);
+    TEST_ASSERT_EQUAL_UINT32(2, radio->collisions);
+
+    // Other spreading factors do not collide, a much stronger frame is captured
+    radio->inject(CHANNEL, 7, false, 300000, payload, sizeof(payload), -60);
+    radio->inject(CHANNEL, 7, false, 310000, payload, sizeof(payload), -90);
+    radio->inject(CHANNEL, 9, false, 310000, payload, sizeof(payload), -60);
+    radio->run(600000);
+    TEST_ASSERT_EQUAL_UINT8(1, received);
+    TEST_ASSERT_EQUAL_UINT32(3, radio->collisions);
+}
+
+static void receiveWithErrors(RadioSim *sim, uint32_t seed)
+{
+    sim->seed(seed);
+    sim->packetErrorRate = 100;
+    sim->begin(CHANNEL);
+    sim->setSpreadingFactor(7);
+    sim->receive();
+    for (uint32_t i = 0; i < 1000; i++)
+    {
+        sim->inject(CHANNEL, 7, false, i * 100000, payload, sizeof(payload));
+        sim->run((i + 1) * 100000);
+    }
+}
+
+void test_packet_error_rate()
+{
+    static RadioSim first;
+    static RadioSim second;
+    receiveWithErrors(&first, 42);
+    receiveWithErrors(&second, 42);
+
+    TEST_ASSERT_EQUAL_UINT32(1000, first.received + first.corrupted);
+    TEST_ASSERT_UINT32_WITHIN(30, 100, first.corrupted);
+    TEST_ASSERT_EQUAL_UINT32(first.corrupted, second.corrupted); // Reproducible
+}
+
+void test_cad()
+{
+    radio->inject(CHANNEL, 7, false, 1000, payload, sizeof(payload));
+    radio->run(2000);
+    radio->cad();
+    radio->run(10000);
+    TEST_ASSERT_EQUAL_UINT8(1, cads);
+    TEST_ASSERT_TRUE(lastDetected);
+
+    // After the preamble there is nothing to detect
+    radio->run(20000);
+    radio->cad();
+    radio->run(30000);
+    TEST_ASSERT_EQUAL_UINT8(2, cads);
+    TEST_ASSERT_FALSE(lastDetected);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_time_on_air);
+    RUN_TEST(test_receive);
+    RUN_TEST(test_wrong_channel_or_sf);
+    RUN_TEST(test_invert_iq);
+    RUN_TEST(test_turnaround);
+    RUN_TEST(test_collision);
+    RUN_TEST(test_packet_error_rate);
+    RUN_TEST(test_cad);
+    return UNITY_END();
+}
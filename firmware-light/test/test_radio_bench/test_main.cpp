@@ -0,0 +1,184 @@
+//
+//  Offline benchmark of the receive and downlink path on the simulated
+//  radio. Sensors send uplinks on one channel, a share of them is
+//  confirmed and answered in RX1 through the DownlinkScheduler. Reports how
+//  many uplinks got through and how close downlinks start to RX1.
+//  Reproducible: the same seed gives the same numbers.
+//
+
+#include <unity.h>
+#include <stdio.h>
+#include "Radio.h"
+#include "DownlinkScheduler.h"
+
+#define CHANNEL 868100000
+#define SF 9
+#define LOOP_TIME 200         // micros between two passes of loop()
+#define RX1_DELAY 1000000     // AT+CRX1DELAY=1
+#define BENCH_TIME 600000000  // 10 minutes
+#define UPLINK_LENGTH 23      // LDS02 uplink
+#define DOWNLINK_LENGTH 12    // Empty ack
+#define CONFIRMED_PERCENT 20
+
+static RadioSim *radio;
+static DownlinkScheduler *downlinks;
+static bool frameReceived;
+static uint32_t rxDone; // Like msgTimestamp, taken in the interrupt
+static bool sendingDone;
+
+static void onReceive(int length)
+{
+    uint8_t buffer[RADIO_SIM_MAX_FRAME];
+    radio->read(buffer, sizeof(buffer));
+    rxDone = radio->now();
+    frameReceived = true;
+}
+
+static void onTxDone()
+{
+    sendingDone = true;
+}
+
+void setUp()
+{
+    radio = new RadioSim();
+    downlinks = new DownlinkScheduler();
+    radio->seed(1);
+    radio->begin(CHANNEL);
+    radio->setSpreadingFactor(SF);
+    radio->onReceive(onReceive);
+    radio->onTxDone(onTxDone);
+    radio->receive();
+    frameReceived = false;
+    sendingDone = false;
+}
+
+void tearDown()
+{
+    delete radio;
+    delete downlinks;
+}
+
+typedef struct BenchResult
+{
+    uint32_t offered;
+    uint32_t downlinks;
+    int32_t maxError; // Transmit start minus RX1, micros
+    int64_t sumError;
+} BenchResult;
+
+// Sensors send every period on average. Runs the light like loop() does.
+static void runBench(uint8_t sensors, uint32_t period, uint16_t packetErrorRate, BenchResult *result)
+{
+    const uint8_t uplink[UPLINK_LENGTH] = {};
+    const uint8_t downlink[DOWNLINK_LENGTH] = {};
+    uint32_t nextUplink[16];
+    srand(7);
+    for (uint8_t i = 0; i < sensors; i++)
+    {
+        nextUplink[i] = rand() % period;
+    }
+
+    radio->packetErrorRate = packetErrorRate;
+    *result = {};
+    uint32_t rx1 = 0;
+    while (radio->now() < BENCH_TIME)
+    {
+        // Put uplinks on the air a little ahead of time
+        for (uint8_t i = 0; i < sensors; i++)
+        {
+            if (nextUplink[i] < radio->now() + LOOP_TIME)
+            {
+                radio->inject(CHANNEL, SF, false, nextUplink[i], uplink, sizeof(uplink));
+                nextUplink[i] += period / 2 + rand() % period;
+                result->offered++;
+            }
+        }
+
+        radio->run(radio->now() + LOOP_TIME);
+
+        if (sendingDone)
+        {
+            sendingDone = false;
+            radio->setInvertIQ(false);
+            radio->receive();
+        }
+
+        if (frameReceived)
+        {
+            frameReceived = false;
+            if (rand() % 100 < CONFIRMED_PERCENT && downlinks->schedule(downlink, sizeof(downlink), rxDone, RX1_DELAY))
+            {
+                rx1 = rxDone + RX1_DELAY;
+            }
+        }
+
+        uint32_t wait;
+        DownlinkAction action = downlinks->poll(radio->now(), &wait);
+        if (action == DOWNLINK_WAIT && wait < LOOP_TIME)
+        {
+            // The downlink timer fires before the next pass
+            radio->run(radio->now() + wait);
+            action = downlinks->poll(radio->now(), &wait);
+        }
+
+        if (action == DOWNLINK_SEND_RX1 || action == DOWNLINK_SEND_RX2)
+        {
+            radio->idle();
+            radio->setInvertIQ(true);
+            radio->transmit(downlinks->buffer(), downlinks->length());
+            const RadioSimTransmission *t = radio->transmission(radio->transmissions() - 1);
+            downlinks->sent(t->start);
+
+            if (action == DOWNLINK_SEND_RX1)
+            {
+                int32_t error = (int32_t)(t->start - rx1);
+                result->downlinks++;
+                result->sumError += error;
+                if (error > result->maxError)
+                {
+                    result->maxError = error;
+                }
+            }
+        }
+    }
+}
+
+static void report(const char *name, BenchResult *result)
+{
+    printf("%-22s offered %5u received %5u collided %4u corrupted %4u missed %4u  RX1/RX2 %4u/%u  late avg/max %ld/%ld us\n",
+           name, result->offered, radio->received, radio->collisions, radio->corrupted, radio->missed,
+           downlinks->sentRX1, downlinks->sentRX2,
+           result->downlinks ? (long)(result->sumError / result->downlinks) : 0L, (long)result->maxError);
+}
+
+void test_bench_few_sensors()
+{
+    BenchResult result;
+    runBench(4, 60000000, 0, &result);
+    report("4 sensors, 60 s", &result);
+
+    TEST_ASSERT_GREATER_THAN(0, result.downlinks);
+    TEST_ASSERT_LESS_OR_EQUAL((int32_t)DOWNLINK_LATE_LIMIT, result.maxError);
+    TEST_ASSERT_GREATER_THAN(result.offered * 9 / 10, radio->received);
+}
+
+void test_bench_busy_channel()
+{
+    BenchResult result;
+    runBench(16, 5000000, 10, &result);
+    report("16 sensors, 5 s, 1% PER", &result);
+
+    // Every uplink that ended is accounted for
+    TEST_ASSERT_UINT32_WITHIN(16, result.offered, radio->received + radio->collisions + radio->corrupted + radio->missed);
+    TEST_ASSERT_GREATER_THAN(0, radio->collisions);
+    TEST_ASSERT_LESS_OR_EQUAL((int32_t)DOWNLINK_LATE_LIMIT, result.maxError);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_bench_few_sensors);
+    RUN_TEST(test_bench_busy_channel);
+    return UNITY_END();
+}
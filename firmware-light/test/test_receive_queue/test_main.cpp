@@ -0,0 +1,97 @@
+//
+//  Receive queue ordering, wrap around and overflow accounting.
+//
+
+#include <unity.h>
+#include <string.h>
+#include "ReceiveQueue.h"
+
+static ReceiveQueue *queue;
+
+static bool push(uint8_t value)
+{
+    struct_received_frame *frame = queue->reserve();
+    if (!frame)
+    {
+        return false;
+    }
+
+    frame->length = 1;
+    frame->data[0] = value;
+    queue->publish();
+    return true;
+}
+
+void setUp()
+{
+    queue = new ReceiveQueue();
+}
+
+void tearDown()
+{
+    delete queue;
+}
+
+void test_empty_queue()
+{
+    TEST_ASSERT_NULL(queue->peek());
+}
+
+void test_fifo_order_with_wrap_around()
+{
+    uint8_t next = 0;
+
+    // Several times around the ring, also past the 8-bit index overflow
+    for (int i = 0; i < 100; i++)
+    {
+        TEST_ASSERT_TRUE(push(i * 3));
+        TEST_ASSERT_TRUE(push(i * 3 + 1));
+        TEST_ASSERT_TRUE(push(i * 3 + 2));
+
+        struct_received_frame *frame;
+        while ((frame = queue->peek()) != NULL)
+        {
+            TEST_ASSERT_EQUAL_UINT8(next++, frame->data[0]);
+            queue->pop();
+        }
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(0, queue->overflows);
+}
+
+void test_overflow_drops_newest()
+{
+    for (int i = 0; i < RECEIVE_QUEUE_SIZE; i++)
+    {
+        TEST_ASSERT_TRUE(push(i));
+    }
+
+    TEST_ASSERT_FALSE(push(0xFF));
+    TEST_ASSERT_FALSE(push(0xFF));
+    TEST_ASSERT_EQUAL_UINT32(2, queue->overflows);
+
+    // Frames already queued are untouched
+    TEST_ASSERT_EQUAL_UINT8(0, queue->peek()->data[0]);
+    queue->pop();
+    TEST_ASSERT_TRUE(push(0x42));
+}
+
+void test_reserve_without_publish_is_invisible()
+{
+    struct_received_frame *frame = queue->reserve();
+    TEST_ASSERT_NOT_NULL(frame);
+    TEST_ASSERT_NULL(queue->peek());
+
+    queue->publish();
+    TEST_ASSERT_EQUAL_PTR(frame, queue->peek());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_empty_queue);
+    RUN_TEST(test_fifo_order_with_wrap_around);
+    RUN_TEST(test_overflow_drops_newest);
+    RUN_TEST(test_reserve_without_publish_is_invisible);
+    return UNITY_END();
+}
@@ -0,0 +1,225 @@
+//
+//  CAD scanner: slot order, locking, timeouts and reception of uplinks on
+//  random channels with the simulated radio.
+//
+
+#include <unity.h>
+#include "ChannelScanner.h"
+#include "Radio.h"
+
+#define LOOP_TIME 100 // micros between two passes of loop()
+
+static const uint32_t eu868[] = {868100000, 868300000, 868500000, 867100000,
+                                 867300000, 867500000, 867700000, 867900000};
+static ChannelScanner *s;
+static RadioSim *radio;
+static bool cadDone;
+static bool cadDetected;
+static bool frameReceived;
+
+static void onCadDone(bool detected)
+{
+    cadDetected = detected;
+    cadDone = true;
+}
+
+static void onReceive(int length)
+{
+    uint8_t buffer[RADIO_SIM_MAX_FRAME];
+    radio->read(buffer, sizeof(buffer));
+    frameReceived = true;
+}
+
+void setUp()
+{
+    s = new ChannelScanner();
+    radio = new RadioSim();
+    radio->onCadDone(onCadDone);
+    radio->onReceive(onReceive);
+    cadDone = false;
+    frameReceived = false;
+}
+
+void tearDown()
+{
+    delete s;
+    delete radio;
+}
+
+static void startCad()
+{
+    radio->idle();
+    radio->setFrequency(s->frequency());
+    radio->setSpreadingFactor(s->spreadingFactor());
+    radio->cad();
+}
+
+// Drive the scanner until end, the way loop() in main.cpp does.
+static void run(uint32_t end)
+{
+    while (radio->now() < end)
+    {
+        radio->run(radio->now() + LOOP_TIME);
+        if (frameReceived)
+        {
+            frameReceived = false;
+            s->received(radio->now());
+            startCad();
+            continue;
+        }
+
+        ScanAction action;
+        if (cadDone)
+        {
+            cadDone = false;
+            action = s->cadDone(cadDetected, radio->now());
+        }
+        else
+        {
+            action = s->poll(radio->now());
+        }
+
+        if (action == SCAN_RECEIVE)
+        {
+            radio->receive();
+        }
+        else if (action == SCAN_CAD)
+        {
+            startCad();
+        }
+    }
+}
+
+void test_airtime()
+{
+    // 13 byte frame: 46.3 ms at SF7, 1.16 s at SF12 (low data rate optimization)
+    TEST_ASSERT_EQUAL_UINT32(1024, loraSymbolTime(7));
+    TEST_ASSERT_EQUAL_UINT32(46336, loraAirtime(7, 13));
+    TEST_ASSERT_EQUAL_UINT32(1155072, loraAirtime(12, 13));
+}
+
+void test_begin_checks_range()
+{
+    TEST_ASSERT_FALSE(s->begin(eu868, 0, 7, 12, 64, 0));
+    TEST_ASSERT_FALSE(s->begin(eu868, 9, 7, 12, 64, 0));
+    TEST_ASSERT_FALSE(s->begin(eu868, 8, 6, 12, 64, 0));
+    TEST_ASSERT_FALSE(s->begin(eu868, 8, 10, 9, 64, 0));
+    TEST_ASSERT_TRUE(s->begin(eu868, 8, 7, 12, 64, 0));
+}
+
+void test_slot_order()
+{
+    s->begin(eu868, 3, 9, 10, 64, 0);
+
+    // All channels at SF9, then at SF10, then a new cycle
+    const uint8_t sfs[] = {9, 9, 9, 10, 10, 10, 9};
+    for (uint8_t i = 0; i < sizeof(sfs); i++)
+    {
+        TEST_ASSERT_EQUAL_UINT32(eu868[i % 3], s->frequency());
+        TEST_ASSERT_EQUAL_UINT8(sfs[i], s->spreadingFactor());
+        TEST_ASSERT_EQUAL_UINT8(SCAN_CAD, s->cadDone(false, (i + 1) * 1000));
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, s->cycles);
+    TEST_ASSERT_EQUAL_UINT32(6000, s->cycleTime);
+    TEST_ASSERT_EQUAL_UINT32(2, s->stats(0, 9).cads);
+}
+
+void test_lock_and_receive()
+{
+    s->begin(eu868, 8, 7, 12, 64, 0);
+    s->cadDone(false, 100);
+
+    TEST_ASSERT_EQUAL_UINT8(SCAN_RECEIVE, s->cadDone(true, 200));
+    TEST_ASSERT_TRUE(s->locked());
+    TEST_ASSERT_EQUAL_UINT8(SCAN_NONE, s->cadDone(false, 300)); // Ignored while locked
+    TEST_ASSERT_EQUAL_UINT8(SCAN_NONE, s->poll(1000));
+
+    s->received(50000);
+    TEST_ASSERT_FALSE(s->locked());
+    TEST_ASSERT_EQUAL_UINT32(eu868[2], s->frequency());
+
+    ScanStats stats = s->stats(1, 7);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.cads);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.detections);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.frames);
+}
+
+void test_lock_timeout()
+{
+    s->begin(eu868, 8, 12, 12, 64, 0);
+    s->cadDone(true, 0);
+
+    uint32_t timeout = loraAirtime(12, 64);
+    TEST_ASSERT_EQUAL_UINT8(SCAN_NONE, s->poll(timeout - 1));
+    TEST_ASSERT_EQUAL_UINT8(SCAN_CAD, s->poll(timeout));
+    TEST_ASSERT_FALSE(s->locked());
+    TEST_ASSERT_EQUAL_UINT32(1, s->stats(0, 12).timeouts);
+    TEST_ASSERT_EQUAL_UINT32(0, s->stats(0, 12).frames);
+}
+
+void test_cancel()
+{
+    s->begin(eu868, 8, 7, 12, 64, 0);
+    s->cadDone(true, 0);
+    s->cancel(10);
+    TEST_ASSERT_FALSE(s->locked());
+    TEST_ASSERT_EQUAL_UINT32(eu868[1], s->frequency());
+    TEST_ASSERT_EQUAL_UINT32(0, s->stats(0, 7).timeouts);
+}
+
+// Fraction of uplinks received when a sensor picks a random channel
+static uint8_t receiveRate(uint8_t minSF, uint8_t maxSF, uint8_t sensorSF)
+{
+    const uint8_t uplinks = 64;
+    const uint8_t payload[23] = {}; // LDS02 uplink
+    s->begin(eu868, 8, minSF, maxSF, 64, 0);
+    startCad();
+
+    srand(1);
+    uint32_t start = 500000;
+    for (uint8_t i = 0; i < uplinks; i++)
+    {
+        radio->inject(eu868[rand() % 8], sensorSF, false, start, payload, sizeof(payload));
+        start += 4000000 + rand() % 1000000;
+        run(start);
+    }
+
+    uint32_t frames = 0;
+    for (uint8_t channel = 0; channel < 8; channel++)
+    {
+        frames += s->stats(channel, sensorSF).frames;
+    }
+    return frames * 100 / uplinks;
+}
+
+void test_scan_one_sf()
+{
+    // 8 CADs at SF9 take 66 ms. A preamble lasts 50 ms, of which the CAD and
+    // the receiver need 6 symbols, so about 40% of the uplinks is caught.
+    uint8_t rate = receiveRate(9, 9, 9);
+    TEST_ASSERT_GREATER_THAN(30, rate);
+    TEST_ASSERT_UINT32_WITHIN(5000, 8 * RADIO_SIM_CAD_SYMBOLS * loraSymbolTime(9) + 8 * LOOP_TIME, s->cycleTime);
+}
+
+void test_scan_all_sf()
+{
+    // One pass over all 48 slots takes about a second, so at SF12 only about a
+    // fifth of the uplinks is caught.
+    uint8_t rate = receiveRate(7, 12, 12);
+    TEST_ASSERT_GREATER_THAN(15, rate);
+    TEST_ASSERT_GREATER_THAN(1000000, s->maxCycleTime);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_airtime);
+    RUN_TEST(test_begin_checks_range);
+    RUN_TEST(test_slot_order);
+    RUN_TEST(test_lock_and_receive);
+    RUN_TEST(test_lock_timeout);
+    RUN_TEST(test_cancel);
+    RUN_TEST(test_scan_one_sf);
+    RUN_TEST(test_scan_all_sf);
+    return UNITY_END();
+}
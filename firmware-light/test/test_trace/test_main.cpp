@@ -0,0 +1,110 @@
+//
+//  Trace histograms: min/avg/max and the 99th percentile bucket.
+//
+
+#include <unity.h>
+#include "Trace.h"
+
+static Trace *t;
+
+void setUp()
+{
+    t = new Trace();
+}
+
+void tearDown()
+{
+    delete t;
+}
+
+void test_empty_stage()
+{
+    TraceStats stats = t->stats(TRACE_SHOW);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.count);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.p99);
+}
+
+void test_min_avg_max()
+{
+    t->record(TRACE_POPULATE, 10 * TRACE_CYCLES_PER_US);
+    t->record(TRACE_POPULATE, 20 * TRACE_CYCLES_PER_US);
+    t->record(TRACE_POPULATE, 60 * TRACE_CYCLES_PER_US);
+
+    TraceStats stats = t->stats(TRACE_POPULATE);
+    TEST_ASSERT_EQUAL_UINT32(3, stats.count);
+    TEST_ASSERT_EQUAL_UINT32(10, stats.min);
+    TEST_ASSERT_EQUAL_UINT32(30, stats.avg);
+    TEST_ASSERT_EQUAL_UINT32(60, stats.max);
+    TEST_ASSERT_EQUAL_UINT32(60, stats.p99); // Capped at max
+}
+
+void test_p99_within_bucket()
+{
+    // 990 fast samples and 10 slow ones, p99 lands in the fast bucket
+    for (int i = 0; i < 990; i++)
+    {
+        t->record(TRACE_DECRYPT, 100 * TRACE_CYCLES_PER_US);
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        t->record(TRACE_DECRYPT, 5000 * TRACE_CYCLES_PER_US);
+    }
+
+    TraceStats stats = t->stats(TRACE_DECRYPT);
+    TEST_ASSERT_TRUE(stats.p99 >= 100);
+    TEST_ASSERT_TRUE(stats.p99 <= 125); // A quarter octave above
+    TEST_ASSERT_EQUAL_UINT32(5000, stats.max);
+
+    // One more slow sample moves it to the slow bucket
+    for (int i = 0; i < 2; i++)
+    {
+        t->record(TRACE_DECRYPT, 5000 * TRACE_CYCLES_PER_US);
+    }
+    TEST_ASSERT_EQUAL_UINT32(5000, t->stats(TRACE_DECRYPT).p99);
+}
+
+void test_mark_needs_begin()
+{
+    t->mark(TRACE_HANDLE);
+    TEST_ASSERT_EQUAL_UINT32(0, t->stats(TRACE_HANDLE).count);
+
+    t->begin(traceCycles());
+    t->mark(TRACE_HANDLE);
+    t->end();
+    t->mark(TRACE_HANDLE);
+    TEST_ASSERT_EQUAL_UINT32(1, t->stats(TRACE_HANDLE).count);
+}
+
+void test_loop_period()
+{
+    t->loop();
+    t->loop();
+    t->loop();
+    TEST_ASSERT_EQUAL_UINT32(2, t->stats(TRACE_LOOP).count);
+
+    t->reset();
+    TEST_ASSERT_EQUAL_UINT32(0, t->stats(TRACE_LOOP).count);
+}
+
+void test_full_range()
+{
+    t->record(TRACE_ESPNOW, 0);
+    t->record(TRACE_ESPNOW, 3);
+    t->record(TRACE_ESPNOW, UINT32_MAX);
+
+    TraceStats stats = t->stats(TRACE_ESPNOW);
+    TEST_ASSERT_EQUAL_UINT32(3, stats.count);
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX / TRACE_CYCLES_PER_US, stats.p99);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_empty_stage);
+    RUN_TEST(test_min_avg_max);
+    RUN_TEST(test_p99_within_bucket);
+    RUN_TEST(test_mark_needs_begin);
+    RUN_TEST(test_loop_period);
+    RUN_TEST(test_full_range);
+    return UNITY_END();
+}
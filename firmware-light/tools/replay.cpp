@@ -0,0 +1,165 @@
+//
+//  replay.cpp
+//  Feed a frame capture back through LoRaWanP2P::parseMessage on a computer.
+//
+//  Build with `pio run -e replay` and run
+//
+//    .pio/build/replay/program <capture log> <devAddr>:<nwkSKey>:<appSKey> [...] [-n rounds]
+//
+//  The capture log is the serial output of the 'c' command of the light, other
+//  lines are ignored. Keys are given in hex, as in main.cpp. The first round
+//  compares every outcome with the one recorded on the light, the following
+//  rounds measure throughput.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "LoRaWanP2P.h"
+#include "CaptureRecord.h"
+
+static const char *resultNames[] = {"accepted", "joined", "replay", "malformed", "unknown device", "invalid mic", "old fcnt", "ignored", "fcnt gap", "duplicate"};
+
+static const char *resultName(uint8_t result)
+{
+    return result < sizeof(resultNames) / sizeof(resultNames[0]) ? resultNames[result] : "?";
+}
+
+static bool parseHex(const char *hex, uint8_t *out, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned int value;
+        if (sscanf(&hex[2 * i], "%2x", &value) != 1)
+        {
+            return false;
+        }
+        out[i] = value;
+    }
+    return true;
+}
+
+static bool addDevice(LoRaWanP2P *loRaWAN, const char *arg, uint8_t id)
+{
+    uint8_t devAddr[4];
+    uint8_t nwkSKey[16];
+    uint8_t appSKey[16];
+
+    if (strlen(arg) != 8 + 1 + 32 + 1 + 32 || arg[8] != ':' || arg[41] != ':' ||
+        !parseHex(&arg[0], devAddr, 4) || !parseHex(&arg[9], nwkSKey, 16) || !parseHex(&arg[42], appSKey, 16))
+    {
+        return false;
+    }
+
+    return loRaWAN->addDevice(devAddr, nwkSKey, appSKey, id) != NULL;
+}
+
+static void resetDevices(LoRaWanP2P *loRaWAN)
+{
+    for (uint16_t i = 0; i < loRaWAN->devices.count(); i++)
+    {
+        LoRaWanDevice *device = loRaWAN->devices.get(i);
+        device->fCntUp = 0;
+        device->fCntDown = 0;
+        device->allowFCntReset = true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static LoRaWanP2P loRaWAN;
+    std::vector<struct_capture_record> records;
+    const char *path = NULL;
+    uint32_t rounds = 100;
+    uint8_t id = 0;
+
+    loRaWAN.OTAAEnabled = false;
+    loRaWAN.dedup.expiry = 0; // Frames replay faster than they were received
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            rounds = atoi(argv[++i]);
+        }
+        else if (!path)
+        {
+            path = argv[i];
+        }
+        else if (!addDevice(&loRaWAN, argv[i], id++))
+        {
+            fprintf(stderr, "Invalid device %s, expected <devAddr>:<nwkSKey>:<appSKey>\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (!path)
+    {
+        fprintf(stderr, "Usage: %s <capture log> <devAddr>:<nwkSKey>:<appSKey> [...] [-n rounds]\n", argv[0]);
+        return 2;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        return 2;
+    }
+
+    char line[512];
+    size_t prefixLength = strlen(CAPTURE_LINE_PREFIX);
+    while (fgets(line, sizeof(line), file))
+    {
+        const char *start = strstr(line, CAPTURE_LINE_PREFIX);
+        struct_capture_record record;
+        if (start && parseHex(start + prefixLength, (uint8_t *)&record, sizeof(record)) && record.length <= CAPTURE_MAX_FRAME)
+        {
+            records.push_back(record);
+        }
+    }
+    fclose(file);
+
+    printf("%zu frames, %u devices\n", records.size(), loRaWAN.devices.count());
+    if (records.empty())
+    {
+        return 0;
+    }
+
+    // Regression check
+    uint32_t mismatches = 0;
+    uint8_t buf[CAPTURE_MAX_FRAME];
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        struct_capture_record *record = &records[i];
+        memcpy(buf, record->frame, record->length);
+
+        LoRaWanResult result = loRaWAN.parseMessage(buf, record->length, record->rssi, record->snr);
+        if (result != record->outcome)
+        {
+            mismatches++;
+            printf("#%u at %ums, rssi %d, snr %.2f: recorded %s, replayed %s\n",
+                   record->sequence, record->time, record->rssi, record->snr / 4.0,
+                   resultName(record->outcome), resultName(result));
+        }
+    }
+    printf("%u of %zu outcomes differ\n", mismatches, records.size());
+
+    // Throughput
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < rounds; round++)
+    {
+        resetDevices(&loRaWAN);
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            memcpy(buf, records[i].frame, records[i].length);
+            loRaWAN.parseMessage(buf, records[i].length, records[i].rssi, records[i].snr);
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    double frames = (double)rounds * records.size();
+    printf("%.0f frames/s, %.0f ns/frame\n", frames * 1e9 / ns, ns / frames);
+
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+#include "RelayScheduler.h"
+
+bool RelayScheduler::trigger(const RelayPattern *pattern)
+{
+    if (_count > 0)
+    {
+        Entry *last = &_queue[(_head + _count - 1) % (RELAY_QUEUE_SIZE + 1)];
+        if (last->pattern == pattern)
+        {
+            // While on, the cycle playing counts as one of the new cycles
+            uint8_t cycles = pattern->cycles;
+            if (_count == 1 && _started && !_on)
+            {
+                cycles++;
+            }
+            if (last->cycles < cycles)
+            {
+                last->cycles = cycles;
+            }
+            merged++;
+            return true;
+        }
+    }
+
+    if (_count > RELAY_QUEUE_SIZE)
+    {
+        dropped++;
+        return false;
+    }
+
+    Entry *entry = &_queue[(_head + _count) % (RELAY_QUEUE_SIZE + 1)];
+    entry->pattern = pattern;
+    entry->cycles = pattern->cycles;
+    _count++;
+    return true;
+}
+
+bool RelayScheduler::update(uint32_t now)
+{
+    while (_count > 0)
+    {
+        Entry *entry = &_queue[_head];
+
+        if (!_started)
+        {
+            _started = true;
+            _on = true;
+            _phaseStart = now;
+            played++;
+        }
+
+        uint32_t phase = _on ? entry->pattern->onTime : entry->pattern->offTime;
+        if (now - _phaseStart < phase)
+        {
+            return _on;
+        }
+
+        // Next phase starts where the previous one should have ended, so
+        // a late update() does not stretch the pattern
+        _phaseStart += phase;
+        if (_on)
+        {
+            _on = false;
+            continue;
+        }
+
+        if (--entry->cycles > 0)
+        {
+            _on = true;
+            continue;
+        }
+
+        // Pattern done, start the next one right away
+        _head = (_head + 1) % (RELAY_QUEUE_SIZE + 1);
+        _count--;
+        _started = false;
+    }
+
+    return false;
+}
@@ -0,0 +1,51 @@
+#ifndef RELAYSCHEDULER_H
+#define RELAYSCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RELAY_QUEUE_SIZE 4 // Patterns waiting behind the one that plays
+
+// Switch the relay on for onTime ms, then off for offTime ms, cycles times.
+typedef struct RelayPattern
+{
+    uint16_t onTime;
+    uint16_t offTime;
+    uint8_t cycles;
+} RelayPattern;
+
+// Plays relay patterns one after the other without blocking. update() is
+// called every loop and returns the state the relay should be in.
+class RelayScheduler
+{
+public:
+    uint32_t played = 0;  // Patterns started
+    uint32_t merged = 0;  // Triggers that extended a pattern already queued
+    uint32_t dropped = 0; // Triggers lost because the queue was full
+
+    // Queue pattern. If the same pattern is playing or last in the queue it
+    // is extended to play all its cycles from now on instead.
+    // Returns false if the trigger was dropped.
+    bool trigger(const RelayPattern *pattern);
+
+    bool update(uint32_t now);
+    bool active() { return _count > 0; }
+
+private:
+    struct Entry
+    {
+        const RelayPattern *pattern;
+        uint8_t cycles; // Cycles left, including the one playing
+    };
+
+    Entry _queue[RELAY_QUEUE_SIZE + 1];
+    uint8_t _head = 0;  // Entry that plays
+    uint8_t _count = 0; // Entries in the queue, including the one playing
+    bool _started = false;
+    bool _on = false;
+    uint32_t _phaseStart = 0;
+};
+
+#else
+#error "RELAYSCHEDULER_H not defined"
+#endif
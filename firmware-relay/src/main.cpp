@@ -1,6 +1,9 @@
 // Network
 #include <ESP8266WiFi.h>
 #include <espnow.h>
+#include "encryption.h"
+#include "DoorLink.h"
+#include "RelayScheduler.h"
 
 // Board pins
 #define RELAY_PIN 12
@@ -10,16 +13,30 @@
 // MAC Address
 uint8_t broadcastAddress[] = {0xF4, 0xCF, 0xA2, 0x16, 0x47, 0x4D};
 
-// Structure of the data send over the wifi.
+// Door events sent by the light, see DoorLink.h
+uint8_t linkKey[16] = {0x20, 0xe4, 0x33, 0xb6, 0x6f, 0xa1, 0xcd, 0x5f, 0xba, 0xa5, 0x38, 0x85, 0x0a, 0xe3, 0xc6, 0x4b}; // Same as the light
+#define RELAY_ID 0x80 // Sender id of the acks of this relay
+
+AES_Context linkContext;
+DoorLink doorLink;
+
 typedef struct struct_message
 {
-  unsigned int batteryVoltage;
-  bool doorOpened;
+  uint8_t mac[6];
+  uint8_t length;
+  uint8_t data[DOORLINK_MAX_FRAME];
 } struct_message;
 
-// Create a struct_message to store data
-struct_message message;
-bool newDataAvailable = false;
+// Messages received over ESP-NOW, handled in loop()
+#define MESSAGE_QUEUE_SIZE 4 // Must be a power of 2
+struct_message messages[MESSAGE_QUEUE_SIZE];
+volatile uint8_t messageHead = 0;
+volatile uint8_t messageTail = 0;
+uint32_t droppedMessages = 0;
+
+// Relay output
+const RelayPattern doorPattern = {1000, 1000, 3}; // 3 times 1s on, 1s off
+RelayScheduler relay;
 
 /*
  *  Setup scripts
@@ -49,7 +66,7 @@ void setupWifi() {
 
   // Once ESPNow is successfully Init, we will register for recv CB to
   // get recv packer info4
-  esp_now_set_self_role(ESP_NOW_ROLE_SLAVE);
+  esp_now_set_self_role(ESP_NOW_ROLE_COMBO); // Receive events, send acks
   esp_now_register_recv_cb(OnDataRecv);
 }
 
@@ -57,6 +74,10 @@ void setup()
 {
   Serial.begin(115200);
   setupPins();
+
+  AES_Setup(&linkContext, linkKey);
+  doorLink.begin(&linkContext, RELAY_ID, false);
+
   setupWifi();
 }
 
@@ -76,13 +97,7 @@ void powerOff()
 
 void blink()
 {
-  for (int i = 0; i < 3; i++)
-  {
-    powerOn();
-    delay(1000);
-    powerOff();
-    delay(1000);
-  }
+  relay.trigger(&doorPattern);
 }
 
 /*
@@ -115,13 +130,64 @@ void loopLocalButton()
 
 void loopRemoteData()
 {
-  if (newDataAvailable)
+  while (messageTail != messageHead)
   {
-    if (message.doorOpened)
+    struct_message *message = &messages[messageTail & (MESSAGE_QUEUE_SIZE - 1)];
+    DoorLinkFrame frame;
+    DoorLinkResult result = doorLink.parse(message->data, message->length, &frame);
+
+    if ((result == DOORLINK_RECEIVED || result == DOORLINK_DUPLICATE) && (frame.header->flags & DOORLINK_FLAG_ACK))
     {
-      blink();
+      // Also ack duplicates, the previous ack was lost
+      uint8_t ack[DOORLINK_MAX_FRAME];
+      uint8_t length = doorLink.ack(&frame, ack);
+      if (!esp_now_is_peer_exist(message->mac))
+      {
+        esp_now_add_peer(message->mac, ESP_NOW_ROLE_COMBO, 1, NULL, 0);
+      }
+      esp_now_send(message->mac, ack, length);
     }
-    newDataAvailable = false;
+
+    if (result == DOORLINK_RECEIVED)
+    {
+      for (uint8_t i = 0; i < frame.header->count; i++)
+      {
+        if (frame.events[i].event == DOORLINK_EVENT_OPENED)
+        {
+          blink();
+        }
+      }
+    }
+    messageTail++;
+  }
+}
+
+void loopRelay()
+{
+  static bool prevOn = false;
+
+  bool on = relay.update(millis());
+  if (on != prevOn)
+  {
+    on ? powerOn() : powerOff();
+    prevOn = on;
+  }
+}
+
+void loopSerial()
+{
+  if (Serial.available() && Serial.read() == 's')
+  {
+    Serial.print("Patterns played/merged/dropped: ");
+    Serial.print(relay.played);
+    Serial.print("/");
+    Serial.print(relay.merged);
+    Serial.print("/");
+    Serial.println(relay.dropped);
+    Serial.print("Messages dropped/invalid: ");
+    Serial.print(droppedMessages);
+    Serial.print("/");
+    Serial.println(doorLink.invalid);
   }
 }
 
@@ -129,6 +195,8 @@ void loop()
 {
   loopLocalButton();
   loopRemoteData();
+  loopRelay();
+  loopSerial();
 }
 
 /*
@@ -136,6 +204,15 @@ void loop()
  */
 void OnDataRecv(uint8_t *mac, uint8_t *incomingData, uint8_t len)
 {
-  memcpy(&message, incomingData, sizeof(message));
-  newDataAvailable = true;
+  if (len > DOORLINK_MAX_FRAME || (uint8_t)(messageHead - messageTail) >= MESSAGE_QUEUE_SIZE)
+  {
+    droppedMessages++;
+    return;
+  }
+
+  struct_message *message = &messages[messageHead & (MESSAGE_QUEUE_SIZE - 1)];
+  memcpy(message->mac, mac, 6);
+  memcpy(message->data, incomingData, len);
+  message->length = len;
+  messageHead++;
 }
\ No newline at end of file
@@ -0,0 +1,186 @@
+#include "DoorLink.h"
+#include "encryption.h"
+#include <string.h>
+
+void DoorLink::begin(AES_Context *ctx, uint8_t sender, bool ack)
+{
+    _ctx = ctx;
+    _sender = sender;
+    _ack = ack;
+}
+
+bool DoorLink::add(uint8_t device, uint8_t event, uint16_t battery, int16_t rssi)
+{
+    if (_batchCount >= DOORLINK_MAX_EVENTS)
+    {
+        dropped++;
+        return false;
+    }
+
+    DoorLinkEvent *e = &_batch[_batchCount++];
+    e->device = device;
+    e->event = event;
+    e->battery = battery;
+    e->rssi = rssi < -128 ? -128 : (rssi > 127 ? 127 : rssi);
+    return true;
+}
+
+uint8_t DoorLink::poll(uint32_t now, uint8_t *buffer)
+{
+    if (_inFlight)
+    {
+        if (now - _sentAt < DOORLINK_RETRY_INTERVAL)
+        {
+            return 0;
+        }
+
+        if (_retries < DOORLINK_MAX_RETRIES)
+        {
+            _retries++;
+            retransmits++;
+            _sentAt = now;
+            memcpy(buffer, _frame, _frameLength);
+            return _frameLength;
+        }
+
+        // Give up, go on with the next batch
+        _inFlight = false;
+        failed++;
+    }
+
+    if (_batchCount == 0)
+    {
+        return 0;
+    }
+
+    _frameLength = _build(_frame, DOORLINK_EVENTS, _ack ? DOORLINK_FLAG_ACK : 0, _sequence++,
+                          _batchCount, _batch, _batchCount * sizeof(DoorLinkEvent));
+    _batchCount = 0;
+    sent++;
+
+    if (_ack)
+    {
+        _inFlight = true;
+        _retries = 0;
+        _sentAt = now;
+    }
+
+    memcpy(buffer, _frame, _frameLength);
+    return _frameLength;
+}
+
+DoorLinkResult DoorLink::parse(uint8_t *buffer, uint8_t length, DoorLinkFrame *frame)
+{
+    const DoorLinkHeader *header = (const DoorLinkHeader *)buffer;
+
+    if (length < sizeof(DoorLinkHeader) + DOORLINK_MIC_SIZE)
+    {
+        invalid++;
+        return DOORLINK_MALFORMED;
+    }
+
+    // A claim has no events, but a body of its own
+    size_t body = header->type == DOORLINK_CLAIM ? sizeof(DoorLinkClaim) : header->count * sizeof(DoorLinkEvent);
+    if (header->version != DOORLINK_VERSION || header->count > DOORLINK_MAX_EVENTS ||
+        (header->type == DOORLINK_CLAIM && header->count != 0) ||
+        length != sizeof(DoorLinkHeader) + body + DOORLINK_MIC_SIZE)
+    {
+        invalid++;
+        return DOORLINK_MALFORMED;
+    }
+
+    uint8_t mic[16];
+    AES_CMAC(buffer, length - DOORLINK_MIC_SIZE, mic, _ctx);
+    if (memcmp(mic, &buffer[length - DOORLINK_MIC_SIZE], DOORLINK_MIC_SIZE) != 0)
+    {
+        invalid++;
+        return DOORLINK_INVALID_MIC;
+    }
+
+    frame->header = header;
+    frame->events = (const DoorLinkEvent *)&buffer[sizeof(DoorLinkHeader)];
+    frame->claim = NULL;
+
+    if (header->type == DOORLINK_CLAIM)
+    {
+        frame->claim = (const DoorLinkClaim *)&buffer[sizeof(DoorLinkHeader)];
+        return DOORLINK_CLAIMED;
+    }
+
+    if (header->type == DOORLINK_ACK)
+    {
+        // The sequence of the frame in flight is the one before _sequence
+        if (_inFlight && header->sequence == (uint16_t)(_sequence - 1))
+        {
+            _inFlight = false;
+            return DOORLINK_ACKED;
+        }
+        return DOORLINK_IGNORED;
+    }
+
+    if (header->type != DOORLINK_EVENTS)
+    {
+        return DOORLINK_IGNORED;
+    }
+
+    // Only a repeat of the last sequence is a duplicate, so a sender that
+    // restarts its sequence after a reboot is still heard.
+    Peer *peer = NULL;
+    for (uint8_t i = 0; i < DOORLINK_SENDERS; i++)
+    {
+        if (_peers[i].valid && _peers[i].sender == header->sender)
+        {
+            peer = &_peers[i];
+            break;
+        }
+    }
+
+    if (!peer)
+    {
+        peer = &_peers[_nextPeer];
+        _nextPeer = (_nextPeer + 1) % DOORLINK_SENDERS;
+        peer->valid = true;
+        peer->sender = header->sender;
+    }
+    else if (peer->sequence == header->sequence)
+    {
+        return DOORLINK_DUPLICATE;
+    }
+
+    peer->sequence = header->sequence;
+    return DOORLINK_RECEIVED;
+}
+
+uint8_t DoorLink::ack(const DoorLinkFrame *frame, uint8_t *buffer)
+{
+    return _build(buffer, DOORLINK_ACK, 0, frame->header->sequence, 0, NULL, 0);
+}
+
+uint8_t DoorLink::claim(const DoorLinkClaim *claim, uint8_t *buffer)
+{
+    // Not acked, and the sequence of the events is left alone
+    return _build(buffer, DOORLINK_CLAIM, 0, 0, 0, claim, sizeof(DoorLinkClaim));
+}
+
+uint8_t DoorLink::_build(uint8_t *buffer, uint8_t type, uint8_t flags, uint16_t sequence, uint8_t count, const void *body, uint8_t bodyLength)
+{
+    DoorLinkHeader *header = (DoorLinkHeader *)buffer;
+    header->version = DOORLINK_VERSION;
+    header->type = type;
+    header->flags = flags;
+    header->sender = _sender;
+    header->sequence = sequence;
+    header->count = count;
+
+    uint8_t length = sizeof(DoorLinkHeader);
+    if (bodyLength)
+    {
+        memcpy(&buffer[length], body, bodyLength);
+        length += bodyLength;
+    }
+
+    uint8_t mic[16];
+    AES_CMAC(buffer, length, mic, _ctx);
+    memcpy(&buffer[length], mic, DOORLINK_MIC_SIZE);
+    return length + DOORLINK_MIC_SIZE;
+}
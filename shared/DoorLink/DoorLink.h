@@ -0,0 +1,159 @@
+//
+//  DoorLink.h
+//  Wire format of the ESP-NOW messages between the light and the relay.
+//
+//  A frame is a header, count events and a MIC, all little endian:
+//
+//    version(1) type(1) flags(1) sender(1) sequence(2) count(1)
+//    count x [device(1) event(1) battery(2) rssi(1)]
+//    mic(4)   First 4 bytes of the AES-CMAC of everything before it
+//
+//  An ack is a frame of type DOORLINK_ACK without events, carrying the
+//  sequence number of the frame it acknowledges.
+//
+//  A claim is a frame of type DOORLINK_CLAIM without events, broadcast from
+//  one light to the others when it wants to answer an uplink:
+//
+//    header(7, count 0) devAddr(4) fCnt(2) rssi(2) mic(4)
+//
+
+#ifndef DOORLINK_H
+#define DOORLINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct AES_Context; // See encryption.h
+
+#define DOORLINK_VERSION 1
+#define DOORLINK_MAX_EVENTS 16    // Events per frame
+#define DOORLINK_MIC_SIZE 4
+#define DOORLINK_RETRY_INTERVAL 30 // ms to wait for an ack before sending again
+#define DOORLINK_MAX_RETRIES 3
+#define DOORLINK_SENDERS 4 // Senders the receiver tracks sequence numbers of
+
+enum DoorLinkType : uint8_t
+{
+    DOORLINK_EVENTS = 1,
+    DOORLINK_ACK = 2,
+    DOORLINK_CLAIM = 3, // Between lights, see Arbiter.h of the light
+};
+
+#define DOORLINK_FLAG_ACK 0x01 // The sender wants an ack
+
+enum DoorLinkEventType : uint8_t
+{
+    DOORLINK_EVENT_CLOSED = 0,
+    DOORLINK_EVENT_OPENED = 1,
+};
+
+enum DoorLinkResult : uint8_t
+{
+    DOORLINK_RECEIVED = 0, // New events, in frame
+    DOORLINK_DUPLICATE,    // Retransmit of the last frame of this sender, ack it again
+    DOORLINK_ACKED,        // Ack of the frame in flight
+    DOORLINK_MALFORMED,
+    DOORLINK_INVALID_MIC,
+    DOORLINK_IGNORED, // Valid, but nothing to do
+    DOORLINK_CLAIMED, // Claim of another light, in frame
+};
+
+typedef struct __attribute__((packed)) DoorLinkHeader
+{
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint8_t sender;
+    uint16_t sequence;
+    uint8_t count;
+} DoorLinkHeader;
+
+typedef struct __attribute__((packed)) DoorLinkEvent
+{
+    uint8_t device;   // Door id
+    uint8_t event;    // DoorLinkEventType
+    uint16_t battery; // mV
+    int8_t rssi;      // dBm of the LoRa frame
+} DoorLinkEvent;
+
+typedef struct __attribute__((packed)) DoorLinkClaim
+{
+    uint8_t devAddr[4]; // As in the uplink, least significant byte first
+    uint16_t fCnt;      // As in the uplink, the lower 16 bits
+    int16_t rssi;       // dBm the light received the uplink with
+} DoorLinkClaim;
+
+#define DOORLINK_MAX_FRAME (sizeof(DoorLinkHeader) + DOORLINK_MAX_EVENTS * sizeof(DoorLinkEvent) + DOORLINK_MIC_SIZE)
+
+// Parsed frame. events points into the received buffer.
+typedef struct DoorLinkFrame
+{
+    const DoorLinkHeader *header;
+    const DoorLinkEvent *events;
+    const DoorLinkClaim *claim; // Only for DOORLINK_CLAIMED
+} DoorLinkFrame;
+
+// Both ends of the link. The sender batches events added in between two
+// polls into one frame and, if acks are enabled, keeps sending it until it
+// is acked or DOORLINK_MAX_RETRIES is reached. One frame is in flight at a
+// time, events added meanwhile wait for the next one.
+class DoorLink
+{
+public:
+    uint32_t sent = 0;
+    uint32_t retransmits = 0;
+    uint32_t failed = 0;  // Frames never acked
+    uint32_t dropped = 0; // Events that did not fit in the batch
+    uint32_t invalid = 0; // Received frames that were malformed or had an invalid MIC
+
+    // ctx holds the link key shared by all lights and relays, see AES_Setup().
+    void begin(AES_Context *ctx, uint8_t sender, bool ack);
+
+    // Sender
+    bool add(uint8_t device, uint8_t event, uint16_t battery, int16_t rssi);
+
+    // Returns the length of the frame written to buffer that has to be sent
+    // now, or 0 if there is nothing to send. buffer holds DOORLINK_MAX_FRAME.
+    uint8_t poll(uint32_t now, uint8_t *buffer);
+    bool idle() { return !_inFlight && _batchCount == 0; }
+
+    // Receiver
+    DoorLinkResult parse(uint8_t *buffer, uint8_t length, DoorLinkFrame *frame);
+
+    // Write the ack of a received frame to buffer, returns its length.
+    uint8_t ack(const DoorLinkFrame *frame, uint8_t *buffer);
+
+    // Write a claim to buffer, returns its length. Broadcast to the other lights.
+    uint8_t claim(const DoorLinkClaim *claim, uint8_t *buffer);
+
+private:
+    AES_Context *_ctx = NULL;
+    uint8_t _sender = 0;
+    bool _ack = false;
+    uint16_t _sequence = 0;
+
+    DoorLinkEvent _batch[DOORLINK_MAX_EVENTS];
+    uint8_t _batchCount = 0;
+
+    uint8_t _frame[DOORLINK_MAX_FRAME];
+    uint8_t _frameLength = 0;
+    bool _inFlight = false;
+    uint8_t _retries = 0;
+    uint32_t _sentAt = 0;
+
+    struct Peer
+    {
+        bool valid;
+        uint8_t sender;
+        uint16_t sequence; // Last sequence received
+    };
+    Peer _peers[DOORLINK_SENDERS] = {};
+    uint8_t _nextPeer = 0;
+
+    uint8_t _build(uint8_t *buffer, uint8_t type, uint8_t flags, uint16_t sequence, uint8_t count, const void *body, uint8_t bodyLength);
+};
+
+#else
+#error "DOORLINK_H not defined"
+#endif
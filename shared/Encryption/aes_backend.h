@@ -0,0 +1,76 @@
+//
+//  aes_backend.h
+//  lorawan
+//
+//  AES-128 block cipher backends used by encryption.cpp. All backends expose
+//  the same setKey / encryptBlock / decryptBlock interface, the one used in
+//  the firmware is selected at compile time with AES_BACKEND:
+//
+//    AES_BACKEND_TINY    rweather AESTiny128. Smallest RAM footprint, the
+//                        round keys are recomputed for every block.
+//    AES_BACKEND_FULL    rweather AES128. Keeps the 176 byte key schedule.
+//    AES_BACKEND_TTABLE  32-bit T-table implementation. Fastest; on the
+//                        ESP8266 the block functions are placed in IRAM.
+//
+
+#ifndef AES_BACKEND_H
+#define AES_BACKEND_H
+
+#include <stdint.h>
+#include <AES.h>
+
+#define AES_BACKEND_TINY 0
+#define AES_BACKEND_FULL 1
+#define AES_BACKEND_TTABLE 2
+
+#ifndef AES_BACKEND
+#define AES_BACKEND AES_BACKEND_TTABLE
+#endif
+
+class AESBackendTiny
+{
+public:
+    void setKey(const uint8_t *key);
+    void encryptBlock(uint8_t *output, const uint8_t *input);
+    void decryptBlock(uint8_t *output, const uint8_t *input);
+
+private:
+    AESTiny128 _aes;
+    uint8_t _key[16]; // AESTiny128 cannot decrypt, keep the key for the rare join accept
+};
+
+class AESBackendFull
+{
+public:
+    void setKey(const uint8_t *key);
+    void encryptBlock(uint8_t *output, const uint8_t *input);
+    void decryptBlock(uint8_t *output, const uint8_t *input);
+
+private:
+    AES128 _aes;
+};
+
+class AESBackendTTable
+{
+public:
+    void setKey(const uint8_t *key);
+    void encryptBlock(uint8_t *output, const uint8_t *input);
+    void decryptBlock(uint8_t *output, const uint8_t *input);
+
+private:
+    uint32_t _roundKeys[44];
+};
+
+#if AES_BACKEND == AES_BACKEND_TINY
+typedef AESBackendTiny AESBackend;
+#elif AES_BACKEND == AES_BACKEND_FULL
+typedef AESBackendFull AESBackend;
+#elif AES_BACKEND == AES_BACKEND_TTABLE
+typedef AESBackendTTable AESBackend;
+#else
+#error "Unknown AES_BACKEND"
+#endif
+
+#else
+#error "AES_BACKEND_H not defined"
+#endif
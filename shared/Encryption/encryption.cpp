@@ -39,36 +39,76 @@
 // ----------------------------------------------------------------------------
 
 #include "encryption.h"
-#include <AES.h>
 #include <string.h>
 
-void AES_Encrypt(uint8_t* data, uint8_t* key) {
-    AESTiny128 aes;
+void generate_subkey(AES_Context *ctx);
 
+// ----------------------------------------------------------------------------
+// AES_Setup
+// Expand the key once and derive the CMAC subkeys k1 and k2, so that the
+// encrypt, decrypt and CMAC functions below never touch the raw key again.
+// ----------------------------------------------------------------------------
+void AES_Setup(AES_Context *ctx, uint8_t *key) {
+    ctx->aes.setKey(key);
+    generate_subkey(ctx);
+}
+
+void AES_Encrypt(uint8_t* data, AES_Context *ctx) {
     uint8_t result[16];
 
-    aes.setKey(key, 16);
-    aes.encryptBlock(&result[0], data);
+    ctx->aes.encryptBlock(&result[0], data);
 
     for(int i=0; i<16; i++) {
         data[i]=result[i];
     }    
 } 
 
-void AES_Decrypt(uint8_t* data, uint8_t* key) {
-    AES128 aes;
-
+void AES_Decrypt(uint8_t* data, AES_Context *ctx) {
     uint8_t result[16];
 
-    aes.setKey(key, 16);
-    aes.decryptBlock(&result[0], data);
+    ctx->aes.decryptBlock(&result[0], data);
     
     for(int i=0; i<16; i++) {
         data[i]=result[i];
     }    
 } 
 
-uint8_t encodePacket(uint8_t *Data, uint8_t DataLength, uint32_t FrameCount, uint8_t *DevAddr, uint8_t *AppSKey, uint8_t Direction)
+// ----------------------------------------------------------------------------
+// AES_Keystream
+// Compute keystream block S_i = aes128_encrypt(K, A_i) of a frame. Index
+// starts at 1. Split from encodePacket() so the keystream of an expected
+// frame can be computed ahead of time.
+// ----------------------------------------------------------------------------
+void AES_Keystream(uint8_t *Block_A, uint32_t FrameCount, uint8_t *DevAddr, AES_Context *ctx, uint8_t Direction, uint8_t Index)
+{
+    Block_A[0] = 0x01;
+    
+    Block_A[1] = 0x00;
+    Block_A[2] = 0x00;
+    Block_A[3] = 0x00;
+    Block_A[4] = 0x00;
+
+    Block_A[5] = Direction;                // 0 is uplink
+
+    Block_A[6] = DevAddr[3];            // Only works for and with ABP
+    Block_A[7] = DevAddr[2];
+    Block_A[8] = DevAddr[1];
+    Block_A[9] = DevAddr[0];
+
+    Block_A[10] = (FrameCount & 0x000000FF); // 4 byte FCNT
+    Block_A[11] = ((FrameCount >> 8) & 0x000000FF);
+    Block_A[12] = ((FrameCount >> 16) & 0x000000FF);
+    Block_A[13] = ((FrameCount >> 24) & 0x000000FF);
+
+    Block_A[14] = 0x00;
+
+    Block_A[15] = Index;
+
+    // Encrypt and calculate the S
+    AES_Encrypt(Block_A, ctx);
+}
+
+uint8_t encodePacket(uint8_t *Data, uint8_t DataLength, uint32_t FrameCount, uint8_t *DevAddr, AES_Context *ctx, uint8_t Direction)
 {
     uint8_t i, j;
     uint8_t Block_A[16];
@@ -79,31 +119,7 @@ uint8_t encodePacket(uint8_t *Data, uint8_t DataLength, uint32_t FrameCount, uin
     if (restLength>0) numBlocks++;            // And add block for the rest if any
 
     for(i = 1; i <= numBlocks; i++) {
-        Block_A[0] = 0x01;
-        
-        Block_A[1] = 0x00;
-        Block_A[2] = 0x00;
-        Block_A[3] = 0x00;
-        Block_A[4] = 0x00;
-
-        Block_A[5] = Direction;                // 0 is uplink
-
-        Block_A[6] = DevAddr[3];            // Only works for and with ABP
-        Block_A[7] = DevAddr[2];
-        Block_A[8] = DevAddr[1];
-        Block_A[9] = DevAddr[0];
-
-        Block_A[10] = (FrameCount & 0x000000FF); // 4 byte FCNT
-        Block_A[11] = ((FrameCount >> 8) & 0x000000FF);
-        Block_A[12] = ((FrameCount >> 16) & 0x000000FF);
-        Block_A[13] = ((FrameCount >> 24) & 0x000000FF);
-
-        Block_A[14] = 0x00;
-
-        Block_A[15] = i;
-
-        // Encrypt and calculate the S
-        AES_Encrypt(Block_A, AppSKey);
+        AES_Keystream(Block_A, FrameCount, DevAddr, ctx, Direction, i);
         
         // Last block? set bLen to rest
         if ((i == numBlocks) && (restLength>0)) bLen = restLength;
@@ -152,14 +168,17 @@ void shift_left(uint8_t * buf, uint8_t len)
 // ----------------------------------------------------------------------------
 // generate_subkey
 // RFC 4493, para 2.3
+// Only called from AES_Setup(), the subkeys are stored in the context.
 // -----------------------------------------------------------------------------
-void generate_subkey(uint8_t *key, uint8_t *k1, uint8_t *k2)
+void generate_subkey(AES_Context *ctx)
 {
+    uint8_t *k1 = ctx->k1;
+    uint8_t *k2 = ctx->k2;
 
     memset(k1, 0, 16);                                // Fill subkey1 with 0x00
     
     // Step 1: Assume k1 is an all zero block
-    AES_Encrypt(k1,key);
+    AES_Encrypt(k1,ctx);
     
     // Step 2: Analyse outcome of Encrypt operation (in k1), generate k1
     if (k1[0] & 0x80) {
@@ -185,29 +204,35 @@ void generate_subkey(uint8_t *key, uint8_t *k1, uint8_t *k2)
     return;
 }
 
-void AES_CMAC(uint8_t *data, uint8_t len, uint8_t *result, uint8_t * key)
+void AES_CMAC(uint8_t *data, uint8_t len, uint8_t *result, AES_Context *ctx)
+{
+    AES_CMAC_B0(NULL, data, len, result, ctx);
+}
+
+// ----------------------------------------------------------------------------
+// AES_CMAC_B0
+// CMAC of B0 | data, read directly from both buffers without copying them
+// into one. LoRaWAN data frames prefix the MIC input with a B0 block. As B0
+// is always a whole block, it is simply the first block of the chain.
+// B0 may be NULL. If B0 is given, data may not be empty.
+// ----------------------------------------------------------------------------
+void AES_CMAC_B0(uint8_t *B0, uint8_t *data, uint8_t len, uint8_t *result, AES_Context *ctx)
 {
     uint8_t X[16];
     uint8_t Y[16];
     
     // ------------------------------------
-    // Step 1: Generate the subkeys
-    //
-    uint8_t k1[16];
-    uint8_t k2[16];
-    generate_subkey(key, k1, k2);
-    
-    // ------------------------------------
-    // Copy the data to a new buffer
+    // Step 1: The subkeys were generated by AES_Setup()
     //
-    uint8_t micBuf[len];                    // data
-    for (uint8_t i=0; i<len; i++) micBuf[i]=data[i];
+    uint8_t *k1 = ctx->k1;
+    uint8_t *k2 = ctx->k2;
     
     // ------------------------------------
     // Step 2: Calculate the number of blocks for CMAC
     //
     uint8_t numBlocks = len/16;            // Compensate for B0 block
     if ((len % 16)!=0) numBlocks++;            // If we have only a part block, take it all
+    if (numBlocks == 0) numBlocks = 1;          // An empty message is one padded block
     
     // ------------------------------------
     // Step 3: Calculate padding is necessary
@@ -219,14 +244,19 @@ void AES_CMAC(uint8_t *data, uint8_t len, uint8_t *result, uint8_t * key)
     // Step 5: Make a buffer of zeros
     //
     memset(X, 0, 16);
+
+    if (B0) {
+        for (uint8_t j=0; j<16; j++) X[j] = B0[j];
+        AES_Encrypt(X, ctx);
+    }
     
     // ------------------------------------
     // Step 6: Do the actual encoding according to RFC
     //
     for(uint8_t i= 0x0; i < (numBlocks - 1); i++) {
-        for (uint8_t j=0; j<16; j++) Y[j] = micBuf[(i*16)+j];
+        for (uint8_t j=0; j<16; j++) Y[j] = data[(i*16)+j];
         mXor(Y, X);
-        AES_Encrypt(Y, key);
+        AES_Encrypt(Y, ctx);
         for (uint8_t j=0; j<16; j++) X[j] = Y[j];
     }
     
@@ -236,9 +266,9 @@ void AES_CMAC(uint8_t *data, uint8_t len, uint8_t *result, uint8_t * key)
     // Last block. We move step 4 to the end as we need Y
     // to compute the last block
     //
-    if (restBits) {
+    if (restBits || len == 0) {
         for (uint8_t i=0; i<16; i++) {
-            if (i< restBits) Y[i] = micBuf[((numBlocks-1)*16)+i];
+            if (i< restBits) Y[i] = data[((numBlocks-1)*16)+i];
             if (i==restBits) Y[i] = 0x80;
             if (i> restBits) Y[i] = 0x00;
         }
@@ -246,12 +276,12 @@ void AES_CMAC(uint8_t *data, uint8_t len, uint8_t *result, uint8_t * key)
     }
     else {
         for (uint8_t i=0; i<16; i++) {
-            Y[i] = micBuf[((numBlocks-1)*16)+i];
+            Y[i] = data[((numBlocks-1)*16)+i];
         }
         mXor(Y, k1);
     }
     mXor(Y, X);
-    AES_Encrypt(Y,key);
+    AES_Encrypt(Y,ctx);
     
     // ------------------------------------
     // Step 7: done, return the MIC size.
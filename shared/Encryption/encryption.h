@@ -9,10 +9,25 @@
 #define ENCRYPTION_H
 
 #include <stdint.h>
-void AES_Encrypt(uint8_t* data, uint8_t* key);
-void AES_Decrypt(uint8_t* data, uint8_t* key);
-uint8_t encodePacket(uint8_t *Data, uint8_t DataLength, uint32_t FrameCount, uint8_t *DevAddr, uint8_t *AppSKey, uint8_t Direction);
-void AES_CMAC(uint8_t *data, uint8_t len, uint8_t *result, uint8_t * AppKey);
+#include "aes_backend.h"
+
+// Expanded round keys and CMAC subkeys (RFC 4493, para 2.3) of a single key.
+// Build it once with AES_Setup() whenever the key changes and reuse it for
+// every block, so the key schedule is not recomputed for each packet.
+typedef struct AES_Context
+{
+    AESBackend aes;
+    uint8_t k1[16];
+    uint8_t k2[16];
+} AES_Context;
+
+void AES_Setup(AES_Context *ctx, uint8_t *key);
+void AES_Encrypt(uint8_t* data, AES_Context *ctx);
+void AES_Decrypt(uint8_t* data, AES_Context *ctx);
+void AES_Keystream(uint8_t *Block_A, uint32_t FrameCount, uint8_t *DevAddr, AES_Context *ctx, uint8_t Direction, uint8_t Index);
+uint8_t encodePacket(uint8_t *Data, uint8_t DataLength, uint32_t FrameCount, uint8_t *DevAddr, AES_Context *ctx, uint8_t Direction);
+void AES_CMAC(uint8_t *data, uint8_t len, uint8_t *result, AES_Context *ctx);
+void AES_CMAC_B0(uint8_t *B0, uint8_t *data, uint8_t len, uint8_t *result, AES_Context *ctx);
 
 #else
 #error "ENCRYPTION_H not defined"